@@ -0,0 +1,310 @@
+// Runs the real server and client loops in one process over a loopback TCP connection, with
+// memory-backed TUN queues standing in for the interfaces, and measures the data path
+// in both directions: packets/s and Gbit/s at the highest rate that loses nothing, what
+// gets through (and what is lost) when the sender saturates the tunnel, and one-way
+// latency at a paced rate inside the loss-free region. Needs no root; run it from
+// tun_interface/ like the vpn binary (certificates are found in ../server_certs and
+// ../client_certs).
+//   usage: loopback_bench [results.json] [packets] [port]
+#include "../server/VPNServer.cpp"
+#include "../client/VPNClient.cpp"
+#include "../tunneling/FrameBatcher.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using namespace std;
+
+static const size_t PACKET_SIZES[] = {64, 256, 512, 1024, 1500};
+// Latency runs send this many packets at this rate (or half the loss-free rate, if that is
+// lower), far below saturation, so the numbers show the cost of the path rather than the
+// depth of its queues
+static const size_t LATENCY_PACKETS = 20000;
+static const int LATENCY_RATE = 20000;
+// Paced runs bisecting for the loss-free rate, each with a quarter of the packets
+static const int SEARCH_STEPS = 6;
+// A packet that has not arrived by then is counted as lost
+static const int RECEIVE_TIMEOUT_MS = 2000;
+
+// Offsets of the run number and send timestamp in the UDP payload
+static const size_t RUN_OFFSET = 28;
+static const size_t TIMESTAMP_OFFSET = 32;
+
+struct Result {
+    const char* direction;
+    size_t size;
+    size_t sent;
+    size_t received;
+    double packetsPerSecond;
+    double gbitPerSecond;
+    double p50, p99, p999;  // Microseconds
+    // The saturating run: packets/s that got through and the share lost
+    double saturatedPacketsPerSecond;
+    double saturatedLoss;
+};
+
+static uint64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Builds an IPv4/UDP packet of `size` bytes; the run number and timestamp are filled in later
+static vector<char> makePacket(size_t size, uint32_t src, uint32_t dst) {
+    vector<char> packet(size, 0);
+    unsigned char* p = reinterpret_cast<unsigned char*>(packet.data());
+    p[0] = 0x45;
+    uint16_t total = htons(size);
+    memcpy(p + 2, &total, 2);
+    p[8] = 64;
+    p[9] = IPPROTO_UDP;
+    memcpy(p + 12, &src, 4);
+    memcpy(p + 16, &dst, 4);
+    uint16_t port = htons(9);
+    memcpy(p + 20, &port, 2);
+    memcpy(p + 22, &port, 2);
+    uint16_t udpLength = htons(size - 20);
+    memcpy(p + 24, &udpLength, 2);
+    return packet;
+}
+
+static double percentile(vector<uint64_t>& sorted, double q) {
+    if (sorted.empty())
+        return 0;
+    size_t i = min(sorted.size() - 1, (size_t)(q * sorted.size()));
+    return sorted[i] / 1000.0;
+}
+
+// Writes `count` packets into one memory TUN queue and reads them back from the other side
+// of the tunnel. rate == 0 sends as fast as the tunnel accepts them.
+static Result measure(const char* direction, int in, int out, size_t size, size_t count, int rate,
+                      uint32_t src, uint32_t dst) {
+    // Stragglers from an earlier run carry an older run number and are ignored
+    static uint32_t runs = 0;
+    uint32_t run = ++runs;
+    Result result = {direction, size, count, 0, 0, 0, 0, 0, 0, 0, 0};
+    vector<uint64_t> latencies;
+    latencies.reserve(count);
+
+    uint64_t start = nowNs();
+    thread sender([&] {
+        vector<char> packet = makePacket(size, src, dst);
+        memcpy(packet.data() + RUN_OFFSET, &run, sizeof(run));
+        for (uint64_t seq = 0; seq < count; seq++) {
+            // Sleep rather than spin, so the paced sender leaves the CPU to the tunnel
+            if (rate > 0)
+                this_thread::sleep_until(chrono::steady_clock::time_point(
+                    chrono::nanoseconds(start + seq * 1000000000ULL / rate)));
+            uint64_t sent = nowNs();
+            memcpy(packet.data() + TIMESTAMP_OFFSET, &sent, sizeof(sent));
+            if (write(in, packet.data(), size) != (ssize_t)size)
+                return;
+        }
+    });
+
+    vector<char> buffer(TunDevice::BUFFER_SIZE);
+    uint64_t last = start;
+    while (result.received < count) {
+        ssize_t n = read(out, buffer.data(), buffer.size());
+        if (n <= 0)
+            break;  // Timed out: the rest was lost
+        uint32_t tag;
+        memcpy(&tag, buffer.data() + RUN_OFFSET, sizeof(tag));
+        if ((size_t)n != size || tag != run)
+            continue;
+        last = nowNs();
+        uint64_t sent;
+        memcpy(&sent, buffer.data() + TIMESTAMP_OFFSET, sizeof(sent));
+        latencies.push_back(last - sent);
+        result.received++;
+    }
+    sender.join();
+
+    double seconds = (last - start) / 1e9;
+    if (seconds > 0) {
+        result.packetsPerSecond = result.received / seconds;
+        result.gbitPerSecond = result.received * size * 8 / seconds / 1e9;
+    }
+    sort(latencies.begin(), latencies.end());
+    result.p50 = percentile(latencies, 0.50);
+    result.p99 = percentile(latencies, 0.99);
+    result.p999 = percentile(latencies, 0.999);
+    return result;
+}
+
+// Bisects for the highest paced rate that delivers every packet (RFC 2544 throughput),
+// starting from what got through a saturating run; returns that rate's run
+static Result measureLossFree(const char* direction, int in, int out, size_t size, size_t count, uint32_t src,
+                              uint32_t dst, double ceiling);
+
+// Waits for the tunnel to go quiet, discarding whatever an earlier run left in flight
+static void drain(int fd) {
+    char buffer[TunDevice::BUFFER_SIZE];
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (poll(&pfd, 1, 100) > 0) {
+        if (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) <= 0)
+            break;
+    }
+}
+
+static Result measureLossFree(const char* direction, int in, int out, size_t size, size_t count, uint32_t src,
+                              uint32_t dst, double ceiling) {
+    Result best = {direction, size, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    double low = 0, high = ceiling;
+    for (int step = 0; step < SEARCH_STEPS; step++) {
+        double rate = step == 0 ? high : (low + high) / 2;
+        Result trial = measure(direction, in, out, size, count, max(1, (int)rate), src, dst);
+        drain(out);
+        if (trial.received == trial.sent) {
+            low = rate;
+            best = trial;
+            if (step == 0)
+                break;  // The saturated goodput itself is clean
+        } else {
+            high = rate;
+        }
+    }
+    return best;
+}
+
+static bool writeResults(const string& path, const vector<Result>& results) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        perror(path.c_str());
+        return false;
+    }
+    fprintf(file, "[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        fprintf(file,
+                "  {\"direction\": \"%s\", \"size\": %zu, \"sent\": %zu, \"received\": %zu, "
+                "\"packets_per_second\": %.0f, \"gbit_per_second\": %.3f, "
+                "\"latency_p50_us\": %.1f, \"latency_p99_us\": %.1f, \"latency_p999_us\": %.1f, "
+                "\"saturated_packets_per_second\": %.0f, \"saturated_loss\": %.4f}%s\n",
+                r.direction, r.size, r.sent, r.received, r.packetsPerSecond, r.gbitPerSecond, r.p50, r.p99, r.p999,
+                r.saturatedPacketsPerSecond, r.saturatedLoss, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "]\n");
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    string output = argc > 1 ? argv[1] : "loopback_bench.json";
+    size_t packets = argc > 2 ? strtoul(argv[2], nullptr, 10) : 200000;
+    int port = argc > 3 ? atoi(argv[3]) : 55990;
+
+    // The side torn down last says goodbye to a closed socket
+    signal(SIGPIPE, SIG_IGN);
+    // Both ends report their setup on cout; keep the table readable
+    streambuf* console = cout.rdbuf(nullptr);
+    Logger::setLevel(Logger::Warn);
+    Logger::start();
+
+    VPNConfig config = {};
+    strcpy(config.ifaceName, "bench");
+    strcpy(config.serverIP, "127.0.0.1");
+    config.port = port;
+    config.batchSize = FrameBatcher::DEFAULT_RECORD_SIZE;
+    config.batchBudgetUsec = 200;
+    config.queues = 1;
+    config.ticketRotation = Tunnel::DEFAULT_TICKET_ROTATION;
+    TunDevice::setMemoryQueues(true);
+
+    config.isServer = true;
+    VPNServer server(config);
+    if (!server.initialize()) {
+        cout.rdbuf(console);
+        fprintf(stderr, "Failed to initialize server\n");
+        Logger::stop();
+        return 1;
+    }
+    thread serverThread([&] { server.run(); });
+
+    // The client's handshake completes while the server loop runs
+    config.isServer = false;
+    VPNClient client(config);
+    if (!client.initialize()) {
+        cout.rdbuf(console);
+        fprintf(stderr, "Failed to initialize client\n");
+        server.stop();
+        serverThread.join();
+        Logger::stop();
+        return 1;
+    }
+    thread clientThread([&] { client.run(); });
+
+    // Downstream packets are routed by the address the server hands out
+    string cidr;
+    for (int i = 0; i < 500 && (cidr = client.getTunDevice().getAddress()).empty(); i++)
+        this_thread::sleep_for(chrono::milliseconds(10));
+    uint32_t clientAddress = 0;
+    uint32_t serverAddress = inet_addr("10.0.0.1");
+    inet_pton(AF_INET, cidr.substr(0, cidr.find('/')).c_str(), &clientAddress);
+
+    int serverSide = server.getTunDevice().getPeerFd(0);
+    int clientSide = client.getTunDevice().getPeerFd(0);
+    struct timeval timeout = {RECEIVE_TIMEOUT_MS / 1000, (RECEIVE_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(serverSide, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(clientSide, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    printf("%-5s %6s %12s %10s %10s %10s %10s %12s %8s\n", "dir", "size", "packets/s", "Gbit/s", "p50 us",
+           "p99 us", "p999 us", "saturated/s", "loss");
+    vector<Result> results;
+    for (size_t size : PACKET_SIZES) {
+        for (int up = 1; up >= 0; up--) {
+            if (!up && !clientAddress)
+                continue;  // No address was assigned, nothing routes to the client
+            const char* direction = up ? "up" : "down";
+            int in = up ? clientSide : serverSide;
+            int out = up ? serverSide : clientSide;
+            uint32_t src = up ? clientAddress : serverAddress;
+            uint32_t dst = up ? serverAddress : clientAddress;
+
+            // Saturated: as fast as the tunnel takes packets. Upstream the client holds back
+            // what its connection cannot carry; downstream the server drops it, so there
+            // this shows overload rather than what the path sustains
+            Result saturated = measure(direction, in, out, size, packets, 0, src, dst);
+            drain(out);
+            // Throughput: the highest paced rate that loses nothing
+            Result result = saturated.received == saturated.sent
+                                ? saturated
+                                : measureLossFree(direction, in, out, size, max<size_t>(packets / 4, 1000), src, dst,
+                                                  saturated.packetsPerSecond);
+            result.saturatedPacketsPerSecond = saturated.packetsPerSecond;
+            result.saturatedLoss = saturated.sent ? (double)(saturated.sent - saturated.received) / saturated.sent : 0;
+            // Latency well inside the loss-free region
+            int rate = max(1, min(LATENCY_RATE, (int)(result.packetsPerSecond / 2)));
+            Result paced = measure(direction, in, out, size, LATENCY_PACKETS, rate, src, dst);
+            drain(out);
+            result.p50 = paced.p50;
+            result.p99 = paced.p99;
+            result.p999 = paced.p999;
+
+            printf("%-5s %6zu %12.0f %10.3f %10.1f %10.1f %10.1f %12.0f %7.1f%%\n", direction, size,
+                   result.packetsPerSecond, result.gbitPerSecond, result.p50, result.p99, result.p999,
+                   result.saturatedPacketsPerSecond, result.saturatedLoss * 100);
+            fflush(stdout);
+            results.push_back(result);
+        }
+    }
+    bool ok = writeResults(output, results);
+    if (ok)
+        printf("Results written to %s\n", output.c_str());
+
+    // Ending its TUN queue stops the client; the server is stopped directly
+    shutdown(clientSide, SHUT_RDWR);
+    clientThread.join();
+    server.stop();
+    serverThread.join();
+
+    cout.rdbuf(console);
+    Logger::stop();
+    return ok ? 0 : 1;
+}
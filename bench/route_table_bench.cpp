@@ -0,0 +1,58 @@
+// Measures RouteTable lookups on the server's TUN dispatch path
+//   usage: route_table_bench [entries] [lookups]
+#include "../tun_interface/RouteTable.hpp"
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+#include <arpa/inet.h>
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    size_t entries = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+    size_t lookups = argc > 2 ? strtoul(argv[2], nullptr, 10) : 20000000;
+
+    mt19937_64 rng(42);
+    RouteTable<uintptr_t> table;
+    vector<IpAddress> keys;
+    keys.reserve(entries);
+
+    // Mix of IPv4 clients in 10.0.0.0/8 and IPv6 clients in fd00::/8
+    for (size_t i = 0; i < entries; i++) {
+        IpAddress key;
+        if (i % 4 == 3) {
+            unsigned char v6[16] = {0xfd};
+            uint64_t r = rng();
+            memcpy(v6 + 8, &r, sizeof(r));
+            key = IpAddress::fromV6(v6);
+        } else {
+            key = IpAddress::fromV4(htonl(0x0a000000 | (rng() & 0x00ffffff)));
+        }
+        table.insert(key, i + 1);
+        keys.push_back(key);
+    }
+
+    // Pre-compute a random access order so the timed loop only measures lookups
+    vector<uint32_t> order(1 << 20);
+    for (auto& index : order)
+        index = rng() % keys.size();
+
+    uintptr_t checksum = 0;
+    size_t misses = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < lookups; i++) {
+        uintptr_t* value = table.find(keys[order[i & (order.size() - 1)]]);
+        if (value)
+            checksum += *value;
+        else
+            misses++;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "entries: " << table.size() << "\n"
+         << "lookups: " << lookups << " (" << misses << " misses)\n"
+         << "time: " << seconds << " s\n"
+         << "rate: " << lookups / seconds / 1e6 << " M lookups/s\n"
+         << "checksum: " << checksum << endl;
+    return 0;
+}
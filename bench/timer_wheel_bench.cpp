@@ -0,0 +1,109 @@
+// Measures per-connection timers on a TimerWheel, against a binary heap doing the same
+// work: each tick a share of the connections push their timeout back (as traffic would),
+// and the timers that come due fire and re-arm
+//   usage: timer_wheel_bench [timers] [seconds simulated]
+#include "../tun_interface/TimerWheel.hpp"
+#include <chrono>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <vector>
+using namespace std;
+
+using Clock = TimerWheel::Clock;
+
+static constexpr auto TICK = chrono::milliseconds(100);
+// Each tick, this share of the connections carries traffic and moves its check out
+static constexpr double BUSY_SHARE = 0.05;
+
+struct Result {
+    double seconds;
+    size_t rearms, fired;
+};
+
+// One keepalive interval of 10 s, give or take, so the checks spread over the ticks
+static Clock::duration interval(mt19937_64& rng) {
+    return chrono::milliseconds(8000 + rng() % 4000);
+}
+
+static Result runWheel(size_t timers, size_t ticks, Clock::time_point start) {
+    mt19937_64 rng(42);
+    TimerWheel wheel(TICK, start);
+    vector<TimerWheel::Timer> nodes(timers);
+    for (size_t i = 0; i < timers; i++) {
+        nodes[i].data = i;
+        wheel.schedule(nodes[i], start + interval(rng));
+    }
+
+    size_t rearms = 0, fired = 0;
+    size_t busy = timers * BUSY_SHARE;
+    auto begin = chrono::steady_clock::now();
+    for (size_t t = 1; t <= ticks; t++) {
+        Clock::time_point now = start + TICK * t;
+        for (size_t i = 0; i < busy; i++)
+            wheel.schedule(nodes[rng() % timers], now + interval(rng));
+        rearms += busy;
+        wheel.advance(now, [&](TimerWheel::Timer& timer) {
+            fired++;
+            wheel.schedule(timer, now + interval(rng));
+        });
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    return {seconds, rearms, fired};
+}
+
+// The usual heap alternative: re-arming pushes a new entry, and stale ones are skipped
+// by their generation when they reach the top
+static Result runHeap(size_t timers, size_t ticks, Clock::time_point start) {
+    mt19937_64 rng(42);
+    struct Entry {
+        Clock::time_point when;
+        uint32_t id, generation;
+        bool operator>(const Entry& other) const { return when > other.when; }
+    };
+    priority_queue<Entry, vector<Entry>, greater<Entry>> heap;
+    vector<uint32_t> generations(timers);
+    for (size_t i = 0; i < timers; i++)
+        heap.push({start + interval(rng), (uint32_t)i, 0});
+
+    size_t rearms = 0, fired = 0;
+    size_t busy = timers * BUSY_SHARE;
+    auto begin = chrono::steady_clock::now();
+    for (size_t t = 1; t <= ticks; t++) {
+        Clock::time_point now = start + TICK * t;
+        for (size_t i = 0; i < busy; i++) {
+            uint32_t id = rng() % timers;
+            heap.push({now + interval(rng), id, ++generations[id]});
+        }
+        rearms += busy;
+        while (!heap.empty() && heap.top().when <= now) {
+            Entry entry = heap.top();
+            heap.pop();
+            if (entry.generation != generations[entry.id])
+                continue;
+            fired++;
+            heap.push({now + interval(rng), entry.id, ++generations[entry.id]});
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    return {seconds, rearms, fired};
+}
+
+static void print(const char* name, const Result& result, size_t ticks) {
+    size_t operations = result.rearms + result.fired;
+    cout << name << ": " << result.seconds << " s, " << result.rearms << " re-arms, " << result.fired << " fired, "
+         << result.seconds * 1e9 / operations << " ns per operation, "
+         << result.seconds * 1e6 / ticks << " us per tick\n";
+}
+
+int main(int argc, char* argv[]) {
+    size_t timers = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+    size_t seconds = argc > 2 ? strtoul(argv[2], nullptr, 10) : 60;
+    size_t ticks = seconds * chrono::seconds(1) / TICK;
+    Clock::time_point start = Clock::now();
+
+    cout << "timers: " << timers << ", " << ticks << " ticks of " << TICK.count() << " ms\n";
+    print("wheel", runWheel(timers, ticks, start), ticks);
+    print("heap", runHeap(timers, ticks, start), ticks);
+    return 0;
+}
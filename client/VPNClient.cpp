@@ -1,10 +1,74 @@
 #include "../tun_interface/TunDevice.hpp"
 #include "../tun_interface/VPNConnection.hpp"
+#include "../tun_interface/PacketOffload.hpp"
+#include "../tun_interface/Logger.hpp"
+#include "../tun_interface/Metrics.hpp"
+#include "../tun_interface/PacketPool.hpp"
+#include "../tun_interface/PacketReplay.hpp"
+#include "../tun_interface/FlowHash.hpp"
+#include "../tun_interface/FairQueue.hpp"
+#include "../tun_interface/TunRing.hpp"
+#include "../tunneling/Frame.hpp"
+#include "../tunneling/FrameBatcher.hpp"
+#include "../tunneling/FrameReader.hpp"
+#include "../tunneling/FrameCompressor.hpp"
+#include "../src/VPNConfig.hpp"
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <vector>
+#include <arpa/inet.h>
 using namespace std;
 
 class VPNClient {
+public:
+    // Reconnect mode (-x): the first attempt is immediate, then the delay doubles up to the
+    // cap, each drawn from its upper half so clients cut off together do not return together
+    static constexpr int RECONNECT_BASE_MS = 100;
+    static constexpr int RECONNECT_MAX_MS = 10000;
+    // Packets held while the tunnel is down: at most this many bytes, none older than HOLD_MS
+    // (by then the applications have retransmitted them or given up)
+    static constexpr size_t HOLD_LIMIT = 1 << 20;
+    static constexpr int HOLD_MS = 3000;
+
 private:
+    // A TUN packet read while the tunnel was down
+    struct HeldPacket {
+        chrono::steady_clock::time_point time;
+        struct virtio_net_hdr vnet;
+        vector<char> data;
+    };
+
+    // One TLS connection to the server with its own framing state
+    struct Stream {
+        VPNConnection* vpn;
+        unique_ptr<VPNConnection> owned;  // Extra streams own their connection
+        // Frames received from the server, parsed in place
+        FrameReader rx;
+        // Frames waiting to be sent to the server as one record
+        FrameBatcher txBatch;
+        // When the first frame of the current batch was read off the TUN device
+        chrono::steady_clock::time_point txBatchStart;
+        // Fair queueing (-f): packets waiting for room in the send queue
+        FairQueue egress;
+        // When anything last went to the server and came from it
+        chrono::steady_clock::time_point lastSent, lastReceived;
+
+        Stream(VPNConnection* vpn, size_t maxFrame, size_t batchSize)
+            : vpn(vpn), rx(maxFrame), txBatch(batchSize),
+              lastSent(chrono::steady_clock::now()), lastReceived(lastSent) {}
+    };
+
+    // An extra stream being opened: a connection whose connect and handshake advance in the loop
+    struct OpeningStream {
+        unique_ptr<VPNConnection> connection;
+        bool ready;  // Handshake complete, waiting for the others
+    };
+
     // TUN device object
     TunDevice tun;
     // VPN connection object
@@ -15,21 +79,78 @@ private:
     string serverIP;
     // Port number
     int port;
-    // Buffer for data transfer
-    char buffer[TunDevice::BUFFER_SIZE];
-    // Counters for packets sent and received
-    unsigned long packets_sent, packets_received;
+    // Command line settings (batching limits)
+    VPNConfig config;
+    // Pooled buffers for TUN reads, sized for the largest TUN packet
+    PacketPool packetPool;
+    PacketCache* packets;
+    // Buffer the next TUN packet is read into
+    PacketHandle buffer;
+    // Connections to the server: the session's own over vpn first, then (-S) the extra
+    // streams that joined it, over which flows are striped by their hash
+    vector<unique_ptr<Stream>> streams;
+    // Extra streams still opening, all given until openingDeadline, and the server's token
+    // they join the session with once none of them is left waiting
+    vector<OpeningStream> opening;
+    chrono::steady_clock::time_point openingDeadline;
+    StreamTokenMessage joinToken;
+    // The server accepts FRAME_GSO superpackets (announced in CONTROL_FEATURES)
+    bool peerGso;
+    // The server accepts FRAME_COMPRESSED frames (announced in CONTROL_FEATURES)
+    bool peerCompression;
+    // Seconds between the server's keepalives, from its CONTROL_KEEPALIVE (0: it sends none)
+    int peerKeepalive;
+    // Scratch state for compressing and restoring frames
+    FrameCompressor compressor;
+    // Packet, drop and error counters for this thread
+    MetricsShard metrics;
+    // io_uring backend for the TUN device (-I); null when it is read and written directly
+    unique_ptr<TunRing> ring;
+    // Counters for the tunnel to the server, exported once it assigns an address
+    SessionMetrics session;
+    // Capture file sent through the tunnel in place of TUN traffic (-R)
+    PacketReplay replay;
+    bool replaying;
+    chrono::steady_clock::time_point replayStart;
+    size_t replayedPackets;
+    size_t replayedBytes;
+    // The tunnel is up; only ever false in reconnect mode
+    bool connected;
+    // Reconnect mode: when the tunnel went down, when to try next and how often it failed
+    chrono::steady_clock::time_point lostAt;
+    chrono::steady_clock::time_point reconnectAt;
+    int reconnectAttempts;
+    mt19937 jitter;
+    // Reconnect mode: packets waiting for the tunnel, oldest first, and their total size
+    deque<HeldPacket> held;
+    size_t heldBytes;
+    // Address the server assigned last (network byte order), asked for again on a reconnect
+    uint32_t assignedAddress;
+    // Assignments to ignore: the one the server sends unasked before it reads our request
+    int skipAssignments;
     // Certificate paths
     string certPath;
     string keyPath;
 
 public:
     // Constructor
-    VPNClient(const string& iface, const string& serverIP, int port,
+    VPNClient(const VPNConfig& config,
               const string& certPath = "", const string& keyPath = "")
-        : tun(iface, false), vpn(false), interfaceName(iface), 
-          serverIP(serverIP), port(port), packets_sent(0), packets_received(0),
-          certPath(certPath), keyPath(keyPath) {}
+        : tun(config.ifaceName, false, 1, config.offload), vpn(false, config.datagram), interfaceName(config.ifaceName), 
+          serverIP(config.serverIP), port(config.port), config(config),
+          packetPool(config.offload ? TunDevice::MAX_PACKET_SIZE : TunDevice::BUFFER_SIZE),
+          packets(packetPool.cache()), buffer(packets->get()),
+          peerGso(false), peerCompression(false), peerKeepalive(0), replaying(false), replayedPackets(0), replayedBytes(0),
+          connected(false), reconnectAttempts(0), jitter(random_device{}()), heldBytes(0), assignedAddress(0),
+          skipAssignments(0), certPath(certPath), keyPath(keyPath) {
+        streams.push_back(make_unique<Stream>(&vpn, maxFrameSize(), config.batchSize));
+        Metrics::addShard(&metrics);
+    }
+
+    ~VPNClient() {
+        Metrics::removeSession(&session);
+        Metrics::removeShard(&metrics);
+    }
 
     // Initialize the VPN client
     bool initialize() {
@@ -40,6 +161,37 @@ public:
         }
         cout << "Successfully initialized TUN device " << interfaceName << endl;
 
+        // Each packet travels in its own datagram, so it must leave room for the outer headers
+        if (config.datagram && !tun.setMtu(Tunnel::DATAGRAM_MTU)) {
+            cerr << "Failed to set TUN MTU\n";
+            return false;
+        }
+
+        // Record what passes the TUN device, instead of running tcpdump on the interface
+        if (config.capturePath[0] && !tun.enableCapture(config.capturePath, (size_t)config.captureFileMb << 20,
+                                                        config.captureFiles, config.captureSample, config.captureHosts)) {
+            cerr << "Failed to start packet capture\n";
+            return false;
+        }
+
+        if (config.replayPath[0] && !replay.open(config.replayPath)) {
+            cerr << "Failed to open replay file\n";
+            return false;
+        }
+
+        // The TUN device is drained until EAGAIN so bursts can be batched. io_uring reads
+        // wait in the kernel instead, so with -I it stays blocking
+        if (config.ioUring) {
+            ring = make_unique<TunRing>(tun, 0, packets, metrics);
+            if (!ring->initialize()) {
+                cerr << "Failed to set up io_uring for the TUN device: " << strerror(errno) << "\n";
+                return false;
+            }
+        } else if (!tun.setNonBlocking(true)) {
+            cerr << "Failed to make TUN device non-blocking\n";
+            return false;
+        }
+
         // Configure SSL if certificates are provided
         if (!certPath.empty() && !keyPath.empty()) {
             if (!vpn.configureCertificates(certPath, keyPath)) {
@@ -49,114 +201,911 @@ public:
         }
 
         // Connect to the VPN server
-
-
+        Tunnel::setKernelTls(config.ktls);
+        Tunnel::setCipherPolicy(CipherPolicy{config.cipherSuites, config.groups});
         if (!vpn.connect(serverIP, port)) {
             cerr << "Failed to connect to server\n";
             return false;
         }
         cout << "Connected to server " << serverIP << endl;
+        if (!startTunnel())
+            return false;
+        replaying = config.replayPath[0] != '\0';
+        return true;
+    }
+
+    // Replaces a dropped tunnel with a new connection to the server (a single attempt).
+    // The TUN device and its address stay as they are
+    bool reconnect() {
+        // Extra streams are opened again once the server hands out a new token
+        streams.resize(1);
+        opening.clear();
+        streams[0]->rx.reset();
+        streams[0]->txBatch.clear();
+        peerGso = false;
+        peerCompression = false;
+        peerKeepalive = 0;
+        // Ask for the previous address back, so connections using it carry on
+        if (!vpn.reconnect(serverIP, port) || !startTunnel() || (assignedAddress && !requestAddress())) {
+            connected = false;
+            return false;
+        }
         return true;
     }
 
     // Run the VPN client
     bool run() {
+        if (ring && !ring->start()) {
+            perror("io_uring_enter()");
+            printStatistics();
+            return false;
+        }
         while (true) {
-            // File descriptor set for select
-            fd_set readSet;
+            // Reconnect mode: the tunnel is down, so TUN packets are held until it is back
+            if (!connected) {
+                if (!waitForTunnel()) {
+                    printStatistics();
+                    return false;
+                }
+                continue;
+            }
+
+            // File descriptor sets for select
+            fd_set readSet, writeSet;
             FD_ZERO(&readSet);
-            FD_SET(tun.getFd(), &readSet);
-            FD_SET(vpn.getFd(), &readSet);
+            FD_ZERO(&writeSet);
+            // Backpressure: leave packets in the TUN queue while the server is not keeping up.
+            // With fair queueing the scheduler takes everything and drops where it hurts least
+            bool tunWanted = config.fairQueue || !sendQueueFull();
+            if (tunWanted)
+                FD_SET(tunFd(), &readSet);
+            int maxFd = tunFd();
+            for (auto& stream : streams) {
+                int fd = stream->vpn->getFd();
+                FD_SET(fd, &readSet);
+                if (stream->vpn->wantsWrite())
+                    FD_SET(fd, &writeSet);
+                maxFd = max(maxFd, fd);
+            }
+            // Extra streams being opened, in whichever direction their handshakes wait
+            for (auto& stream : opening) {
+                if (stream.ready)
+                    continue;
+                int fd = stream.connection->getFd();
+                FD_SET(fd, stream.connection->handshakeWantsWrite() ? &writeSet : &readSet);
+                maxFd = max(maxFd, fd);
+            }
+
+            // Replayed packets go out whenever the send queue has room, without waiting
+            bool replayReady = replaying && !sendQueueFull();
+            // io_uring: packets left over from a drain that stopped early were signalled already
+            bool tunPending = tunWanted && ring && ring->pending();
+            // Otherwise sleep until data arrives, a keepalive check is due or opening streams time out
+            int timeoutMs = replayReady || tunPending ? 0 : loopTimeout();
+            struct timeval timeout = {timeoutMs / 1000, timeoutMs % 1000 * 1000};
+
+            // TUN writes queued since the last round, and reposted reads, go in with one call
+            if (ring && !ring->submit()) {
+                perror("io_uring_enter()");
+                printStatistics();
+                return false;
+            }
 
-            // Get the maximum file descriptor
-            int maxFd = max(tun.getFd(), vpn.getFd()) + 1;
-            // Wait for data on either TUN or VPN
-            if (select(maxFd, &readSet, NULL, NULL, NULL) < 0) {
+            // Wait for data on either TUN or VPN, or for room in a socket
+            if (select(maxFd + 1, &readSet, &writeSet, NULL, timeoutMs >= 0 ? &timeout : NULL) < 0) {
                 perror("select()");
                 printStatistics();
                 return false;
             }
 
             // Handle data from TUN to VPN
-            if (FD_ISSET(tun.getFd(), &readSet)) {
+            if (FD_ISSET(tunFd(), &readSet) || tunPending) {
                 if (!handleTunToVPN()) {
-                    printStatistics();
-                    return false;
+                    if (!tunnelLost())
+                        return false;
+                    continue;
                 }
             }
 
-            // Handle data from VPN to TUN
-            if (FD_ISSET(vpn.getFd(), &readSet)) {
-                if (!handleVPNToTun()) {
-                    printStatistics();
+            if (replayReady && !handleReplay()) {
+                if (!tunnelLost())
                     return false;
-                }
+                continue;
+            }
+
+            // Handle data from VPN to TUN, stream by stream. Streams opened meanwhile are
+            // not in the sets yet; a failing stream takes the whole tunnel down
+            bool ok = true;
+            for (size_t i = 0; ok && i < streams.size(); i++) {
+                Stream& stream = *streams[i];
+                int fd = stream.vpn->getFd();
+                if (FD_ISSET(fd, &readSet))
+                    ok = handleVPNToTun(stream);
+                // Retry whatever OpenSSL could not write earlier: either readiness can unblock it
+                if (ok && (FD_ISSET(fd, &writeSet) || FD_ISSET(fd, &readSet)))
+                    ok = flushBatch(stream);
             }
+            if (ok && !opening.empty())
+                advanceStreams(readSet, writeSet);
+            if (ok)
+                ok = checkKeepalive();
+            if (!ok && !tunnelLost())
+                return false;
         }
         return true;
     }
 
+    const TunDevice& getTunDevice() const { return tun; }
+
 private:
-    // Handle data transfer from TUN to VPN
-    bool handleTunToVPN() {
-        // Read data from TUN device
-        int len = tun.read(buffer, sizeof(buffer));
-        if (len <= 0) return false;
-        
-        // Increment packets sent counter
-        packets_sent++;
-        cout << "TUN -> NET [" << packets_sent << "]: " 
-                    << len << " bytes" << endl;
-        
-        // Write packet length to VPN
-        uint16_t plength = htons(len);
-        if (vpn.write(reinterpret_cast<char*>(&plength), sizeof(plength)) <= 0 ||
-            vpn.write(buffer, len) <= 0) {
-            cerr << "Failed to write to network\n";
+    // Prepares a freshly connected tunnel: counts it, makes it non-blocking and announces
+    // the optional frame kinds this client accepts
+    bool startTunnel() {
+        metrics.sessionsAdded.add();
+        if (vpn.resumedSession())
+            metrics.sessionsResumed.add();
+
+        // Records are drained until EAGAIN, so a partial one never blocks the loop
+        if (!vpn.setNonBlocking(true)) {
+            cerr << "Failed to make VPN connection non-blocking\n";
             return false;
         }
+        // Fair queueing only works if the backlog waits in the scheduler, not in the socket
+        if (config.fairQueue && !vpn.setUnsentLimit(FairQueue::BACKLOG_BYTES))
+            LOG_WARN("Failed to limit unsent bytes");
+
+        // Tell the server which optional frame kinds we accept, and how often it hears from us
+        streams[0]->lastReceived = chrono::steady_clock::now();
+        if (!sendFeatures(*streams[0]) || (config.keepalive && !sendKeepalive(*streams[0]))) {
+            cerr << "Failed to send features to server\n";
+            return false;
+        }
+        connected = true;
         return true;
     }
 
-    // Handle data transfer from VPN to TUN
-    bool handleVPNToTun() {
-        // Read packet length from VPN
-        uint16_t plength;
-        if (vpn.read(reinterpret_cast<char*>(&plength), sizeof(plength)) <= 0) {
-            cerr << "Connection closed by peer\n";
+    // The tunnel failed. Outside reconnect mode that ends run(); in it, TUN packets are
+    // held from now on and the first attempt to reconnect is made right away
+    bool tunnelLost() {
+        if (config.reconnect)
+            holdStreams();
+        streams.resize(1);
+        opening.clear();
+        if (!config.reconnect) {
+            printStatistics();
             return false;
         }
+        LOG_WARN("Lost the tunnel to %s, reconnecting", serverIP.c_str());
+        metrics.sessionsClosed.add();
+        connected = false;
+        lostAt = chrono::steady_clock::now();
+        reconnectAt = lostAt;
+        reconnectAttempts = 0;
+        return true;
+    }
 
-        // Convert packet length to host byte order
-        int len = ntohs(plength);
-        if (len > TunDevice::BUFFER_SIZE) {
-            cerr << "Packet too large: " << len << endl;
-            return false;
+    // Reconnect mode: tries to reconnect when an attempt is due, holding TUN packets until
+    // then. Returns false only if the TUN device fails
+    bool waitForTunnel() {
+        if (chrono::steady_clock::now() >= reconnectAt) {
+            if (reconnect()) {
+                metrics.reconnects.add();
+                double seconds = chrono::duration<double>(chrono::steady_clock::now() - lostAt).count();
+                LOG_INFO("Reconnected to %s after %.3f s, sending %zu held packets", serverIP.c_str(), seconds,
+                         held.size());
+                return sendHeld() || tunnelLost();
+            }
+            int delay = min(RECONNECT_MAX_MS, RECONNECT_BASE_MS << min(reconnectAttempts, 16));
+            delay = uniform_int_distribution<int>(delay / 2, delay)(jitter);
+            reconnectAttempts++;
+            reconnectAt = chrono::steady_clock::now() + chrono::milliseconds(delay);
+            LOG_INFO("Reconnect attempt %d failed, next one in %d ms", reconnectAttempts, delay);
         }
 
-        // Read packet data from VPN
-        if (vpn.read(buffer, len) <= 0) {
-            cerr << "Failed to read packet data\n";
+        auto wait = chrono::duration_cast<chrono::microseconds>(reconnectAt - chrono::steady_clock::now());
+        long usec = max<long>(wait.count(), 0);
+        struct timeval timeout = {usec / 1000000, usec % 1000000};
+        // io_uring: reads that completed meanwhile are held without waiting
+        bool pending = ring && ring->pending();
+        if (pending)
+            timeout = {0, 0};
+        if (ring && !ring->submit()) {
+            perror("io_uring_enter()");
             return false;
         }
+        fd_set readSet;
+        FD_ZERO(&readSet);
+        FD_SET(tunFd(), &readSet);
+        int n = select(tunFd() + 1, &readSet, NULL, NULL, &timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("select()");
+            return false;
+        }
+        expireHeld();
+        return (n <= 0 && !pending) || holdPackets();
+    }
+
+    // Drains the TUN device into the hold queue, dropping the oldest packets over the limit:
+    // they are the closest to expiring and to being retransmitted anyway
+    bool holdPackets() {
+        auto now = chrono::steady_clock::now();
+        while (true) {
+            struct virtio_net_hdr vnet;
+            ssize_t len = readTun(vnet);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (len <= 0)
+                return false;
+
+            held.push_back({now, vnet, vector<char>(buffer.data(), buffer.data() + len)});
+            heldBytes += len;
+            metrics.packetsHeld.add();
+            while (heldBytes > HOLD_LIMIT)
+                dropHeld();
+        }
+    }
+
+    // The tunnel failed with packets still waiting in the streams. Those in a fair queue had
+    // not been sent yet and are held like TUN packets, oldest first; those already framed
+    // into a batch went down with their connection and are counted as dropped
+    void holdStreams() {
+        auto now = chrono::steady_clock::now();
+        vector<HeldPacket> waiting;
+        for (auto& stream : streams) {
+            FairQueue::Packet next;
+            size_t dropped;
+            while (true) {
+                bool more = stream->egress.dequeue(next, now, dropped);
+                if (dropped) {
+                    metrics.dropsCodel.add(dropped);
+                    session.packetsDropped.add(dropped);
+                }
+                if (!more)
+                    break;
+                waiting.push_back({next.enqueued, next.vnet,
+                                   vector<char>(next.data.data(), next.data.data() + next.data.length())});
+            }
+            if (size_t frames = stream->txBatch.frames()) {
+                metrics.dropsQueueFull.add(frames);
+                session.packetsDropped.add(frames);
+                stream->txBatch.clear();
+            }
+        }
+        updateFairQueueDepth();
+
+        // Each stream's queue is drained in scheduling order; the hold queue keeps read order
+        stable_sort(waiting.begin(), waiting.end(),
+                    [](const HeldPacket& a, const HeldPacket& b) { return a.time < b.time; });
+        for (auto it = waiting.rbegin(); it != waiting.rend(); ++it) {
+            heldBytes += it->data.size();
+            held.push_front(move(*it));
+            metrics.packetsHeld.add();
+        }
+        while (heldBytes > HOLD_LIMIT)
+            dropHeld();
+    }
+
+    // Drops held packets older than HOLD_MS
+    void expireHeld() {
+        auto oldest = chrono::steady_clock::now() - chrono::milliseconds(HOLD_MS);
+        while (!held.empty() && held.front().time < oldest)
+            dropHeld();
+    }
+
+    void dropHeld() {
+        heldBytes -= held.front().data.size();
+        held.pop_front();
+        metrics.dropsHeld.add();
+    }
+
+    // Sends the held packets through the new tunnel, in the order they were read
+    bool sendHeld() {
+        expireHeld();
+        deque<HeldPacket> sending;
+        sending.swap(held);
+        heldBytes = 0;
+        for (HeldPacket& packet : sending) {
+            size_t len = packet.data.size();
+            countSent(len);
+            if (!queuePacket(streamFor(packet.data.data(), len), packet.vnet, packet.data.data(), len))
+                return false;
+        }
+        return flushBatch();
+    }
+
+    // Handle data transfer from TUN to VPN
+    bool handleTunToVPN() {
+        // Drain every ready packet into one batch, bounded by the time budget
+        auto deadline = chrono::steady_clock::now() + chrono::microseconds(config.batchBudgetUsec);
+        while (true) {
+            // Read data from TUN device
+            struct virtio_net_hdr vnet;
+            ssize_t len = readTun(vnet);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (len <= 0) return false;
+
+            if (config.fairQueue) {
+                buffer.setLength(len);
+                queueEgress(vnet);
+            } else {
+                countSent(len);
+                LOG_TRACE_RATE(20, "TUN -> NET [%lu]: %zd bytes", metrics.packetsSent.get(), len);
+                if (!queuePacket(streamFor(buffer.data(), len), vnet, buffer.data(), len))
+                    return false;
+            }
+
+            // Stop draining once a send queue is full; the kernel queues the rest
+            if ((!config.fairQueue && sendQueueFull()) || chrono::steady_clock::now() >= deadline)
+                break;
+        }
+        return flushBatch();
+    }
+
+    void countSent(size_t len) {
+        metrics.packetsSent.add();
+        metrics.bytesSent.add(len);
+        metrics.sentSize.observe(len);
+        session.packetsSent.add();
+        session.bytesSent.add(len);
+    }
+
+    // Fair queueing: the packet in buffer waits in its stream's scheduler, which releases it
+    // when the send queue has room (see flushBatch). The buffer moves into the queue
+    void queueEgress(const struct virtio_net_hdr& vnet) {
+        Stream& stream = streamFor(buffer.data(), buffer.length());
+        if (size_t dropped = stream.egress.enqueue(buffer, vnet, chrono::steady_clock::now())) {
+            metrics.dropsQueueFull.add(dropped);
+            session.packetsDropped.add(dropped);
+        }
+        buffer = packets->get();
+        updateFairQueueDepth();
+    }
+
+    // Fair queueing: moves packets from a stream's scheduler into its batch until the send
+    // queue would hold BACKLOG_BYTES
+    bool releaseEgress(Stream& stream) {
+        auto now = chrono::steady_clock::now();
+        FairQueue::Packet next;
+        size_t dropped;
+        while (stream.vpn->queued() + stream.txBatch.size() < FairQueue::BACKLOG_BYTES) {
+            bool more = stream.egress.dequeue(next, now, dropped);
+            if (dropped) {
+                metrics.dropsCodel.add(dropped);
+                session.packetsDropped.add(dropped);
+            }
+            if (!more)
+                break;
+            size_t len = next.data.length();
+            metrics.fairQueueSeconds.observe(chrono::duration<double>(now - next.enqueued).count());
+            countSent(len);
+            LOG_TRACE_RATE(20, "TUN -> NET [%lu]: %zu bytes", metrics.packetsSent.get(), len);
+            if (!queuePacket(stream, next.vnet, next.data.data(), len))
+                return false;
+        }
+        updateFairQueueDepth();
+        return true;
+    }
+
+    void updateFairQueueDepth() {
+        size_t waiting = 0;
+        for (auto& stream : streams)
+            waiting += stream->egress.packets();
+        session.fairQueuePackets.set(waiting);
+    }
+
+    // Sends the next batch of packets from the replay file, like a TUN drain
+    bool handleReplay() {
+        auto now = chrono::steady_clock::now();
+        if (replayedPackets == 0)
+            replayStart = now;
+        auto deadline = now + chrono::microseconds(config.batchBudgetUsec);
+        const char* packet;
+        size_t len;
+        while (replay.next(packet, len)) {
+            // The server reads plain packets into TUN-sized buffers; superpackets cannot go as is
+            if (len == 0 || len > TunDevice::BUFFER_SIZE)
+                continue;
+
+            countSent(len);
+            replayedPackets++;
+            replayedBytes += len;
+            if (!queueFrame(streamFor(packet, len), nullptr, 0, packet, len))
+                return false;
+            if (sendQueueFull() || chrono::steady_clock::now() >= deadline)
+                return flushBatch();
+        }
+
+        replaying = false;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - replayStart).count();
+        LOG_INFO("Replayed %zu packets (%zu bytes) in %.3f s: %.0f packets/s, %.3f Gbit/s", replayedPackets,
+                 replayedBytes, seconds, seconds > 0 ? replayedPackets / seconds : 0.0,
+                 seconds > 0 ? replayedBytes * 8 / seconds / 1e9 : 0.0);
+        return flushBatch();
+    }
+
+    // Queues a TUN packet on a stream, resolving offload requests the server cannot take
+    bool queuePacket(Stream& stream, const struct virtio_net_hdr& vnet, char* packet, size_t len) {
+        if (!PacketOffload::needsOffload(vnet))
+            return queueFrame(stream, nullptr, 0, packet, len);
 
-        // Increment packets received counter
-        packets_received++;
-        cout << "NET -> TUN [" << packets_received << "]: " 
-                    << len << " bytes" << endl;
+        // The server's kernel segments the superpacket
+        if (peerGso && len + sizeof(GsoFrameHeader) <= UINT16_MAX) {
+            GsoFrameHeader gso;
+            PacketOffload::encodeHeader(vnet, gso);
+            return queueFrame(stream, reinterpret_cast<char*>(&gso), sizeof(gso), packet, len);
+        }
 
-        // Write data to TUN device
-        if (tun.write(buffer, len) <= 0) {
-            cerr << "Failed to write to TUN\n";
+        // The server cannot take superpackets: segment and checksum here
+        bool ok = true;
+        PacketOffload::resolve(packet, len, vnet, [&](const char* segment, size_t segmentLen) {
+            ok = queueFrame(stream, nullptr, 0, segment, segmentLen);
+            return ok;
+        });
+        return ok;
+    }
+
+    // The stream a packet's flow is striped onto, so each flow stays in order
+    Stream& streamFor(const char* packet, size_t len) {
+        if (streams.size() == 1)
+            return *streams[0];
+        return *streams[flowHash(packet, len) % streams.size()];
+    }
+
+    // Adds one frame to a stream's batch
+    bool queueFrame(Stream& stream, const char* header, size_t headerLen, const char* packet, size_t len) {
+        if (config.compress && peerCompression)
+            compressFrame(header, headerLen, packet, len);
+
+        // A full batch goes out now and the packet starts the next one
+        if (stream.txBatch.empty())
+            stream.txBatchStart = chrono::steady_clock::now();
+        if (!stream.txBatch.append(header, headerLen, packet, len)) {
+            if (!writeBatch(stream))
+                return false;
+            stream.txBatchStart = chrono::steady_clock::now();
+            stream.txBatch.append(header, headerLen, packet, len);
+        }
+        return true;
+    }
+
+    // Replaces a frame with its compressed form when that pays off, counting the outcome and time
+    void compressFrame(const char*& header, size_t& headerLen, const char*& packet, size_t& len) {
+        auto start = chrono::steady_clock::now();
+        const char* compressed;
+        size_t compressedLen;
+        bool ok = compressor.compress(header, headerLen, packet, len, compressed, compressedLen);
+        metrics.compressNanoseconds.add(
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        if (!ok) {
+            metrics.packetsUncompressed.add();
+            return;
+        }
+        metrics.packetsCompressed.add();
+        metrics.compressInputBytes.add(headerLen + len);
+        metrics.compressOutputBytes.add(compressedLen);
+        header = nullptr;
+        headerLen = 0;
+        packet = compressed;
+        len = compressedLen;
+    }
+
+    // Move every stream's batched frames to its send queue and write what the sockets take
+    bool flushBatch() {
+        for (auto& stream : streams) {
+            if (!flushBatch(*stream))
+                return false;
+        }
+        return true;
+    }
+
+    bool flushBatch(Stream& stream) {
+        // With fair queueing the scheduler tops the send queue up for as long as the socket takes it all
+        do {
+            if (config.fairQueue && !releaseEgress(stream))
+                return false;
+            if (!writeBatch(stream))
+                return false;
+        } while (config.fairQueue && !stream.egress.empty() && stream.vpn->queued() == 0);
+        return true;
+    }
+
+    // One round of flushBatch: batch to send queue, send queue to socket
+    bool writeBatch(Stream& stream) {
+        FrameBatcher& batch = stream.txBatch;
+        if (!batch.empty()) {
+            stream.vpn->enqueue(batch.data(), batch.size());
+            // Latency up to the socket handoff, charged to every frame by the batch's oldest
+            stream.lastSent = chrono::steady_clock::now();
+            chrono::duration<double> waited = stream.lastSent - stream.txBatchStart;
+            metrics.tunToSocketSeconds.observe(waited.count(), batch.frames());
+            batch.clear();
+        }
+        return flushQueue(stream);
+    }
+
+    // Write queued data without blocking; the rest waits for select() to report room
+    bool flushQueue(Stream& stream) {
+        if (stream.vpn->flush() < 0) {
+            LOG_ERROR("Failed to write to network");
+            metrics.sslWriteErrors.add();
             return false;
         }
+        size_t queued = 0;
+        for (auto& other : streams)
+            queued += other->vpn->queued();
+        session.sendQueueBytes.set(queued);
+        return true;
+    }
+
+    // Whether any stream's send queue is full: TUN reads wait for the slowest stream
+    bool sendQueueFull() const {
+        for (auto& stream : streams) {
+            if (stream->vpn->sendQueueFull())
+                return true;
+        }
+        return false;
+    }
+
+    // Largest frame payload the server may send: GSO superpackets need the full 64 KB
+    size_t maxFrameSize() const {
+        return config.offload ? TunDevice::MAX_PACKET_SIZE : TunDevice::BUFFER_SIZE;
+    }
+
+    // Handle data transfer from VPN to TUN
+    bool handleVPNToTun(Stream& stream) {
+        FrameReader& rx = stream.rx;
+        // Read until EAGAIN: select() cannot see records OpenSSL has already buffered
+        while (true) {
+            // One read takes up to a whole TLS record, usually many frames
+            char* space = rx.space();
+            ssize_t n = stream.vpn->read(space, rx.spaceSize());
+            if (n < 0 && errno == EAGAIN)
+                return true;
+            if (n < 0) {
+                LOG_ERROR("Failed to read from network");
+                metrics.sslReadErrors.add();
+                return false;
+            }
+            if (n == 0) {
+                LOG_ERROR("Connection closed by peer");
+                return false;
+            }
+            rx.commit(n);
+            stream.lastReceived = chrono::steady_clock::now();
+
+            // Hand every complete frame to the TUN device straight from the receive buffer
+            char* packet;
+            size_t len;
+            while (rx.next(packet, len)) {
+                // Control messages are consumed here and never reach the TUN device
+                FrameKind kind = frameKind(packet, len);
+                if (kind == FRAME_CONTROL) {
+                    if (!handleControl(stream, packet, len))
+                        return false;
+                    continue;
+                }
+                if (kind == FRAME_COMPRESSED) {
+                    auto start = chrono::steady_clock::now();
+                    char* restored;
+                    size_t restoredLen;
+                    bool ok = compressor.decompress(packet, len, restored, restoredLen);
+                    metrics.decompressNanoseconds.add(
+                        chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+                    if (!ok) {
+                        LOG_ERROR("Invalid compressed frame from server");
+                        return false;
+                    }
+                    packet = restored;
+                    len = restoredLen;
+                    kind = frameKind(packet, len);
+                }
+
+                metrics.packetsReceived.add();
+                metrics.bytesReceived.add(len);
+                metrics.receivedSize.observe(len);
+                session.packetsReceived.add();
+                session.bytesReceived.add(len);
+                LOG_TRACE_RATE(20, "NET -> TUN [%lu]: %zu bytes", metrics.packetsReceived.get(), len);
+
+                // Write data to TUN device
+                if (!writeToTun(kind, packet, len)) {
+                    metrics.dropsTunWrite.add();
+                    LOG_ERROR("Failed to write to TUN");
+                    return false;
+                }
+            }
+            if (rx.corrupt()) {
+                LOG_ERROR("Invalid frame length from server");
+                return false;
+            }
+        }
+    }
+
+    // Writes a received packet (or superpacket) to the TUN device
+    bool writeToTun(FrameKind kind, char* packet, size_t len) {
+        if (kind == FRAME_PACKET)
+            return writeTun(packet, len);
+
+        struct virtio_net_hdr vnet;
+        PacketOffload::decodeHeader(*reinterpret_cast<const GsoFrameHeader*>(packet), vnet);
+        packet += sizeof(GsoFrameHeader);
+        len -= sizeof(GsoFrameHeader);
+        if (tun.hasOffload())
+            return writeTun(packet, len, &vnet);
+        return PacketOffload::resolve(packet, len, vnet, [&](const char* segment, size_t segmentLen) {
+            return writeTun(segment, segmentLen);
+        });
+    }
+
+    // Reads the next TUN packet into buffer (with -I, swaps in the buffer it was read into)
+    ssize_t readTun(struct virtio_net_hdr& vnet) {
+        if (ring)
+            return ring->read(buffer, &vnet);
+        return tun.read(buffer.data(), packets->bufferSize(), 0, &vnet);
+    }
+
+    // Writes to the TUN device, or queues the write on the ring (submitted before the next
+    // wait); either way the packet's memory is free again on return
+    bool writeTun(const char* packet, size_t len, const struct virtio_net_hdr* vnet = nullptr) {
+        if (ring)
+            return ring->write(packet, len, vnet);
+        return tun.write(packet, len, 0, vnet) > 0;
+    }
+
+    // What select() watches for TUN packets: the device, or the ring's eventfd
+    int tunFd() const {
+        return ring ? ring->getEventFd() : tun.getFd();
+    }
+
+    // Announces the optional frame kinds this client accepts on a stream
+    bool sendFeatures(Stream& stream) {
+        char frame[FRAME_HEADER_SIZE + sizeof(FeaturesMessage)];
+        uint16_t plength = htons(sizeof(FeaturesMessage));
+        FeaturesMessage msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = CONTROL_FEATURES;
+        // Superpackets need 64 KB frames, which do not fit a datagram
+        // The session's own connection asks for a stream token when striping
+        msg.features = htonl((tun.hasOffload() && !config.datagram ? (uint32_t)FEATURE_GSO : 0) |
+                             (config.compress ? (uint32_t)FEATURE_COMPRESSION : 0) |
+                             (config.streams > 1 && &stream == streams[0].get() ? (uint32_t)FEATURE_STREAMS : 0));
+        memcpy(frame, &plength, sizeof(plength));
+        memcpy(frame + FRAME_HEADER_SIZE, &msg, sizeof(msg));
+        stream.vpn->enqueue(frame, sizeof(frame));
+        return flushQueue(stream);
+    }
+
+    // Starts opening the extra streams (-S), which join the session with the server's token
+    // once connected (see advanceStreams). The loop carries on meanwhile. Striping only
+    // speeds things up, so a stream that cannot be opened is left out
+    void openStreams(const StreamTokenMessage& token) {
+        joinToken = token;
+        joinToken.type = CONTROL_JOIN_STREAM;
+        opening.clear();
+        for (size_t i = streams.size(); i < (size_t)config.streams; i++) {
+            auto connection = make_unique<VPNConnection>(false, config.datagram);
+            // The first step only gets as far as waiting for the TCP connect
+            if ((!certPath.empty() && !keyPath.empty() && !connection->configureCertificates(certPath, keyPath)) ||
+                !connection->startConnect(serverIP, port) || connection->handshake() < 0) {
+                LOG_WARN("Failed to open stream %zu to %s", i + 1, serverIP.c_str());
+                break;
+            }
+            opening.push_back({move(connection), false});
+        }
+        openingDeadline = chrono::steady_clock::now() + chrono::milliseconds(Tunnel::CONNECT_TIMEOUT_MS);
+        if (opening.empty())
+            joinStreams();
+    }
+
+    // Advances the handshakes of the opening streams whose sockets are ready, giving up on
+    // the ones out of time. Once none is left waiting, the ones that made it join together,
+    // so flows move between streams once rather than with every stream that comes up
+    void advanceStreams(const fd_set& readSet, const fd_set& writeSet) {
+        bool expired = chrono::steady_clock::now() >= openingDeadline;
+        bool waiting = false;
+        for (auto it = opening.begin(); it != opening.end();) {
+            int r = 1;
+            if (!it->ready) {
+                int fd = it->connection->getFd();
+                r = FD_ISSET(fd, &readSet) || FD_ISSET(fd, &writeSet) ? it->connection->handshake() : 0;
+            }
+            if (r > 0 || (r == 0 && !expired)) {
+                it->ready = r > 0;
+                waiting |= r == 0;
+                ++it;
+                continue;
+            }
+            if (r == 0)
+                LOG_WARN("Opening a stream to %s timed out", serverIP.c_str());
+            else
+                LOG_WARN("Failed to open a stream to %s", serverIP.c_str());
+            it = opening.erase(it);
+        }
+        if (!waiting)
+            joinStreams();
+    }
+
+    // Turns the opened connections into extra streams of the session
+    void joinStreams() {
+        char frame[FRAME_HEADER_SIZE + sizeof(StreamTokenMessage)];
+        uint16_t plength = htons(sizeof(StreamTokenMessage));
+        memcpy(frame, &plength, sizeof(plength));
+        memcpy(frame + FRAME_HEADER_SIZE, &joinToken, sizeof(joinToken));
+
+        for (OpeningStream& opened : opening) {
+            if (config.fairQueue && !opened.connection->setUnsentLimit(FairQueue::BACKLOG_BYTES))
+                LOG_WARN("Failed to limit unsent bytes");
+            auto stream = make_unique<Stream>(opened.connection.get(), maxFrameSize(), config.batchSize);
+            stream->owned = move(opened.connection);
+            // The join goes first: the server reads it before it would start a session of its own
+            stream->vpn->enqueue(frame, sizeof(frame));
+            if (!sendFeatures(*stream) || (config.keepalive && !sendKeepalive(*stream))) {
+                LOG_WARN("Failed to join stream %zu to the session", streams.size() + 1);
+                continue;
+            }
+            streams.push_back(move(stream));
+        }
+        opening.clear();
+        LOG_INFO("Striping flows over %zu streams", streams.size());
+    }
+
+    // Tells the server the stream is alive, and how often it will hear that
+    bool sendKeepalive(Stream& stream) {
+        char frame[FRAME_HEADER_SIZE + sizeof(KeepaliveMessage)];
+        uint16_t plength = htons(sizeof(KeepaliveMessage));
+        KeepaliveMessage msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = CONTROL_KEEPALIVE;
+        msg.interval = htons(config.keepalive);
+        memcpy(frame, &plength, sizeof(plength));
+        memcpy(frame + FRAME_HEADER_SIZE, &msg, sizeof(msg));
+        stream.vpn->enqueue(frame, sizeof(frame));
+        stream.lastSent = chrono::steady_clock::now();
+        metrics.keepalivesSent.add();
+        return flushQueue(stream);
+    }
+
+    // Gives the tunnel up if the server went silent on a stream, and sends a keepalive on
+    // each stream that carried nothing else for an interval. False if the tunnel failed
+    bool checkKeepalive() {
+        auto now = chrono::steady_clock::now();
+        for (auto& stream : streams) {
+            if (peerKeepalive && now - stream->lastReceived >= chrono::seconds(peerKeepalive * KEEPALIVE_MISSES)) {
+                LOG_ERROR("Nothing from the server for %d s", peerKeepalive * KEEPALIVE_MISSES);
+                metrics.connectionsTimedOut.add();
+                return false;
+            }
+            if (config.keepalive && now - stream->lastSent >= chrono::seconds(config.keepalive) &&
+                !sendKeepalive(*stream))
+                return false;
+        }
+        return true;
+    }
+
+    // How long select() may sleep: until a keepalive check is due or the opening streams run out of time
+    int loopTimeout() const {
+        int timeout = keepaliveTimeout();
+        if (opening.empty())
+            return timeout;
+        auto wait = chrono::ceil<chrono::milliseconds>(openingDeadline - chrono::steady_clock::now());
+        int opened = max<long>(wait.count(), 0);
+        return timeout < 0 ? opened : min(timeout, opened);
+    }
+
+    // Milliseconds until checkKeepalive() has something to do (rounded up), -1 for never
+    int keepaliveTimeout() const {
+        auto next = chrono::steady_clock::time_point::max();
+        for (auto& stream : streams) {
+            if (config.keepalive)
+                next = min(next, stream->lastSent + chrono::seconds(config.keepalive));
+            if (peerKeepalive)
+                next = min(next, stream->lastReceived + chrono::seconds(peerKeepalive * KEEPALIVE_MISSES));
+        }
+        if (next == chrono::steady_clock::time_point::max())
+            return -1;
+        auto wait = chrono::ceil<chrono::milliseconds>(next - chrono::steady_clock::now());
+        return max<long>(wait.count(), 0);
+    }
+
+    // Asks the server for the address this client had before the tunnel dropped
+    bool requestAddress() {
+        char frame[FRAME_HEADER_SIZE + sizeof(AssignAddressMessage)];
+        uint16_t plength = htons(sizeof(AssignAddressMessage));
+        AssignAddressMessage msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = CONTROL_REQUEST_ADDRESS;
+        msg.address = assignedAddress;
+        memcpy(frame, &plength, sizeof(plength));
+        memcpy(frame + FRAME_HEADER_SIZE, &msg, sizeof(msg));
+        vpn.enqueue(frame, sizeof(frame));
+        // The server answers with an assignment after the one it sends every new client
+        skipAssignments = 1;
+        return flushQueue(*streams[0]);
+    }
+
+    // Handle a control message from the server
+    bool handleControl(Stream& stream, const char* payload, size_t len) {
+        // The server keeps every stream alive; the interval is the same on each
+        if ((uint8_t)payload[0] == CONTROL_KEEPALIVE && len >= sizeof(KeepaliveMessage)) {
+            KeepaliveMessage msg;
+            memcpy(&msg, payload, sizeof(msg));
+            metrics.keepalivesReceived.add();
+            peerKeepalive = ntohs(msg.interval);
+            return true;
+        }
+        // Extra streams only carry packets; what the server says there (an address of
+        // its own, the same features) is for connections that are sessions of their own
+        if (&stream != streams[0].get())
+            return true;
+        if ((uint8_t)payload[0] == CONTROL_ASSIGN_ADDRESS && len >= sizeof(AssignAddressMessage)) {
+            if (skipAssignments > 0) {
+                skipAssignments--;
+                return true;
+            }
+            AssignAddressMessage msg;
+            memcpy(&msg, payload, sizeof(msg));
+            assignedAddress = msg.address;
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &msg.address, ip, sizeof(ip));
+            string cidr = string(ip) + "/" + to_string(msg.prefixLen);
+            LOG_INFO("Server assigned address %s", cidr.c_str());
+            if (!tun.assignAddress(cidr)) {
+                LOG_ERROR("Failed to apply assigned address");
+                return false;
+            }
+            // Labels are set once, before the exporter can see them
+            if (session.address.empty()) {
+                session.address = ip;
+                session.peer = serverIP + ":" + to_string(port);
+                Metrics::addSession(&session);
+            }
+            return true;
+        }
+        if ((uint8_t)payload[0] == CONTROL_FEATURES && len >= sizeof(FeaturesMessage)) {
+            FeaturesMessage msg;
+            memcpy(&msg, payload, sizeof(msg));
+            peerGso = ntohl(msg.features) & FEATURE_GSO;
+            peerCompression = ntohl(msg.features) & FEATURE_COMPRESSION;
+            return true;
+        }
+        if ((uint8_t)payload[0] == CONTROL_STREAM_TOKEN && len >= sizeof(StreamTokenMessage)) {
+            StreamTokenMessage token;
+            memcpy(&token, payload, sizeof(token));
+            openStreams(token);
+            return true;
+        }
+        // Unknown control messages are ignored for forward compatibility
         return true;
     }
 
     // Print statistics of packets sent and received
     void printStatistics() {
         cout << "\nStatistics:\n"
-                  << "Packets sent: " << packets_sent << "\n"
-                  << "Packets received: " << packets_received << endl;
+                  << "Packets sent: " << metrics.packetsSent.get() << "\n"
+                  << "Packets received: " << metrics.packetsReceived.get() << "\n"
+                  << "kTLS send: " << (vpn.kernelTlsSend() ? "kernel" : "user space") << "\n"
+                  << "kTLS receive: " << (vpn.kernelTlsReceive() ? "kernel" : "user space") << endl;
+        if (config.compress) {
+            uint64_t in = metrics.compressInputBytes.get();
+            cout << "Packets compressed: " << metrics.packetsCompressed.get() << " of "
+                 << metrics.packetsCompressed.get() + metrics.packetsUncompressed.get()
+                 << " (" << (in ? 100.0 * metrics.compressOutputBytes.get() / in : 100.0) << "% of their size, "
+                 << metrics.compressNanoseconds.get() / 1e6 << " ms compressing, "
+                 << metrics.decompressNanoseconds.get() / 1e6 << " ms decompressing)" << endl;
+        }
+        if (config.reconnect) {
+            cout << "Reconnects: " << metrics.reconnects.get() << " (" << metrics.packetsHeld.get()
+                 << " packets held, " << metrics.dropsHeld.get() << " of them dropped)" << endl;
+        }
+        if (config.keepalive || metrics.keepalivesReceived.get()) {
+            cout << "Keepalives sent/received: " << metrics.keepalivesSent.get() << "/"
+                 << metrics.keepalivesReceived.get() << ", tunnels timed out: "
+                 << metrics.connectionsTimedOut.get() << endl;
+        }
+        if (ring) {
+            cout << "TUN reads and writes through io_uring: " << metrics.ringPackets.get() << " in "
+                 << metrics.ringEnters.get() << " io_uring_enter calls" << endl;
+        }
     }
 };
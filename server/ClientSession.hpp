@@ -0,0 +1,74 @@
+#pragma once
+#include "../tun_interface/TunDevice.hpp"
+#include "../tunneling/Tunnel.hpp"
+#include "../tunneling/FrameBatcher.hpp"
+#include "../tunneling/FrameReader.hpp"
+#include "../tunneling/Frame.hpp"
+#include "../tun_interface/Metrics.hpp"
+#include "../tun_interface/FairQueue.hpp"
+#include "../tun_interface/TimerWheel.hpp"
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+// State the server keeps for one connected VPN client
+struct ClientSession {
+    // Secure channel to the client (owns the socket)
+    std::unique_ptr<Tunnel> tunnel;
+    // Remote address, for log messages
+    std::string peer;
+    // Inner IPv4 address assigned to the client from the pool (network order)
+    uint32_t virtualIp = 0;
+    // The time limit on the handshake and the client's first frame, then the next keepalive
+    // check. Armed on the wheel of the worker that has the session, with the socket as its data
+    TimerWheel::Timer timer;
+    // When anything last went to the client and came from it
+    std::chrono::steady_clock::time_point lastSent, lastReceived;
+    // Seconds between the client's keepalives, from its CONTROL_KEEPALIVE (0: it sends none)
+    int peerKeepalive = 0;
+
+    // Received bytes not yet parsed into frames, including a partial frame between edges
+    FrameReader rx;
+
+    // The client accepts FRAME_GSO superpackets (announced in CONTROL_FEATURES)
+    bool peerGso = false;
+    // The client accepts FRAME_COMPRESSED frames (announced in CONTROL_FEATURES)
+    bool peerCompression = false;
+
+    // Frames waiting to be sent to the client as one record
+    FrameBatcher txBatch;
+    // When the first frame of the current batch was read off the TUN device
+    std::chrono::steady_clock::time_point txBatchStart;
+    // Whether the session is on the server's list of batches to flush
+    bool txQueued = false;
+    // Whether EPOLLOUT is in the session's event mask (only while the tunnel waits to write)
+    bool writeArmed = false;
+    // Fair queueing (-f): packets for this connection waiting for room in its send queue
+    FairQueue egress;
+
+    // Per-session counters, exported once the owning worker registers the session
+    SessionMetrics metrics;
+
+    // Striping: a session (the client's first connection) owns the address, and the
+    // client's further connections join it as extra streams, all on the same worker.
+    // The session lists its extra streams and each extra stream points back to it
+    std::vector<ClientSession*> streams;
+    ClientSession* primary = nullptr;
+    // Session: the token handed out for joining it (joinId 0: none yet)
+    uint64_t joinId = 0;
+    uint8_t joinSecret[16];
+    // Extra stream: the token of its CONTROL_JOIN_STREAM, the first frame it sent
+    StreamTokenMessage join;
+
+    // Counters of the logical session, shared by all its streams
+    SessionMetrics& sessionMetrics() { return primary ? primary->metrics : metrics; }
+
+    ClientSession(size_t batchSize, size_t maxFrame)
+        : rx(maxFrame), txBatch(batchSize) {}
+
+    ~ClientSession() { Metrics::removeSession(&metrics); }
+
+    int getFd() const { return tunnel->get_socket_fd(); }
+};
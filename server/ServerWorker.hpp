@@ -0,0 +1,88 @@
+#pragma once
+#include "../tun_interface/TunDevice.hpp"
+#include "../tun_interface/EventLoop.hpp"
+#include "../tun_interface/RouteTable.hpp"
+#include "../tun_interface/Metrics.hpp"
+#include "../tun_interface/PacketPool.hpp"
+#include "../tun_interface/TunRing.hpp"
+#include "../tun_interface/TimerWheel.hpp"
+#include "../tunneling/FrameCompressor.hpp"
+#include "ClientSession.hpp"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Request handed to a worker from another thread through its inbox
+struct WorkerMessage {
+    enum Type {
+        NEW_SESSION,  // Take ownership of an accepted session
+        PACKET,       // TUN packet read on another queue for one of this worker's sessions
+        ROUTE_ADD,    // A client address now belongs to another worker
+        ROUTE_DEL,    // A client address is no longer in use
+        JOIN_STREAM,  // Take a connection that joins one of this worker's sessions as a stream
+    };
+
+    Type type;
+    std::unique_ptr<ClientSession> session;  // NEW_SESSION / JOIN_STREAM
+    IpAddress address;                       // ROUTE_ADD / ROUTE_DEL
+    int worker = 0;                          // ROUTE_ADD: owning worker
+    PacketHandle packet;                     // PACKET: the buffer it was read into
+    struct virtio_net_hdr vnet = {};         // PACKET: offload request from the TUN device
+};
+
+// Where a client address lives: the owning worker and, on that worker only, its session
+struct SessionRoute {
+    int worker = -1;
+    ClientSession* session = nullptr;
+};
+
+// Per-thread server state: one event loop serving one TUN queue and a share of the sessions.
+// Only the owning thread touches anything but the inbox.
+struct ServerWorker {
+    // Resolution of the handshake and keepalive timers
+    static constexpr int TIMER_TICK_MS = 100;
+
+    int index;          // Worker number, also the TUN queue it serves
+    EventLoop loop;     // epoll instance for the TUN queue, the inbox and the sessions
+    int wakeFd = -1;    // eventfd signalled when the inbox gets messages
+    std::thread thread; // Empty for worker 0, which runs on the caller's thread
+    // Handshake time limits (worker 0) and keepalive checks of the sessions, by socket
+    TimerWheel timers;
+
+    // Connected clients owned by this worker, keyed by socket file descriptor
+    std::unordered_map<int, std::unique_ptr<ClientSession>> sessions;
+    // Private copy of the address -> owner table, so lookups never take a lock
+    RouteTable<SessionRoute> routes;
+    // Sessions with frames batched during the current TUN drain
+    std::vector<int> pendingFlush;
+    PacketCache* packets;  // This thread's free list of pooled packet buffers
+    PacketHandle buffer;   // Buffer the next TUN packet is read into
+    std::unique_ptr<TunRing> ring;  // io_uring backend for the TUN queue (-I); null on the epoll path
+    FrameCompressor compressor;  // Scratch state for compressing and restoring frames
+    // Sessions that handed out a stream token, by token id; nextJoinId numbers the tokens
+    std::unordered_map<uint64_t, ClientSession*> joinable;
+    uint64_t nextJoinId = 0;
+
+    // Messages from other workers
+    std::mutex inboxLock;
+    std::vector<WorkerMessage> inbox;
+
+    // This worker's packet, drop, error and session counters
+    MetricsShard metrics;
+
+    ServerWorker(int index, PacketPool& pool)
+        : index(index), timers(std::chrono::milliseconds(TIMER_TICK_MS)), packets(pool.cache()) {
+        Metrics::addShard(&metrics);
+    }
+
+    ~ServerWorker() {
+        ring.reset();  // Its last completions are still counted in metrics
+        Metrics::removeShard(&metrics);
+        if (wakeFd >= 0)
+            close(wakeFd);
+    }
+};
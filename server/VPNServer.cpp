@@ -1,23 +1,82 @@
 #include "../tun_interface/TunDevice.hpp"
 #include "../tun_interface/VPNConnection.hpp"
+#include "../tun_interface/EventLoop.hpp"
+#include "../tun_interface/AddressPool.hpp"
+#include "../tun_interface/RouteTable.hpp"
+#include "../tun_interface/PacketOffload.hpp"
+#include "../tun_interface/Logger.hpp"
+#include "../tun_interface/Metrics.hpp"
+#include "../tun_interface/PacketPool.hpp"
+#include "../tun_interface/FlowHash.hpp"
+#include "../tun_interface/TimerWheel.hpp"
+#include "../tunneling/Frame.hpp"
+#include "../src/VPNConfig.hpp"
+#include "ClientSession.hpp"
+#include "ServerWorker.hpp"
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
 #include <cstring>  // For memset
+#include <arpa/inet.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <unistd.h>
 using namespace std;
 class VPNServer {
+public:
+    // Network client addresses are handed out from (routed to the TUN device by TunDevice)
+    static constexpr const char* CLIENT_NETWORK = "10.0.1.0/24";
+    // Handshakes run at once; further clients wait in the kernel's accept queue
+    static constexpr size_t MAX_HANDSHAKES = 128;
+    // A client that has not finished its handshake by then is dropped
+    static constexpr int HANDSHAKE_TIMEOUT_MS = 10000;
+    // Datagram mode: how often lost handshake flights are checked for retransmission
+    static constexpr int DTLS_TIMER_MS = 100;
+
 private:
-    TunDevice tun;  
-    VPNConnection vpn;  
-    string interfaceName; 
-    int port;  
-    char buffer[TunDevice::BUFFER_SIZE];  // Buffer for data
-    unsigned long packets_sent, packets_received;  // Packet counters
+    TunDevice tun;
+    VPNConnection vpn;
+    string interfaceName;
+    int port;
+    VPNConfig config;  // Command line settings (batching limits, queue count)
+    // Buffers TUN packets are read into, sized for the largest one; outlives the workers
+    PacketPool packetPool;
+
+    // One worker per TUN queue; worker 0 also accepts new clients
+    vector<unique_ptr<ServerWorker>> workers;
+    // Next worker to receive an accepted session (round robin)
+    int nextWorker;
+    // Set when any worker fails, so the others leave their loops
+    atomic<bool> stopping;
+    // signalfd delivering SIGHUP (certificate reload) to worker 0
+    int reloadFd = -1;
+
+    // Clients whose handshake is still running, keyed by socket; worker 0 only
+    unordered_map<int, unique_ptr<ClientSession>> handshakes;
+    // Accepting stopped at MAX_HANDSHAKES with connections possibly left in the queue
+    bool acceptBacklog = false;
+
+    // Client address allocation, shared by all workers
+    AddressPool addressPool;
+    mutex addressLock;
 
 public:
-    VPNServer(const string& iface, int port) 
-        : tun(iface, true), vpn(true), interfaceName(iface), port(port) {
-        // Initialize packet counters
-        packets_sent = 0;
-        packets_received = 0;
+    VPNServer(const VPNConfig& config)
+        : tun(config.ifaceName, true, config.queues, config.offload), vpn(true, config.datagram), interfaceName(config.ifaceName),
+          port(config.port), config(config), packetPool(tun.getMaxPacketSize()), nextWorker(0), stopping(false) {
+    }
+
+    ~VPNServer() {
+        if (reloadFd >= 0)
+            close(reloadFd);
     }
 
     bool initialize() {
@@ -26,119 +85,1173 @@ public:
             cerr << "Failed to initialize TUN device\n";
             return false;
         }
-        cout << "Successfully initialized TUN device " << interfaceName << endl;
+        cout << "Successfully initialized TUN device " << interfaceName
+             << " with " << tun.getQueueCount() << " queue(s)" << endl;
+
+        // Each packet travels in its own datagram, so it must leave room for the outer headers
+        if (config.datagram && !tun.setMtu(Tunnel::DATAGRAM_MTU)) {
+            cerr << "Failed to set TUN MTU\n";
+            return false;
+        }
+
+        // Record what passes the TUN queues, instead of running tcpdump on the interface
+        if (config.capturePath[0] && !tun.enableCapture(config.capturePath, (size_t)config.captureFileMb << 20,
+                                                        config.captureFiles, config.captureSample, config.captureHosts)) {
+            cerr << "Failed to start packet capture\n";
+            return false;
+        }
 
         // Bind the VPN server to the specified port
+        Tunnel::setKernelTls(config.ktls);
+        Tunnel::setTicketRotation(config.ticketRotation);
+        Tunnel::setCipherPolicy(CipherPolicy{config.cipherSuites, config.groups});
         if (!vpn.bind(port)) {
             cerr << "Failed to bind VPN server to port " << port << endl;
             return false;
         }
         cout << "Successfully bound to port " << port << endl;
 
-        // Accept a client connection
-        if (!vpn.accept()) {
-            cerr << "Failed to accept client connection\n";
+        if (!addressPool.initialize(CLIENT_NETWORK)) {
+            cerr << "Failed to initialize client address pool\n";
+            return false;
+        }
+
+        // Edge-triggered watching requires every descriptor to be drained until EAGAIN.
+        // io_uring reads wait in the kernel instead, so with -I the queues stay blocking
+        if (!config.ioUring && !tun.setNonBlocking(true)) {
+            cerr << "Failed to make TUN device non-blocking\n";
             return false;
         }
-        
-        cout << "Server initialization complete\n";
+
+        // SIGHUP reloads the certificate. Worker 0 reads it from a signalfd between events,
+        // so it is blocked here, before any worker thread exists to inherit the mask
+        sigset_t hup;
+        sigemptyset(&hup);
+        sigaddset(&hup, SIGHUP);
+        if (pthread_sigmask(SIG_BLOCK, &hup, nullptr) != 0 ||
+            (reloadFd = signalfd(-1, &hup, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+            perror("signalfd()");
+            return false;
+        }
+
+        for (int q = 0; q < tun.getQueueCount(); q++) {
+            auto worker = make_unique<ServerWorker>(q, packetPool);
+            if (config.ioUring) {
+                worker->ring = make_unique<TunRing>(tun, q, worker->packets, worker->metrics);
+                if (!worker->ring->initialize()) {
+                    cerr << "Failed to set up io_uring for TUN queue " << q << ": " << strerror(errno) << "\n";
+                    return false;
+                }
+            }
+            worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (worker->wakeFd < 0 ||
+                !worker->loop.initialize() ||
+                !worker->loop.add(tunFd(*worker), EPOLLIN | EPOLLET) ||
+                !worker->loop.add(worker->wakeFd, EPOLLIN | EPOLLET) ||
+                (q == 0 && !worker->loop.add(vpn.getListenFd(), EPOLLIN | EPOLLET)) ||
+                (q == 0 && !worker->loop.add(reloadFd, EPOLLIN | EPOLLET))) {
+                cerr << "Failed to set up event loop for worker " << q << "\n";
+                return false;
+            }
+            workers.push_back(move(worker));
+        }
+
+        cout << "Server initialization complete, waiting for clients\n";
         return true;
     }
 
     bool run() {
-        while (true) {
-            fd_set readSet;  // File descriptor set for select
-            FD_ZERO(&readSet);  // Clear the set
-            FD_SET(tun.getFd(), &readSet);  // Add TUN device file descriptor to the set
-            FD_SET(vpn.getFd(), &readSet);  // Add VPN connection file descriptor to the set
-
-            // Get the maximum file descriptor value?? why? 
-            // The select() function requires the maximum file descriptor value plus one as the first argument.
-            int maxFd = max(tun.getFd(), vpn.getFd()) + 1;
-            // Wait for data on either file descriptor
-            if (select(maxFd, &readSet, nullptr, nullptr, nullptr) < 0) {
-                perror("select()");
-                printStatistics();
-                return false;
+        // Extra queues get their own thread pinned to a core; worker 0 runs here
+        for (size_t i = 1; i < workers.size(); i++) {
+            ServerWorker* worker = workers[i].get();
+            worker->thread = thread([this, worker] { runWorker(*worker); });
+            pinToCore(worker->thread.native_handle(), worker->index);
+        }
+        if (workers.size() > 1)
+            pinToCore(pthread_self(), 0);
+
+        bool ok = runWorker(*workers[0]);
+
+        for (size_t i = 1; i < workers.size(); i++)
+            workers[i]->thread.join();
+        printStatistics();
+        return ok;
+    }
+
+    // Makes run() return; safe to call from any thread
+    void stop() {
+        if (!stopping.exchange(true)) {
+            for (auto& worker : workers)
+                wake(*worker);
+        }
+    }
+
+    const TunDevice& getTunDevice() const { return tun; }
+
+private:
+    bool runWorker(ServerWorker& worker) {
+        struct epoll_event events[EventLoop::MAX_EVENTS];
+        bool ok = true;
+        if (worker.ring && !worker.ring->start()) {
+            perror("io_uring_enter()");
+            ok = false;
+        }
+        while (ok && !stopping) {
+            // Wait for activity on the listen socket, the TUN queue, the inbox or any session
+            int n = worker.loop.wait(events, EventLoop::MAX_EVENTS, waitTimeout(worker));
+            if (n < 0) {
+                perror("epoll_wait()");
+                ok = false;
+                break;
             }
 
-            // Check if there is data to read from the TUN device
-            if (FD_ISSET(tun.getFd(), &readSet)) {
-                if (!handleTunToVPN()) {
-                    printStatistics();
-                    return false;
+            for (int i = 0; i < n && ok; i++) {
+                int fd = events[i].data.fd;
+
+                if (fd == vpn.getListenFd()) {
+                    acceptClients(worker);
+                } else if (fd == tunFd(worker)) {
+                    ok = handleTunToVPN(worker);
+                } else if (fd == worker.wakeFd) {
+                    handleInbox(worker);
+                } else if (fd == reloadFd) {
+                    reloadCertificates();
+                } else if (auto it = worker.sessions.find(fd); it != worker.sessions.end()) {
+                    handleSessionEvents(worker, *it->second, events[i].events);
+                } else if (auto it = handshakes.find(fd); it != handshakes.end()) {
+                    advanceHandshake(worker, *it->second);
                 }
+                // Otherwise the session was closed earlier in this batch
+            }
+            // The TUN writes of the whole batch go to the kernel in one io_uring_enter
+            if (ok && worker.ring && !worker.ring->submit()) {
+                perror("io_uring_enter()");
+                ok = false;
             }
+            if (worker.index == 0 && config.datagram && !handshakes.empty())
+                retransmitHandshakes(worker);
+            runTimers(worker);
+        }
 
-            // Check if there is data to read from the VPN connection
-            if (FD_ISSET(vpn.getFd(), &readSet)) {
-                if (!handleVPNToTun()) {
-                    printStatistics();
-                    return false;
-                }
+        // Bring the other workers down with this one
+        if (!stopping.exchange(true)) {
+            for (auto& other : workers) {
+                if (other.get() != &worker)
+                    wake(*other);
+            }
+        }
+        return ok;
+    }
+
+    // Runs whatever a session's readiness unblocked; a slow client only ever waits for
+    // its own socket, never holding up the loop
+    void handleSessionEvents(ServerWorker& worker, ClientSession& session, uint32_t events) {
+        Tunnel& tunnel = *session.tunnel;
+        bool ok = true;
+        if (events & EPOLLIN) {
+            ok = handleVPNToTun(worker, session);
+            // A queued write that was waiting for incoming handshake data can go on now
+            if (ok && tunnel.write_wants_read() && !flushSession(worker, session))
+                return;
+        }
+        if (ok && (events & EPOLLOUT)) {
+            if (!flushSession(worker, session))
+                return;
+            if (tunnel.read_wants_write())
+                ok = handleVPNToTun(worker, session);
+        }
+        if (!ok || (events & (EPOLLHUP | EPOLLERR))) {
+            closeSession(worker, session);
+            return;
+        }
+        updateEvents(worker, session);
+    }
+
+    // Watches a session for writability only while its tunnel waits for it,
+    // so sessions with an empty send queue cost no wakeups
+    bool updateEvents(ServerWorker& worker, ClientSession& session) {
+        bool want = session.tunnel->wants_write();
+        if (want == session.writeArmed)
+            return true;
+        session.writeArmed = want;
+        return worker.loop.modify(session.getFd(), EPOLLIN | EPOLLRDHUP | EPOLLET | (want ? (uint32_t)EPOLLOUT : 0));
+    }
+
+    // Swaps in a context built from the current certificate files; sessions keep theirs
+    void reloadCertificates() {
+        struct signalfd_siginfo info;
+        while (read(reloadFd, &info, sizeof(info)) == sizeof(info)) {
+        }
+        if (Tunnel::reloadCertificates())
+            LOG_INFO("Reloaded certificate and key");
+        else
+            LOG_ERROR("Certificate reload failed, keeping the current certificate");
+    }
+
+    static void pinToCore(pthread_t thread, int index) {
+        unsigned cores = std::thread::hardware_concurrency();
+        if (cores == 0)
+            return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cores, &set);
+        if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0)
+            cerr << "Failed to pin worker " << index << " to a core\n";
+    }
+
+    // Queues a message for another worker and wakes it if it might be sleeping
+    void post(ServerWorker& target, WorkerMessage message) {
+        bool wasEmpty;
+        {
+            lock_guard<mutex> lock(target.inboxLock);
+            wasEmpty = target.inbox.empty();
+            target.inbox.push_back(move(message));
+        }
+        if (wasEmpty)
+            wake(target);
+    }
+
+    static void wake(ServerWorker& target) {
+        uint64_t one = 1;
+        if (write(target.wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("eventfd write");
+    }
+
+    void handleInbox(ServerWorker& worker) {
+        uint64_t count;
+        while (read(worker.wakeFd, &count, sizeof(count)) > 0) {}
+
+        vector<WorkerMessage> messages;
+        {
+            lock_guard<mutex> lock(worker.inboxLock);
+            messages.swap(worker.inbox);
+        }
+
+        for (WorkerMessage& message : messages) {
+            switch (message.type) {
+            case WorkerMessage::NEW_SESSION:
+                addSession(worker, move(message.session));
+                break;
+            case WorkerMessage::PACKET:
+                deliverPacket(worker, message.vnet, message.packet);
+                break;
+            case WorkerMessage::ROUTE_ADD: {
+                SessionRoute route;
+                route.worker = message.worker;
+                worker.routes.insert(message.address, route);
+                break;
+            }
+            case WorkerMessage::JOIN_STREAM:
+                linkStream(worker, move(message.session));
+                break;
+            case WorkerMessage::ROUTE_DEL: {
+                // Only drop the entry if it still points to another worker
+                SessionRoute* route = worker.routes.find(message.address);
+                if (route && route->worker != worker.index)
+                    worker.routes.erase(message.address);
+                break;
+            }
+            }
+        }
+        flushPending(worker);
+    }
+
+    // Takes queued connections and starts their handshakes. Nothing here blocks: the
+    // handshakes proceed in advanceHandshake() as their sockets become ready.
+    void acceptClients(ServerWorker& worker) {
+        acceptBacklog = false;
+        while (true) {
+            if (handshakes.size() >= MAX_HANDSHAKES) {
+                // The listen edge will not fire again for what is left; resumed when one finishes
+                acceptBacklog = true;
+                return;
+            }
+
+            string peer;
+            unique_ptr<Tunnel> tunnel = vpn.acceptSession(peer);
+            if (!tunnel) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                continue;  // A failed accept only costs that one client
+            }
+
+            auto session = make_unique<ClientSession>(config.batchSize, maxFrameSize());
+            session->tunnel = move(tunnel);
+            session->peer = peer;
+            int fd = session->getFd();
+            session->timer.data = fd;
+            worker.timers.schedule(session->timer, chrono::steady_clock::now() + chrono::milliseconds(HANDSHAKE_TIMEOUT_MS));
+            // The handshake may wait in either direction
+            if (!worker.loop.add(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+                continue;
+            ClientSession& pending = *session;
+            handshakes[fd] = move(session);
+            worker.metrics.handshakesPending.set(handshakes.size());
+            advanceHandshake(worker, pending);
+        }
+    }
+
+    // Runs a handshake as far as the socket allows, then waits for the client's first frame:
+    // a CONTROL_JOIN_STREAM makes the connection an extra stream of a session, anything
+    // else starts a session of its own. Either way the connection is handed on
+    void advanceHandshake(ServerWorker& worker, ClientSession& pending) {
+        if (!pending.tunnel->is_connected()) {
+            int r = pending.tunnel->handshake();
+            if (r == 0)
+                return;
+            if (r < 0) {
+                LOG_WARN("Handshake with %s failed", pending.peer.c_str());
+                worker.metrics.handshakesFailed.add();
+                endHandshake(worker, pending.getFd());
+                return;
+            }
+            LOG_DEBUG("Handshake with %s complete", pending.peer.c_str());
+        }
+        int r = readFirstFrame(pending);
+        if (r == 0)
+            return;
+
+        int fd = pending.getFd();
+        unique_ptr<ClientSession> session = move(handshakes[fd]);
+        endHandshake(worker, fd);
+        if (r < 0) {
+            LOG_WARN("Connection from %s failed before its first frame", session->peer.c_str());
+            return;
+        }
+        // Off this worker's wheel: the session may go to another worker, which arms its own timer
+        session->timer.cancel();
+        char* payload;
+        size_t len;
+        session->rx.peek(payload, len);
+        if ((uint8_t)payload[0] == CONTROL_JOIN_STREAM && len >= sizeof(StreamTokenMessage)) {
+            memcpy(&session->join, payload, sizeof(session->join));
+            session->rx.next(payload, len);
+            joinStream(worker, move(session));
+            return;
+        }
+        startSession(worker, move(session));
+    }
+
+    // Receives until a whole frame is buffered, leaving it there. Returns 0 while it is
+    // incomplete and -1 if the connection failed; the owning worker drains the rest
+    int readFirstFrame(ClientSession& pending) {
+        char* payload;
+        size_t len;
+        while (!pending.rx.peek(payload, len)) {
+            if (pending.rx.corrupt())
+                return -1;
+            ssize_t n = pending.tunnel->receive(pending.rx.space(), pending.rx.spaceSize());
+            if (n < 0 && errno == EAGAIN)
+                return 0;
+            if (n <= 0)
+                return -1;
+            pending.rx.commit(n);
+            pending.lastReceived = chrono::steady_clock::now();
+        }
+        return 1;
+    }
+
+    // Datagram mode: drives the handshakes' DTLS retransmission timers
+    void retransmitHandshakes(ServerWorker& worker) {
+        vector<int> failed;
+        for (auto& entry : handshakes) {
+            ClientSession& pending = *entry.second;
+            if (!pending.tunnel->handshake_timer()) {
+                LOG_WARN("Handshake with %s failed", pending.peer.c_str());
+                worker.metrics.handshakesFailed.add();
+                failed.push_back(entry.first);
+            }
+        }
+        // Ending one may accept new clients into the map, so not while iterating it
+        for (int fd : failed)
+            endHandshake(worker, fd);  // Destroys the session, which closes the socket
+    }
+
+    // Fires the worker's due timers: handshake time limits and keepalive checks. A timer
+    // belongs to a live connection (destroying one cancels it), found by its socket
+    void runTimers(ServerWorker& worker) {
+        auto now = chrono::steady_clock::now();
+        worker.timers.advance(now, [&](TimerWheel::Timer& timer) {
+            int fd = timer.data;
+            if (auto it = worker.sessions.find(fd); it != worker.sessions.end()) {
+                checkKeepalive(worker, *it->second, now);
+            } else if (worker.index == 0 && handshakes.count(fd)) {
+                LOG_WARN("Handshake with %s timed out", handshakes[fd]->peer.c_str());
+                worker.metrics.handshakesTimedOut.add();
+                endHandshake(worker, fd);
+            }
+        });
+        worker.metrics.timersArmed.set(worker.timers.armed());
+    }
+
+    // A session's timer fired: closes the connection if the client went silent, sends a
+    // keepalive if nothing else went out for an interval, and arms the next check
+    void checkKeepalive(ServerWorker& worker, ClientSession& session, chrono::steady_clock::time_point now) {
+        if (session.peerKeepalive &&
+            now - session.lastReceived >= chrono::seconds(session.peerKeepalive * KEEPALIVE_MISSES)) {
+            LOG_WARN("Nothing from %s for %d s, closing the connection", session.peer.c_str(),
+                     session.peerKeepalive * KEEPALIVE_MISSES);
+            worker.metrics.connectionsTimedOut.add();
+            closeSession(worker, session);
+            return;
+        }
+        if (config.keepalive && now - session.lastSent >= chrono::seconds(config.keepalive)) {
+            sendKeepalive(worker, session);
+            if (!writeBatch(worker, session))
+                return;
+        }
+        armKeepalive(worker, session);
+    }
+
+    // Arms a session's timer for its next keepalive or for when the client counts as gone,
+    // whichever comes first
+    void armKeepalive(ServerWorker& worker, ClientSession& session) {
+        auto next = chrono::steady_clock::time_point::max();
+        if (config.keepalive)
+            next = session.lastSent + chrono::seconds(config.keepalive);
+        if (session.peerKeepalive)
+            next = min(next, session.lastReceived + chrono::seconds(session.peerKeepalive * KEEPALIVE_MISSES));
+        if (next != chrono::steady_clock::time_point::max())
+            worker.timers.schedule(session.timer, next);
+        else
+            session.timer.cancel();
+    }
+
+    // Forgets a handshake socket and takes more clients if the limit held some back
+    void endHandshake(ServerWorker& worker, int fd) {
+        worker.loop.remove(fd);
+        handshakes.erase(fd);
+        worker.metrics.handshakesPending.set(handshakes.size());
+        if (acceptBacklog)
+            acceptClients(worker);
+    }
+
+    // How long a worker may sleep before a timer is due, or worker 0 before a DTLS retransmit
+    int waitTimeout(ServerWorker& worker) const {
+        int timeout = worker.timers.timeout(chrono::steady_clock::now());
+        if (worker.index == 0 && config.datagram && !handshakes.empty() && (timeout < 0 || timeout > DTLS_TIMER_MS))
+            return DTLS_TIMER_MS;
+        return timeout;
+    }
+
+    // Gives a client with a finished handshake its address and an owning worker
+    void startSession(ServerWorker& worker, unique_ptr<ClientSession> session) {
+        {
+            lock_guard<mutex> lock(addressLock);
+            session->virtualIp = addressPool.allocate();
+        }
+        if (!session->virtualIp) {
+            LOG_WARN("Address pool exhausted, rejecting %s", session->peer.c_str());
+            return;
+        }
+        // Queued here, written by the owning worker once the session is registered
+        sendAddressAssignment(*session);
+        sendFeatures(*session);
+        if (config.keepalive)
+            sendKeepalive(worker, *session);
+
+        // Spread sessions over the workers
+        ServerWorker& owner = *workers[nextWorker];
+        nextWorker = (nextWorker + 1) % workers.size();
+        if (&owner == &worker) {
+            addSession(worker, move(session));
+        } else {
+            WorkerMessage message;
+            message.type = WorkerMessage::NEW_SESSION;
+            message.session = move(session);
+            post(owner, move(message));
+        }
+    }
+
+    // Registers a session with the worker that will own it and announces its address
+    void addSession(ServerWorker& worker, unique_ptr<ClientSession> session) {
+        int fd = session->getFd();
+        if (!worker.loop.add(fd, EPOLLIN | EPOLLRDHUP | EPOLLET)) {
+            releaseAddress(session->virtualIp);
+            return;
+        }
+
+        IpAddress address = IpAddress::fromV4(session->virtualIp);
+        SessionRoute route;
+        route.worker = worker.index;
+        route.session = session.get();
+        worker.routes.insert(address, route);
+        broadcastRoute(worker, WorkerMessage::ROUTE_ADD, address);
+
+        // Fair queueing only works if the backlog waits in the scheduler, not in the socket
+        if (config.fairQueue && !session->tunnel->set_unsent_limit(FairQueue::BACKLOG_BYTES))
+            LOG_WARN("Failed to limit unsent bytes for %s", session->peer.c_str());
+        if (session->tunnel->ktls_send())
+            worker.metrics.sessionsKtlsSend.add();
+        if (session->tunnel->ktls_receive())
+            worker.metrics.sessionsKtlsReceive.add();
+        worker.metrics.sessionsAdded.add();
+        if (session->tunnel->session_reused())
+            worker.metrics.sessionsResumed.add();
+        worker.metrics.sessionsActive.add(1);
+        char text[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &session->virtualIp, text, sizeof(text));
+        session->metrics.address = text;
+        session->metrics.peer = session->peer;
+        // A host route per client shows who is connected in the routing table
+        if (!tun.addRoute(string(text) + "/32"))
+            LOG_WARN("Failed to add route to %s", text);
+        Metrics::addSession(&session->metrics);
+
+        LOG_INFO("Session %s added as %s on worker %d (%zu active, %s%s%s)", session->peer.c_str(),
+                 addressPool.toCidr(session->virtualIp).c_str(), worker.index, countSessions(worker) + 1,
+                 session->tunnel->cipher(),
+                 session->tunnel->ktls_send() ? ", kTLS send" : "",
+                 session->tunnel->ktls_receive() ? ", kTLS receive" : "");
+        ClientSession& added = *session;
+        worker.sessions[fd] = move(session);
+        startKeepalive(worker, added);
+        // The frames received with the first one, and anything the edge already went by for
+        handleSessionEvents(worker, added, EPOLLIN | EPOLLOUT);
+    }
+
+    void closeSession(ServerWorker& worker, ClientSession& session) {
+        if (session.primary) {
+            // An extra stream: the session carries on over its other connections
+            vector<ClientSession*>& streams = session.primary->streams;
+            streams.erase(find(streams.begin(), streams.end(), &session));
+            LOG_INFO("Stream %s of session %s closed (%zu left)", session.peer.c_str(),
+                     session.primary->metrics.address.c_str(), streams.size() + 1);
+            dropConnection(worker, session);
+            return;
+        }
+
+        const SessionMetrics& metrics = session.metrics;
+        LOG_INFO("Session %s closed (sent %lu, received %lu, dropped %lu)", session.peer.c_str(),
+                 metrics.packetsSent.get(), metrics.packetsReceived.get(), metrics.packetsDropped.get());
+        worker.metrics.sessionsClosed.add();
+        worker.metrics.sessionsActive.add(-1);
+        releaseSessionAddress(worker, session);
+        if (session.joinId)
+            worker.joinable.erase(session.joinId);
+        // Its extra streams go with it
+        for (ClientSession* stream : session.streams)
+            dropConnection(worker, *stream);
+        dropConnection(worker, session);
+    }
+
+    // A worker's sessions, not counting the extra streams that joined them
+    static size_t countSessions(const ServerWorker& worker) {
+        size_t count = 0;
+        for (auto& entry : worker.sessions)
+            count += !entry.second->primary;
+        return count;
+    }
+
+    // Forgets a connection; destroying it closes the Tunnel and with it the socket
+    void dropConnection(ServerWorker& worker, ClientSession& session) {
+        int fd = session.getFd();
+        worker.loop.remove(fd);
+        worker.sessions.erase(fd);
+    }
+
+    // Takes a session's address off every worker's routes and the TUN device and returns it to the pool
+    void releaseSessionAddress(ServerWorker& worker, ClientSession& session) {
+        IpAddress address = IpAddress::fromV4(session.virtualIp);
+        worker.routes.erase(address);
+        broadcastRoute(worker, WorkerMessage::ROUTE_DEL, address);
+        if (!tun.removeRoute(session.metrics.address + "/32"))
+            LOG_WARN("Failed to remove route to %s", session.metrics.address.c_str());
+        releaseAddress(session.virtualIp);
+        session.virtualIp = 0;
+    }
+
+    // Hands a connection that presented a stream token to the worker of the session the
+    // token names: streams live on their session's worker. It never gets an address of its own
+    void joinStream(ServerWorker& worker, unique_ptr<ClientSession> stream) {
+        uint32_t target = stream->join.worker;
+        if (target >= workers.size()) {
+            LOG_WARN("Invalid stream token from %s", stream->peer.c_str());
+            return;
+        }
+        if ((int)target == worker.index) {
+            linkStream(worker, move(stream));
+            return;
+        }
+        WorkerMessage message;
+        message.type = WorkerMessage::JOIN_STREAM;
+        message.session = move(stream);
+        post(*workers[target], move(message));
+    }
+
+    // Adds a connection on the session's own worker to the session's streams once its token checks out
+    void linkStream(ServerWorker& worker, unique_ptr<ClientSession> stream) {
+        auto it = worker.joinable.find(stream->join.session);
+        ClientSession* primary = it != worker.joinable.end() ? it->second : nullptr;
+        if (!primary || CRYPTO_memcmp(primary->joinSecret, stream->join.secret, sizeof(primary->joinSecret)) != 0) {
+            LOG_WARN("Invalid stream token from %s", stream->peer.c_str());
+            return;
+        }
+        if (primary->streams.size() + 1 >= MAX_STREAMS) {
+            LOG_WARN("Session %s has %zu streams already, rejecting %s", primary->metrics.address.c_str(),
+                     MAX_STREAMS, stream->peer.c_str());
+            return;
+        }
+        int fd = stream->getFd();
+        if (!worker.loop.add(fd, EPOLLIN | EPOLLRDHUP | EPOLLET))
+            return;
+        // Fair queueing only works if the backlog waits in the scheduler, not in the socket
+        if (config.fairQueue && !stream->tunnel->set_unsent_limit(FairQueue::BACKLOG_BYTES))
+            LOG_WARN("Failed to limit unsent bytes for %s", stream->peer.c_str());
+
+        stream->primary = primary;
+        primary->streams.push_back(stream.get());
+        worker.metrics.streamsJoined.add();
+        LOG_INFO("Stream %s joined session %s (%zu streams)", stream->peer.c_str(),
+                 primary->metrics.address.c_str(), primary->streams.size() + 1);
+        ClientSession& added = *stream;
+        worker.sessions[fd] = move(stream);
+        startKeepalive(worker, added);
+        handleSessionEvents(worker, added, EPOLLIN | EPOLLOUT);
+    }
+
+    // Tells every other worker where an address now lives (or that it is gone)
+    void broadcastRoute(ServerWorker& worker, WorkerMessage::Type type, const IpAddress& address) {
+        for (auto& other : workers) {
+            if (other.get() == &worker)
+                continue;
+            WorkerMessage message;
+            message.type = type;
+            message.address = address;
+            message.worker = worker.index;
+            post(*other, move(message));
+        }
+    }
+
+    void releaseAddress(uint32_t address) {
+        lock_guard<mutex> lock(addressLock);
+        addressPool.release(address);
+    }
+
+    // Tells a new client which address to put on its TUN interface
+    void sendAddressAssignment(ClientSession& session) {
+        char frame[FRAME_HEADER_SIZE + sizeof(AssignAddressMessage)];
+        uint16_t plength = htons(sizeof(AssignAddressMessage));
+        AssignAddressMessage msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = CONTROL_ASSIGN_ADDRESS;
+        msg.prefixLen = addressPool.getPrefixLength();
+        msg.address = session.virtualIp;
+        memcpy(frame, &plength, sizeof(plength));
+        memcpy(frame + FRAME_HEADER_SIZE, &msg, sizeof(msg));
+        session.tunnel->enqueue(frame, sizeof(frame));
+    }
+
+    // Announces the optional frame kinds this server accepts
+    void sendFeatures(ClientSession& session) {
+        char frame[FRAME_HEADER_SIZE + sizeof(FeaturesMessage)];
+        uint16_t plength = htons(sizeof(FeaturesMessage));
+        FeaturesMessage msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = CONTROL_FEATURES;
+        msg.features = htonl((acceptsGso() ? (uint32_t)FEATURE_GSO : 0) |
+                             (config.compress ? (uint32_t)FEATURE_COMPRESSION : 0));
+        memcpy(frame, &plength, sizeof(plength));
+        memcpy(frame + FRAME_HEADER_SIZE, &msg, sizeof(msg));
+        session.tunnel->enqueue(frame, sizeof(frame));
+    }
+
+    // Tells the client the connection is alive, and how often it will hear that
+    void sendKeepalive(ServerWorker& worker, ClientSession& session) {
+        char frame[FRAME_HEADER_SIZE + sizeof(KeepaliveMessage)];
+        uint16_t plength = htons(sizeof(KeepaliveMessage));
+        KeepaliveMessage msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = CONTROL_KEEPALIVE;
+        msg.interval = htons(config.keepalive);
+        memcpy(frame, &plength, sizeof(plength));
+        memcpy(frame + FRAME_HEADER_SIZE, &msg, sizeof(msg));
+        session.tunnel->enqueue(frame, sizeof(frame));
+        session.lastSent = chrono::steady_clock::now();
+        worker.metrics.keepalivesSent.add();
+    }
+
+    // Starts a connection's keepalive checks on the worker that now has it
+    void startKeepalive(ServerWorker& worker, ClientSession& session) {
+        session.lastSent = session.lastReceived = chrono::steady_clock::now();
+        armKeepalive(worker, session);
+    }
+
+    // Superpackets need 64 KB frames, which do not fit a datagram
+    bool acceptsGso() const {
+        return tun.hasOffload() && !config.datagram;
+    }
+
+    // Largest frame payload a client may send: GSO superpackets need the full 64 KB
+    size_t maxFrameSize() const {
+        return tun.hasOffload() ? UINT16_MAX : TunDevice::BUFFER_SIZE;
+    }
+
+    bool handleTunToVPN(ServerWorker& worker) {
+        // Batches are flushed when the drain finishes or the time budget runs out
+        auto budget = chrono::microseconds(config.batchBudgetUsec);
+        auto deadline = chrono::steady_clock::now() + budget;
+
+        // Drain this worker's TUN queue completely (edge-triggered)
+        while (true) {
+            // Read data from the TUN device
+            // The last buffer is reused unless it was handed to another worker
+            if (!worker.buffer)
+                worker.buffer = worker.packets->get();
+            struct virtio_net_hdr vnet;
+            ssize_t len = worker.ring ? worker.ring->read(worker.buffer, &vnet)
+                                      : tun.read(worker.buffer.data(), worker.packets->bufferSize(), worker.index, &vnet);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (len <= 0) return false;
+
+            worker.buffer.setLength(len);
+            deliverPacket(worker, vnet, worker.buffer);
+
+            if (chrono::steady_clock::now() >= deadline) {
+                flushPending(worker);
+                deadline = chrono::steady_clock::now() + budget;
             }
         }
+
+        flushPending(worker);
         return true;
     }
 
-private:
-    bool handleTunToVPN() {
-        // Read data from the TUN device
-        int len = tun.read(buffer, sizeof(buffer));
-        if (len <= 0) return false;
-        
-        packets_sent++;  // Increment the packet sent counter
-        cout << "TUN -> NET [" << packets_sent << "]: " 
-                    << len << " bytes" << endl;
-        
-        // Convert the length to network byte order
-        uint16_t plength = htons(len);
-        // Write the length and data to the VPN connection
-        if (vpn.write(reinterpret_cast<char*>(&plength), sizeof(plength)) <= 0 ||
-            vpn.write(buffer, len) <= 0) {
-            cerr << "Failed to write to network\n";
-            return false;
+    // Batches a packet for the session that owns its destination address,
+    // handing it to the owning worker when that is another thread. The buffer itself moves
+    // to that worker, so packet is empty afterwards in that case.
+    void deliverPacket(ServerWorker& worker, const struct virtio_net_hdr& vnet, PacketHandle& buffer) {
+        char* packet = buffer.data();
+        size_t len = buffer.length();
+        IpAddress dst;
+        SessionRoute* route = nullptr;
+        if (IpAddress::destinationOf(packet, len, dst))
+            route = worker.routes.find(dst);
+        if (!route) {
+            worker.metrics.dropsNoRoute.add();
+            return;
+        }
+
+        if (route->worker != worker.index) {
+            WorkerMessage message;
+            message.type = WorkerMessage::PACKET;
+            message.packet = move(buffer);
+            message.vnet = vnet;
+            post(*workers[route->worker], move(message));
+            return;
+        }
+
+        ClientSession* session = route->session;
+        // A striped session: the flow's hash picks one of its streams, the session's own
+        // connection included, so each flow stays in order on one connection
+        if (!session->streams.empty()) {
+            size_t stream = flowHash(packet, len) % (session->streams.size() + 1);
+            if (stream)
+                session = session->streams[stream - 1];
+        }
+        if (config.fairQueue) {
+            queueEgress(worker, *session, vnet, buffer);
+            return;
+        }
+        // Backpressure: a client that cannot keep up loses its own packets (TCP backs off)
+        // instead of stalling the TUN queue every other session shares
+        if (session->tunnel->send_queue_full()) {
+            worker.metrics.dropsQueueFull.add();
+            session->sessionMetrics().packetsDropped.add();
+            return;
+        }
+        if (sendPacket(worker, *session, vnet, packet, len))
+            markPending(worker, *session);
+    }
+
+    // Puts a session on the list of batches flushed at the end of the TUN drain
+    static void markPending(ServerWorker& worker, ClientSession& session) {
+        if (!session.txQueued) {
+            session.txQueued = true;
+            worker.pendingFlush.push_back(session.getFd());
+        }
+    }
+
+    // Fair queueing: the packet waits in the connection's scheduler, which releases it
+    // when the send queue has room (see flushSession). The buffer moves into the queue
+    void queueEgress(ServerWorker& worker, ClientSession& session, const struct virtio_net_hdr& vnet,
+                     PacketHandle& buffer) {
+        if (size_t dropped = session.egress.enqueue(buffer, vnet, chrono::steady_clock::now())) {
+            worker.metrics.dropsQueueFull.add(dropped);
+            session.sessionMetrics().packetsDropped.add(dropped);
+        }
+        session.metrics.fairQueuePackets.set(session.egress.packets());
+        markPending(worker, session);
+    }
+
+    // Frames a packet into a session's batch; returns false if the session was closed
+    bool sendPacket(ServerWorker& worker, ClientSession& session, const struct virtio_net_hdr& vnet,
+                    char* packet, size_t len) {
+        worker.metrics.packetsSent.add();
+        worker.metrics.bytesSent.add(len);
+        worker.metrics.sentSize.observe(len);
+        session.sessionMetrics().packetsSent.add();
+        session.sessionMetrics().bytesSent.add(len);
+        LOG_TRACE_RATE(20, "TUN -> NET [%lu] %s: %zu bytes", worker.metrics.packetsSent.get(), session.peer.c_str(), len);
+
+        if (!PacketOffload::needsOffload(vnet))
+            return queueFrame(worker, session, nullptr, 0, packet, len);
+        if (session.peerGso && len + sizeof(GsoFrameHeader) <= UINT16_MAX) {
+            // The client's kernel segments the superpacket
+            GsoFrameHeader gso;
+            PacketOffload::encodeHeader(vnet, gso);
+            return queueFrame(worker, session, reinterpret_cast<char*>(&gso), sizeof(gso), packet, len);
+        }
+        // The client cannot take superpackets: segment and checksum here
+        bool ok = true;
+        PacketOffload::resolve(packet, len, vnet, [&](const char* segment, size_t segmentLen) {
+            ok = queueFrame(worker, session, nullptr, 0, segment, segmentLen);
+            return ok;
+        });
+        return ok;
+    }
+
+    // Adds one frame to a session's batch; returns false if the session was closed
+    bool queueFrame(ServerWorker& worker, ClientSession& session, const char* header, size_t headerLen,
+                    const char* packet, size_t len) {
+        if (config.compress && session.peerCompression)
+            compressFrame(worker, header, headerLen, packet, len);
+
+        // A full batch goes out now and the packet starts the next one
+        if (session.txBatch.empty())
+            session.txBatchStart = chrono::steady_clock::now();
+        if (!session.txBatch.append(header, headerLen, packet, len)) {
+            if (!writeBatch(worker, session))
+                return false;
+            session.txBatchStart = chrono::steady_clock::now();
+            session.txBatch.append(header, headerLen, packet, len);
         }
         return true;
     }
 
-    bool handleVPNToTun() {
-        uint16_t plength;
-        // Read the length of the packet from the VPN connection
-        if (vpn.read(reinterpret_cast<char*>(&plength), sizeof(plength)) <= 0) {
-            cerr << "Connection closed by peer\n";
-            return false;
+    // Replaces a frame with its compressed form when that pays off, counting the outcome and time
+    void compressFrame(ServerWorker& worker, const char*& header, size_t& headerLen, const char*& packet, size_t& len) {
+        auto start = chrono::steady_clock::now();
+        const char* compressed;
+        size_t compressedLen;
+        bool ok = worker.compressor.compress(header, headerLen, packet, len, compressed, compressedLen);
+        worker.metrics.compressNanoseconds.add(
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        if (!ok) {
+            worker.metrics.packetsUncompressed.add();
+            return;
+        }
+        worker.metrics.packetsCompressed.add();
+        worker.metrics.compressInputBytes.add(headerLen + len);
+        worker.metrics.compressOutputBytes.add(compressedLen);
+        header = nullptr;
+        headerLen = 0;
+        packet = compressed;
+        len = compressedLen;
+    }
+
+    // Sends every batch filled during the current drain
+    void flushPending(ServerWorker& worker) {
+        for (int fd : worker.pendingFlush) {
+            auto it = worker.sessions.find(fd);
+            if (it == worker.sessions.end())
+                continue;
+            it->second->txQueued = false;
+            flushSession(worker, *it->second);
         }
+        worker.pendingFlush.clear();
+    }
+
+    // Moves a session's batch to its send queue and writes as much as the socket takes;
+    // closes the session on failure. The rest goes out when EPOLLOUT fires.
+    bool flushSession(ServerWorker& worker, ClientSession& session) {
+        // With fair queueing the scheduler tops the send queue up for as long as the socket takes it all
+        do {
+            if (config.fairQueue && !releaseEgress(worker, session))
+                return false;
+            if (!writeBatch(worker, session))
+                return false;
+        } while (config.fairQueue && !session.egress.empty() && session.tunnel->queued() == 0);
+        session.metrics.sendQueueBytes.set(session.tunnel->queued());
+        return true;
+    }
 
-        // Convert the length to host byte order
-        int len = ntohs(plength);
-        if (len > TunDevice::BUFFER_SIZE) {
-            cerr << "Packet too large: " << len << endl;
+    // One round of flushSession: batch to send queue, send queue to socket
+    bool writeBatch(ServerWorker& worker, ClientSession& session) {
+        FrameBatcher& batch = session.txBatch;
+        if (!batch.empty()) {
+            session.tunnel->enqueue(batch.data(), batch.size());
+            // Latency up to the socket handoff, charged to every frame by the batch's oldest
+            session.lastSent = chrono::steady_clock::now();
+            chrono::duration<double> waited = session.lastSent - session.txBatchStart;
+            worker.metrics.tunToSocketSeconds.observe(waited.count(), batch.frames());
+            batch.clear();
+        }
+        if (session.tunnel->flush() < 0 || !updateEvents(worker, session)) {
+            LOG_WARN("Failed to write to %s", session.peer.c_str());
+            worker.metrics.sslWriteErrors.add();
+            closeSession(worker, session);
             return false;
         }
+        return true;
+    }
 
-        // Read the packet data from the VPN connection
-        if (vpn.read(buffer, len) <= 0) {
-            cerr << "Failed to read packet data\n";
+    // Fair queueing: moves packets from the connection's scheduler into its batch until the
+    // send queue would hold BACKLOG_BYTES. Returns false if the session was closed
+    bool releaseEgress(ServerWorker& worker, ClientSession& session) {
+        auto now = chrono::steady_clock::now();
+        FairQueue::Packet next;
+        size_t dropped;
+        while (session.tunnel->queued() + session.txBatch.size() < FairQueue::BACKLOG_BYTES) {
+            bool more = session.egress.dequeue(next, now, dropped);
+            if (dropped) {
+                worker.metrics.dropsCodel.add(dropped);
+                session.sessionMetrics().packetsDropped.add(dropped);
+            }
+            if (!more)
+                break;
+            worker.metrics.fairQueueSeconds.observe(chrono::duration<double>(now - next.enqueued).count());
+            if (!sendPacket(worker, session, next.vnet, next.data.data(), next.data.length()))
+                return false;
+        }
+        session.metrics.fairQueuePackets.set(session.egress.packets());
+        return true;
+    }
+
+    bool handleVPNToTun(ServerWorker& worker, ClientSession& session) {
+        // Frames buffered before the session was registered go first
+        if (!handleFrames(worker, session))
             return false;
+        // Drain the socket completely, keeping any partial frame for the next edge
+        while (true) {
+            // One receive takes up to a whole TLS record, usually many frames
+            char* space = session.rx.space();
+            ssize_t n = session.tunnel->receive(space, session.rx.spaceSize());
+            if (n < 0 && errno == EAGAIN)
+                return true;
+            if (n < 0) {
+                LOG_WARN("Failed to read from %s", session.peer.c_str());
+                worker.metrics.sslReadErrors.add();
+                return false;
+            }
+            if (n == 0) {
+                LOG_INFO("Connection closed by peer %s", session.peer.c_str());
+                return false;
+            }
+            session.rx.commit(n);
+            session.lastReceived = chrono::steady_clock::now();
+            if (!handleFrames(worker, session))
+                return false;
         }
+    }
+
+    // Hands every complete frame to the TUN device straight from the receive buffer
+    bool handleFrames(ServerWorker& worker, ClientSession& session) {
+        char* packet;
+        size_t len;
+        while (session.rx.next(packet, len)) {
+            FrameKind kind = frameKind(packet, len);
+            if (kind == FRAME_CONTROL) {
+                handleControl(worker, session, packet, len);
+                continue;
+            }
+            if (kind == FRAME_COMPRESSED) {
+                auto start = chrono::steady_clock::now();
+                char* restored;
+                size_t restoredLen;
+                bool ok = worker.compressor.decompress(packet, len, restored, restoredLen);
+                worker.metrics.decompressNanoseconds.add(
+                    chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+                if (!ok) {
+                    LOG_WARN("Invalid compressed frame from %s", session.peer.c_str());
+                    return false;
+                }
+                packet = restored;
+                len = restoredLen;
+                kind = frameKind(packet, len);
+            }
 
-        packets_received++;  // Increment the packet received counter
-        cout << "NET -> TUN [" << packets_received << "]: " 
-                    << len << " bytes" << endl;
+            worker.metrics.packetsReceived.add();
+            worker.metrics.bytesReceived.add(len);
+            worker.metrics.receivedSize.observe(len);
+            session.sessionMetrics().packetsReceived.add();
+            session.sessionMetrics().bytesReceived.add(len);
+            LOG_TRACE_RATE(20, "NET -> TUN [%lu] %s: %zu bytes", worker.metrics.packetsReceived.get(),
+                           session.peer.c_str(), len);
 
-        // Write the data to the TUN device
-        if (tun.write(buffer, len) <= 0) {
-            cerr << "Failed to write to TUN\n";
+            // Write through this worker's queue so the kernel steers the flow's
+            // return traffic back to the same queue
+            if (!writeToTun(worker, kind, packet, len)) {
+                worker.metrics.dropsTunWrite.add();
+                LOG_WARN("Failed to write to TUN");
+            }
+        }
+        if (session.rx.corrupt()) {
+            LOG_WARN("Invalid frame length from %s", session.peer.c_str());
             return false;
         }
         return true;
     }
 
+    // Writes a received packet (or superpacket) to the TUN device
+    bool writeToTun(ServerWorker& worker, FrameKind kind, char* packet, size_t len) {
+        if (kind == FRAME_PACKET)
+            return writeTun(worker, packet, len);
+
+        struct virtio_net_hdr vnet;
+        PacketOffload::decodeHeader(*reinterpret_cast<const GsoFrameHeader*>(packet), vnet);
+        packet += sizeof(GsoFrameHeader);
+        len -= sizeof(GsoFrameHeader);
+        if (tun.hasOffload())
+            return writeTun(worker, packet, len, &vnet);
+        return PacketOffload::resolve(packet, len, vnet, [&](const char* segment, size_t segmentLen) {
+            return writeTun(worker, segment, segmentLen);
+        });
+    }
+
+    // Writes through the worker's queue, or queues the write on its ring (submitted at the
+    // end of the event batch); either way the packet's memory is free again on return
+    bool writeTun(ServerWorker& worker, const char* packet, size_t len, const struct virtio_net_hdr* vnet = nullptr) {
+        if (worker.ring)
+            return worker.ring->write(packet, len, vnet);
+        return tun.write(packet, len, worker.index, vnet) > 0;
+    }
+
+    // What the worker's event loop watches for TUN packets: the queue, or its ring's eventfd
+    int tunFd(const ServerWorker& worker) const {
+        return worker.ring ? worker.ring->getEventFd() : tun.getQueueFd(worker.index);
+    }
+
+    // Handles a control message from a client
+    void handleControl(ServerWorker& worker, ClientSession& session, const char* payload, size_t len) {
+        if ((uint8_t)payload[0] == CONTROL_FEATURES && len >= sizeof(FeaturesMessage)) {
+            FeaturesMessage msg;
+            memcpy(&msg, payload, sizeof(msg));
+            session.peerGso = ntohl(msg.features) & FEATURE_GSO;
+            session.peerCompression = ntohl(msg.features) & FEATURE_COMPRESSION;
+            // Streams share one connection's congestion control over TCP only
+            if ((ntohl(msg.features) & FEATURE_STREAMS) && !config.datagram && !session.primary && !session.joinId)
+                sendStreamToken(worker, session);
+        }
+        if ((uint8_t)payload[0] == CONTROL_REQUEST_ADDRESS && len >= sizeof(AssignAddressMessage) &&
+            !session.primary) {
+            // A reconnecting client wants the address its connections use back. It gets it
+            // if nobody took it meanwhile, and keeps the new one otherwise; either way the
+            // answer is an assignment
+            AssignAddressMessage msg;
+            memcpy(&msg, payload, sizeof(msg));
+            if (msg.address != session.virtualIp && claimAddress(msg.address))
+                moveSession(worker, session, msg.address);
+            sendAddressAssignment(session);
+        }
+        if ((uint8_t)payload[0] == CONTROL_KEEPALIVE && len >= sizeof(KeepaliveMessage)) {
+            KeepaliveMessage msg;
+            memcpy(&msg, payload, sizeof(msg));
+            worker.metrics.keepalivesReceived.add();
+            // The first one, or a new interval, moves the check for a silent client
+            int interval = ntohs(msg.interval);
+            if (interval != session.peerKeepalive) {
+                session.peerKeepalive = interval;
+                armKeepalive(worker, session);
+            }
+        }
+        // Unknown control messages are ignored for forward compatibility
+    }
+
+    // Hands a client the token its further connections present to join this session
+    void sendStreamToken(ServerWorker& worker, ClientSession& session) {
+        if (RAND_bytes(session.joinSecret, sizeof(session.joinSecret)) != 1) {
+            LOG_WARN("Failed to generate a stream token for %s", session.peer.c_str());
+            return;
+        }
+        session.joinId = ++worker.nextJoinId;
+        worker.joinable[session.joinId] = &session;
+
+        char frame[FRAME_HEADER_SIZE + sizeof(StreamTokenMessage)];
+        uint16_t plength = htons(sizeof(StreamTokenMessage));
+        StreamTokenMessage msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = CONTROL_STREAM_TOKEN;
+        msg.worker = worker.index;
+        msg.session = session.joinId;
+        memcpy(msg.secret, session.joinSecret, sizeof(msg.secret));
+        memcpy(frame, &plength, sizeof(plength));
+        memcpy(frame + FRAME_HEADER_SIZE, &msg, sizeof(msg));
+        session.tunnel->enqueue(frame, sizeof(frame));
+    }
+
+    bool claimAddress(uint32_t address) {
+        lock_guard<mutex> lock(addressLock);
+        return addressPool.claim(address);
+    }
+
+    // Gives a session another (already claimed) address, rerouting it on every worker
+    void moveSession(ServerWorker& worker, ClientSession& session, uint32_t address) {
+        IpAddress old = IpAddress::fromV4(session.virtualIp);
+        worker.routes.erase(old);
+        broadcastRoute(worker, WorkerMessage::ROUTE_DEL, old);
+        tun.removeRoute(session.metrics.address + "/32");
+        releaseAddress(session.virtualIp);
+
+        session.virtualIp = address;
+        IpAddress moved = IpAddress::fromV4(address);
+        SessionRoute route;
+        route.worker = worker.index;
+        route.session = &session;
+        worker.routes.insert(moved, route);
+        broadcastRoute(worker, WorkerMessage::ROUTE_ADD, moved);
+
+        // Labels may not change while the exporter can see them
+        char text[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &address, text, sizeof(text));
+        Metrics::removeSession(&session.metrics);
+        session.metrics.address = text;
+        Metrics::addSession(&session.metrics);
+        if (!tun.addRoute(string(text) + "/32"))
+            LOG_WARN("Failed to add route to %s", text);
+        LOG_INFO("Session %s got its previous address %s back", session.peer.c_str(),
+                 addressPool.toCidr(address).c_str());
+    }
+
     void printStatistics() {
-        // Print the packet statistics
+        size_t sessions = 0;
+        for (auto& worker : workers)
+            sessions += countSessions(*worker);
+
+        // Print the packet statistics, summed over the workers' metrics
         cout << "\nStatistics:\n"
-                  << "Packets sent: " << packets_sent << "\n"
-                  << "Packets received: " << packets_received << endl;
+                  << "Packets sent: " << Metrics::total(&MetricsShard::packetsSent) << "\n"
+                  << "Packets received: " << Metrics::total(&MetricsShard::packetsReceived) << "\n"
+                  << "Packets dropped: " << Metrics::total(&MetricsShard::dropsNoRoute) << "\n"
+                  << "Packets dropped (send queue full): " << Metrics::total(&MetricsShard::dropsQueueFull) << "\n"
+                  << "Active sessions: " << sessions << "\n"
+                  << "Sessions with kTLS send/receive: " << Metrics::total(&MetricsShard::sessionsKtlsSend) << "/"
+                  << Metrics::total(&MetricsShard::sessionsKtlsReceive) << " of "
+                  << Metrics::total(&MetricsShard::sessionsAdded) << "\n"
+                  << "Sessions resumed from a ticket: " << Metrics::total(&MetricsShard::sessionsResumed) << "\n"
+                  << "Streams joined to sessions: " << Metrics::total(&MetricsShard::streamsJoined) << endl;
+        if (config.compress)
+            printCompression();
+        if (config.keepalive || Metrics::total(&MetricsShard::keepalivesReceived)) {
+            cout << "Keepalives sent/received: " << Metrics::total(&MetricsShard::keepalivesSent) << "/"
+                 << Metrics::total(&MetricsShard::keepalivesReceived) << ", connections timed out: "
+                 << Metrics::total(&MetricsShard::connectionsTimedOut) << endl;
+        }
+        if (config.ioUring) {
+            cout << "TUN reads and writes through io_uring: " << Metrics::total(&MetricsShard::ringPackets) << " in "
+                 << Metrics::total(&MetricsShard::ringEnters) << " io_uring_enter calls" << endl;
+        }
+    }
+
+    // Ratio and cost of compression, summed over the workers
+    static void printCompression() {
+        uint64_t in = Metrics::total(&MetricsShard::compressInputBytes);
+        uint64_t out = Metrics::total(&MetricsShard::compressOutputBytes);
+        cout << "Packets compressed: " << Metrics::total(&MetricsShard::packetsCompressed) << " of "
+             << Metrics::total(&MetricsShard::packetsCompressed) + Metrics::total(&MetricsShard::packetsUncompressed)
+             << " (" << (in ? 100.0 * out / in : 100.0) << "% of their size, "
+             << Metrics::total(&MetricsShard::compressNanoseconds) / 1e6 << " ms compressing, "
+             << Metrics::total(&MetricsShard::decompressNanoseconds) / 1e6 << " ms decompressing)" << endl;
     }
 };
@@ -0,0 +1,55 @@
+#pragma once
+#include <cstddef>
+
+// Settings collected from the command line (see parseArguments in utils.cpp)
+struct VPNConfig {
+    char ifaceName[100];
+    char serverIP[100];
+    int port;
+    bool isServer;
+    // Bytes of frames packed into one TLS record before it is sent
+    size_t batchSize;
+    // Longest time (microseconds) spent draining TUN before a partial batch is sent
+    int batchBudgetUsec;
+    // TUN queues on the server, each served by its own worker thread
+    int queues;
+    // Open the TUN device with IFF_VNET_HDR and move GSO superpackets through the tunnel
+    bool offload;
+    // Carry packets as DTLS datagrams over UDP instead of a TLS stream over TCP
+    bool datagram;
+    // Ask OpenSSL to hand TLS record encryption to the kernel (kTLS) after the handshake
+    bool ktls;
+    // Compress packets that look compressible, on sessions whose peer also enables it
+    bool compress;
+    // Client: keep the TUN device up when the tunnel drops, hold its packets and reconnect
+    bool reconnect;
+    // Schedule each connection's outgoing packets by flow (FQ-CoDel) instead of first come, first served
+    bool fairQueue;
+    // Read and write the TUN device through io_uring instead of read()/write() on epoll or select
+    bool ioUring;
+    // Seconds a connection may carry nothing before a keepalive goes out (0: none are sent)
+    int keepalive;
+    // Client: TLS connections the session's flows are striped over (1: no striping)
+    int streams;
+    // Each -v lowers the runtime log level by one (info, debug, trace)
+    int verbosity;
+    // Server: seconds between session ticket key rotations (0 disables session resumption)
+    int ticketRotation;
+    // TLS 1.3 cipher suites in preference order, or "auto" to pick by CPU (empty: OpenSSL default)
+    char cipherSuites[256];
+    // Key exchange groups in preference order (empty: OpenSSL default)
+    char groups[128];
+    // Serve Prometheus metrics on 127.0.0.1 at this port (0 disables the endpoint)
+    int metricsPort;
+    // Record TUN traffic to a ring of pcapng files named after this path (empty: off)
+    char capturePath[256];
+    // Megabytes per capture file and files in the ring
+    int captureFileMb;
+    int captureFiles;
+    // Keep one in every captureSample packets
+    int captureSample;
+    // Only capture packets from or to these inner addresses, comma separated (empty: all)
+    char captureHosts[256];
+    // Client: send the packets of this pcapng file through the tunnel as fast as it takes them
+    char replayPath[256];
+};
@@ -1,13 +1,20 @@
 #include "../server/VPNServer.cpp"
 #include "../client/VPNClient.cpp"
 #include "utils.cpp"
+#include "../tun_interface/Logger.hpp"
+#include "../tun_interface/Metrics.hpp"
 #include <iostream>
+#include <signal.h>
 #include <unistd.h>
 using namespace std;
 
 int main(int argc, char* argv[]) {
     VPNConfig config;
 
+    // A peer that resets its connection makes OpenSSL's next write() fail with EPIPE, which
+    // closes that one session; the default SIGPIPE would take the whole process down
+    signal(SIGPIPE, SIG_IGN);
+
     if (argc < 2) {
         printUsage(argv[0]);
         return 1;
@@ -18,11 +25,21 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    // Log output is written by a background thread, off the packet path
+    Logger::setLevel((Logger::Level)max((int)Logger::Trace, (int)Logger::Info - config.verbosity));
+    Logger::start();
+
+    // Prometheus scrape endpoint, reachable from this host only
+    if (config.metricsPort > 0 && !Metrics::serve(config.metricsPort)) {
+        Logger::stop();
+        return 1;
+    }
+
     try {
         if (config.isServer) {
             cout << "Starting VPN server on interface " << config.ifaceName 
                  << " port " << config.port << endl;
-            VPNServer server(config.ifaceName, config.port);
+            VPNServer server(config);
             if (!server.initialize()) {
                 cerr << "Failed to initialize server\n";
                 return 1;
@@ -31,25 +48,32 @@ int main(int argc, char* argv[]) {
         } else {
             cout << "Connecting to " << config.serverIP << ":" << config.port 
                  << " via " << config.ifaceName << endl;
-            VPNClient client(config.ifaceName, config.serverIP, config.port);
+            VPNClient client(config);
             if (!client.initialize()) {
                 cerr << "Failed to initialize client\n";
                 return 1;
             }
             
+            // run() returns when the tunnel drops (-x reconnects inside it instead);
+            // each retry brings up a new tunnel on the same TUN device
             int retries = 3;
-            while (retries-- > 0) {
-                if (client.run()) break;
-                if (retries > 0) {
+            while (!client.run()) {
+                bool reconnected = false;
+                while (!reconnected && retries-- > 0) {
                     cout << "Retrying connection... (" << retries << " attempts left)\n";
                     sleep(2);
+                    reconnected = client.reconnect();
                 }
+                if (!reconnected)
+                    break;
             }
         }
     } catch (const std::exception& e) {
         cerr << "Fatal error: " << e.what() << endl;
+        Logger::stop();
         return 1;
     }
 
+    Logger::stop();
     return 0;
 }
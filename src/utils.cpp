@@ -1,13 +1,13 @@
 #include <iostream>
 #include <string.h>
 #include <unistd.h>
+#include "VPNConfig.hpp"
+#include "../tunneling/Frame.hpp"
+#include "../tunneling/FrameBatcher.hpp"
+#include "../tunneling/Tunnel.hpp"
+#include "../tun_interface/PacketCapture.hpp"
 
-struct VPNConfig {
-    char ifaceName[100];
-    char serverIP[100];
-    int port;
-    bool isServer;
-};
+bool validateConfig(const VPNConfig& config);
 
 bool parseArguments(int argc, char* argv[], VPNConfig& config) {
     int opt;
@@ -16,14 +16,60 @@ bool parseArguments(int argc, char* argv[], VPNConfig& config) {
     config.isServer = false;
     config.ifaceName[0] = '\0';
     config.serverIP[0] = '\0';
+    config.cipherSuites[0] = '\0';
+    config.groups[0] = '\0';
+    config.capturePath[0] = '\0';
+    config.captureHosts[0] = '\0';
+    config.replayPath[0] = '\0';
+    config.batchSize = FrameBatcher::DEFAULT_RECORD_SIZE;
+    config.batchBudgetUsec = 200;
+    config.queues = 1;
+    config.offload = false;
+    config.datagram = false;
+    config.ktls = false;
+    config.compress = false;
+    config.reconnect = false;
+    config.streams = 1;
+    config.fairQueue = false;
+    config.ioUring = false;
+    config.keepalive = DEFAULT_KEEPALIVE;
+    config.verbosity = 0;
+    config.metricsPort = 0;
+    config.ticketRotation = Tunnel::DEFAULT_TICKET_ROTATION;
+    config.captureFileMb = PacketCapture::DEFAULT_FILE_SIZE >> 20;
+    config.captureFiles = PacketCapture::DEFAULT_FILES;
+    config.captureSample = 1;
 
     // Parse command line arguments
-    while ((opt = getopt(argc, argv, "i:sc:p:")) != -1) {
+    while ((opt = getopt(argc, argv, "i:sc:p:b:t:q:oukzxS:fIK:vm:r:e:g:w:C:W:n:a:R:")) != -1) {
         switch (opt) {
             case 'i': strcpy(config.ifaceName, optarg); break;
             case 's': config.isServer = true; break;
             case 'c': strcpy(config.serverIP, optarg); config.isServer = false; break;
             case 'p': config.port = atoi(optarg); break;
+            case 'b': config.batchSize = strtoul(optarg, nullptr, 10); break;
+            case 't': config.batchBudgetUsec = atoi(optarg); break;
+            case 'q': config.queues = atoi(optarg); break;
+            case 'o': config.offload = true; break;
+            case 'u': config.datagram = true; break;
+            case 'k': config.ktls = true; break;
+            case 'z': config.compress = true; break;
+            case 'x': config.reconnect = true; break;
+            case 'S': config.streams = atoi(optarg); break;
+            case 'f': config.fairQueue = true; break;
+            case 'I': config.ioUring = true; break;
+            case 'K': config.keepalive = atoi(optarg); break;
+            case 'v': config.verbosity++; break;
+            case 'm': config.metricsPort = atoi(optarg); break;
+            case 'r': config.ticketRotation = atoi(optarg); break;
+            case 'e': strncpy(config.cipherSuites, optarg, sizeof(config.cipherSuites) - 1); config.cipherSuites[sizeof(config.cipherSuites) - 1] = '\0'; break;
+            case 'g': strncpy(config.groups, optarg, sizeof(config.groups) - 1); config.groups[sizeof(config.groups) - 1] = '\0'; break;
+            case 'w': strncpy(config.capturePath, optarg, sizeof(config.capturePath) - 1); config.capturePath[sizeof(config.capturePath) - 1] = '\0'; break;
+            case 'C': config.captureFileMb = atoi(optarg); break;
+            case 'W': config.captureFiles = atoi(optarg); break;
+            case 'n': config.captureSample = atoi(optarg); break;
+            case 'a': strncpy(config.captureHosts, optarg, sizeof(config.captureHosts) - 1); config.captureHosts[sizeof(config.captureHosts) - 1] = '\0'; break;
+            case 'R': strncpy(config.replayPath, optarg, sizeof(config.replayPath) - 1); config.replayPath[sizeof(config.replayPath) - 1] = '\0'; break;
             default: return false;
         }
     }
@@ -42,9 +88,67 @@ bool validateConfig(const VPNConfig& config) {
         return false;
     }
 
+    if (config.batchSize < 2 || config.batchSize > 1 << 20) {
+        std::cerr << "Batch size must be between 2 and 1048576 bytes (-b option)\n";
+        return false;
+    }
+
+    if (config.queues < 1 || config.queues > 256) {
+        std::cerr << "Queue count must be between 1 and 256 (-q option)\n";
+        return false;
+    }
+
+    if (config.ticketRotation < 0) {
+        std::cerr << "Ticket key rotation must not be negative (-r option)\n";
+        return false;
+    }
+
+    if (config.keepalive < 0 || config.keepalive > 3600) {
+        std::cerr << "Keepalive interval must be between 0 and 3600 seconds (-K option)\n";
+        return false;
+    }
+
+    if (config.metricsPort < 0 || config.metricsPort > 65535) {
+        std::cerr << "Metrics port must be between 0 and 65535 (-m option)\n";
+        return false;
+    }
+
+    if (config.captureFileMb < 1 || config.captureFileMb > 4096) {
+        std::cerr << "Capture file size must be between 1 and 4096 megabytes (-C option)\n";
+        return false;
+    }
+
+    if (config.captureFiles < 1 || config.captureSample < 1) {
+        std::cerr << "Capture file count and sampling rate must be at least 1 (-W, -n options)\n";
+        return false;
+    }
+
+    if (config.isServer && strlen(config.replayPath) > 0) {
+        std::cerr << "Replay is only available in client mode (-R option)\n";
+        return false;
+    }
+
+    if (config.isServer && config.reconnect) {
+        std::cerr << "Reconnecting is only available in client mode (-x option)\n";
+        return false;
+    }
+
+    if (config.streams < 1 || config.streams > (int)MAX_STREAMS) {
+        std::cerr << "Stream count must be between 1 and " << MAX_STREAMS << " (-S option)\n";
+        return false;
+    }
+
+    if (config.streams > 1 && (config.isServer || config.datagram)) {
+        std::cerr << "Striping over streams is only available in client mode over TCP (-S option)\n";
+        return false;
+    }
+
     return true;
 }
 
 void printUsage(const char* programName) {
-    std::cerr << "Usage: " << programName << " -i <interface> [-s|-c <server_ip>] [-p <port>]\n";
+    std::cerr << "Usage: " << programName << " -i <interface> [-s|-c <server_ip>] [-p <port>]"
+              << " [-b <batch_bytes>] [-t <batch_usec>] [-q <queues>] [-o] [-u] [-k] [-z] [-x] [-S <streams>] [-f] [-I] [-K <keepalive_seconds>] [-v] [-m <metrics_port>] [-r <ticket_seconds>]"
+              << " [-e <cipher_suites>|auto] [-g <groups>]"
+              << " [-w <capture_file> [-C <megabytes>] [-W <files>] [-n <sample>] [-a <hosts>]] [-R <pcapng_file>]\n";
 }
@@ -0,0 +1,118 @@
+#include "AddressPool.hpp"
+#include <arpa/inet.h>
+#include <iostream>
+
+using namespace std;
+
+AddressPool::AddressPool()
+    : network_(0), prefixLen_(0), first_(0), count_(0), cursor_(0), free_(0)
+{
+}
+
+bool AddressPool::initialize(const string &cidr, uint32_t reserved)
+{
+    size_t slash = cidr.find('/');
+    if (slash == string::npos)
+    {
+        cerr << "Address pool must be in CIDR notation: " << cidr << endl;
+        return false;
+    }
+
+    struct in_addr addr;
+    if (inet_pton(AF_INET, cidr.substr(0, slash).c_str(), &addr) != 1)
+    {
+        cerr << "Invalid address pool network: " << cidr << endl;
+        return false;
+    }
+
+    prefixLen_ = atoi(cidr.c_str() + slash + 1);
+    if (prefixLen_ < 8 || prefixLen_ > 30)
+    {
+        cerr << "Address pool prefix must be between /8 and /30: " << cidr << endl;
+        return false;
+    }
+
+    uint32_t size = 1u << (32 - prefixLen_);
+    uint32_t mask = ~(size - 1);
+    network_ = ntohl(addr.s_addr) & mask;
+
+    // Skip the network address and the reserved hosts, never hand out broadcast
+    first_ = 1 + reserved;
+    if (first_ >= size - 1)
+    {
+        cerr << "Address pool " << cidr << " has no assignable addresses" << endl;
+        return false;
+    }
+    count_ = size - 1 - first_;
+    cursor_ = 0;
+    free_ = count_;
+    used_.assign((count_ + 63) / 64, 0);
+    return true;
+}
+
+uint32_t AddressPool::allocate()
+{
+    if (free_ == 0)
+        return 0;
+
+    // Next-fit scan, one 64-bit word at a time
+    while (true)
+    {
+        uint32_t word = cursor_ / 64;
+        uint64_t bits = used_[word] | (((uint64_t)1 << (cursor_ % 64)) - 1);
+        if (bits != ~(uint64_t)0)
+        {
+            uint32_t offset = word * 64 + __builtin_ctzll(~bits);
+            if (offset < count_)
+            {
+                used_[word] |= (uint64_t)1 << (offset % 64);
+                free_--;
+                cursor_ = (offset + 1) % count_;
+                return htonl(network_ + first_ + offset);
+            }
+        }
+        // Continue with the next word, wrapping to the start of the pool
+        cursor_ = (word + 1) * 64;
+        if (cursor_ >= count_)
+            cursor_ = 0;
+    }
+}
+
+bool AddressPool::claim(uint32_t addr)
+{
+    uint32_t host = ntohl(addr);
+    if (host < network_ + first_ || host >= network_ + first_ + count_)
+        return false;
+
+    uint32_t offset = host - network_ - first_;
+    uint64_t bit = (uint64_t)1 << (offset % 64);
+    if (used_[offset / 64] & bit)
+        return false;
+    used_[offset / 64] |= bit;
+    free_--;
+    return true;
+}
+
+void AddressPool::release(uint32_t addr)
+{
+    uint32_t host = ntohl(addr);
+    if (host < network_ + first_ || host >= network_ + first_ + count_)
+        return;
+
+    uint32_t offset = host - network_ - first_;
+    uint64_t bit = (uint64_t)1 << (offset % 64);
+    if (used_[offset / 64] & bit)
+    {
+        used_[offset / 64] &= ~bit;
+        free_++;
+    }
+}
+
+string AddressPool::toCidr(uint32_t addr) const
+{
+    char text[INET_ADDRSTRLEN];
+    struct in_addr in;
+    in.s_addr = addr;
+    inet_ntop(AF_INET, &in, text, sizeof(text));
+    return string(text) + "/" + to_string(prefixLen_);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Hands out client addresses from an IPv4 network (e.g. "10.0.1.0/24")
+class AddressPool {
+public:
+    AddressPool();
+
+    // Parses the network in CIDR notation; the network and broadcast addresses
+    // and the first `reserved` hosts are never handed out
+    bool initialize(const std::string& cidr, uint32_t reserved = 1);
+
+    // Takes a free address (network byte order); returns 0 when the pool is exhausted
+    uint32_t allocate();
+
+    // Takes a specific address (network byte order) if it is in the pool and free,
+    // e.g. the one a reconnecting client had before
+    bool claim(uint32_t addr);
+
+    // Returns an address to the pool
+    void release(uint32_t addr);
+
+    // Prefix length of the network, used when configuring client interfaces
+    int getPrefixLength() const { return prefixLen_; }
+
+    size_t available() const { return free_; }
+
+    // Formats an address as "a.b.c.d/prefix"
+    std::string toCidr(uint32_t addr) const;
+
+private:
+    uint32_t network_;           // First address of the network (host byte order)
+    int prefixLen_;              // CIDR prefix length
+    uint32_t first_;             // First assignable host offset
+    uint32_t count_;             // Number of assignable host offsets
+    uint32_t cursor_;            // Next offset to probe (next-fit keeps allocation O(1) amortized)
+    size_t free_;                // Addresses still available
+    std::vector<uint64_t> used_; // One bit per assignable offset
+};
@@ -0,0 +1,75 @@
+#include "EventLoop.hpp"
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+
+using namespace std;
+
+EventLoop::EventLoop() : epollFd_(-1)
+{
+}
+
+EventLoop::~EventLoop()
+{
+    if (epollFd_ >= 0)
+        close(epollFd_);
+}
+
+bool EventLoop::initialize()
+{
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0)
+    {
+        cerr << "epoll_create1 failed: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+bool EventLoop::add(int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        cerr << "epoll_ctl(ADD, " << fd << ") failed: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev) < 0)
+    {
+        cerr << "epoll_ctl(MOD, " << fd << ") failed: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+bool EventLoop::remove(int fd)
+{
+    // The event argument is ignored for DEL but must be non-null on old kernels
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    return epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, &ev) == 0;
+}
+
+int EventLoop::wait(struct epoll_event* events, int maxEvents, int timeoutMs)
+{
+    int n;
+    // Retry when a signal interrupts the wait
+    do
+    {
+        n = epoll_wait(epollFd_, events, maxEvents, timeoutMs);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
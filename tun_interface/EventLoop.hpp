@@ -0,0 +1,38 @@
+#pragma once
+#include <sys/epoll.h>
+#include <cstdint>
+
+// Thin wrapper around a Linux epoll instance used by the server data path
+class EventLoop {
+public:
+    // Maximum number of events collected by a single wait() call
+    static constexpr int MAX_EVENTS = 256;
+
+    EventLoop();
+
+    ~EventLoop();
+
+    bool initialize();
+
+    // Registers a file descriptor for the given EPOLL* event mask
+    bool add(int fd, uint32_t events);
+
+    // Changes the event mask of an already registered file descriptor
+    bool modify(int fd, uint32_t events);
+
+    // Stops watching a file descriptor (must be called before closing it)
+    bool remove(int fd);
+
+    // Waits for events; returns the number of ready entries or -1 on error
+    int wait(struct epoll_event* events, int maxEvents, int timeoutMs);
+
+    // Returns the epoll file descriptor
+    int getFd() const { return epollFd_; }
+
+private:
+    int epollFd_;    // epoll instance
+
+    // Delete copy constructor and assignment operator to prevent copying
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+};
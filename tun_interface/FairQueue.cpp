@@ -0,0 +1,170 @@
+#include "FairQueue.hpp"
+#include "FlowHash.hpp"
+#include <cmath>
+
+using namespace std;
+
+// Below this a queue is never dropped from: one packet waiting is no standing queue
+static constexpr size_t MTU_BYTES = 1500;
+
+size_t FairQueue::enqueue(PacketHandle& packet, const struct virtio_net_hdr& vnet, Clock::time_point now) {
+    if (flows_.empty())
+        flows_.resize(FLOWS);
+
+    size_t memory = packet.capacity();
+    size_t dropped = 0;
+    while (packets_ > 0 && (packets_ >= LIMIT || memory_ + memory > MEMORY_LIMIT)) {
+        // Like fq_codel: the longest queue pays, which is rarely a sparse flow's
+        Flow* fattest = &flows_[0];
+        for (Flow& flow : flows_) {
+            if (flow.bytes > fattest->bytes)
+                fattest = &flow;
+        }
+        drop(*fattest);
+        dropped++;
+    }
+
+    int32_t index;
+    if (free_ >= 0) {
+        index = free_;
+        free_ = nodes_[index].next;
+    } else {
+        index = nodes_.size();
+        nodes_.emplace_back();
+    }
+    Node& node = nodes_[index];
+    size_t len = packet.length();
+    Flow& flow = flows_[flowHash(packet.data(), len) % FLOWS];
+    node.packet.data = move(packet);
+    node.packet.vnet = vnet;
+    node.packet.enqueued = now;
+    node.next = -1;
+    if (flow.tail >= 0)
+        nodes_[flow.tail].next = index;
+    else
+        flow.head = index;
+    flow.tail = index;
+    flow.bytes += len;
+    packets_++;
+    memory_ += memory;
+
+    // A flow that had nothing queued starts a round of its own ahead of the backlogged ones
+    if (!flow.listed) {
+        flow.listed = true;
+        flow.deficit = QUANTUM;
+        newFlows_.push_back(&flow - flows_.data());
+    }
+    return dropped;
+}
+
+bool FairQueue::dequeue(Packet& out, Clock::time_point now, size_t& dropped) {
+    dropped = 0;
+    while (true) {
+        deque<uint16_t>* list = !newFlows_.empty() ? &newFlows_ : !oldFlows_.empty() ? &oldFlows_ : nullptr;
+        if (!list)
+            return false;
+        uint16_t index = list->front();
+        Flow& flow = flows_[index];
+
+        // Used up its quantum: to the back of the line with a new one
+        if (flow.deficit <= 0) {
+            flow.deficit += QUANTUM;
+            list->pop_front();
+            oldFlows_.push_back(index);
+            continue;
+        }
+
+        if (!codelDequeue(flow, out, now, dropped)) {
+            // An emptied new flow goes through the old list once, so a flow that keeps
+            // sending one packet at a time cannot stay ahead of everyone else
+            list->pop_front();
+            if (list == &newFlows_ && !oldFlows_.empty())
+                oldFlows_.push_back(index);
+            else
+                flow.listed = false;
+            continue;
+        }
+        flow.deficit -= out.data.length();
+        return true;
+    }
+}
+
+bool FairQueue::pop(Flow& flow, Packet& out) {
+    if (flow.head < 0)
+        return false;
+    int32_t index = flow.head;
+    Node& node = nodes_[index];
+    out = move(node.packet);
+    flow.head = node.next;
+    if (flow.head < 0)
+        flow.tail = -1;
+    flow.bytes -= out.data.length();
+    packets_--;
+    memory_ -= out.data.capacity();
+    node.next = free_;
+    free_ = index;
+    return true;
+}
+
+void FairQueue::drop(Flow& flow) {
+    Packet packet;
+    pop(flow, packet);  // The buffer goes back to its pool with the handle
+}
+
+bool FairQueue::shouldDrop(Flow& flow, const Packet& packet, Clock::time_point now) {
+    if (now - packet.enqueued < TARGET || flow.bytes <= MTU_BYTES) {
+        flow.firstAbove = Clock::time_point();
+        return false;
+    }
+    if (flow.firstAbove == Clock::time_point()) {
+        flow.firstAbove = now + INTERVAL;
+        return false;
+    }
+    return now >= flow.firstAbove;
+}
+
+bool FairQueue::codelDequeue(Flow& flow, Packet& out, Clock::time_point now, size_t& dropped) {
+    if (!pop(flow, out)) {
+        flow.dropping = false;
+        return false;
+    }
+    bool drop = shouldDrop(flow, out, now);
+    if (flow.dropping) {
+        if (!drop) {
+            flow.dropping = false;
+            return true;
+        }
+        // Drop at the rate the control law sets until the delay comes down
+        while (now >= flow.dropNext && flow.dropping) {
+            dropped++;
+            flow.count++;
+            if (!pop(flow, out)) {
+                flow.dropping = false;
+                return false;
+            }
+            if (!shouldDrop(flow, out, now))
+                flow.dropping = false;
+            else
+                flow.dropNext = controlLaw(flow.dropNext, flow.count);
+        }
+        return true;
+    }
+    if (drop) {
+        // Enter the dropping state, picking up the previous drop rate if that was recent
+        dropped++;
+        bool more = pop(flow, out);
+        if (more)
+            shouldDrop(flow, out, now);
+        flow.dropping = true;
+        uint32_t delta = flow.count - flow.lastCount;
+        flow.count = delta > 1 && now - flow.dropNext < 16 * INTERVAL ? delta : 1;
+        flow.lastCount = flow.count;
+        flow.dropNext = controlLaw(now, flow.count);
+        return more;
+    }
+    return true;
+}
+
+FairQueue::Clock::time_point FairQueue::controlLaw(Clock::time_point t, uint32_t count) {
+    return t + chrono::duration_cast<Clock::duration>(INTERVAL / sqrt((double)count));
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "TunDevice.hpp"
+#include "PacketPool.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Egress scheduler for one tunnel connection (-f), after FQ-CoDel (RFC 8290): packets are
+// hashed by flow into queues served deficit round robin, new flows first, so a sparse flow
+// (SSH, VoIP, DNS) is not stuck behind a bulk transfer. Each queue runs CoDel on the time
+// its head packet waited and drops from the head once that stays above TARGET for an
+// INTERVAL, which tells the bulk flow's TCP to slow down. Only the owning thread uses it.
+class FairQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Flow queues (hash buckets) per connection
+    static constexpr size_t FLOWS = 256;
+    // Packets held in all queues; beyond that the longest queue loses its head
+    static constexpr size_t LIMIT = 1024;
+    // Buffer memory the queued packets may pin, counted by the buffers' size rather than the
+    // packets' (fq_codel's memory_limit): with -o every packet holds a 64 KB buffer, and the
+    // packet limit alone would let a stalled connection keep 64 MB of the pool
+    static constexpr size_t MEMORY_LIMIT = 4 * 1024 * 1024;
+    // Bytes a flow may send per round
+    static constexpr int QUANTUM = 1500;
+    // CoDel: acceptable standing queue delay, and how long it may be exceeded
+    static constexpr std::chrono::microseconds TARGET{5000};
+    static constexpr std::chrono::microseconds INTERVAL{100000};
+    // Bytes let past the scheduler into a connection's send queue, and the unsent bytes the
+    // kernel may hold for its socket: a few records to keep the link busy, little enough that
+    // a packet the scheduler picks next goes out within milliseconds
+    static constexpr size_t BACKLOG_BYTES = 16 * 1024;
+
+    struct Packet {
+        PacketHandle data;
+        struct virtio_net_hdr vnet;
+        Clock::time_point enqueued;
+    };
+
+    // Queues a packet read from the TUN device; the handle moves in. Returns the packets
+    // (not necessarily this one) dropped to stay within the limits
+    size_t enqueue(PacketHandle& packet, const struct virtio_net_hdr& vnet, Clock::time_point now);
+
+    // Takes the next packet to send; false when every queue is empty. dropped counts the
+    // packets CoDel discarded on the way
+    bool dequeue(Packet& out, Clock::time_point now, size_t& dropped);
+
+    bool empty() const { return packets_ == 0; }
+    size_t packets() const { return packets_; }
+    size_t memory() const { return memory_; }
+
+private:
+    struct Flow {
+        int32_t head = -1, tail = -1;  // Node indices of the queued packets, oldest first
+        size_t bytes = 0;
+        int deficit = 0;
+        bool listed = false;           // On newFlows_ or oldFlows_
+        // CoDel state
+        bool dropping = false;
+        uint32_t count = 0, lastCount = 0;
+        Clock::time_point firstAbove;  // When the delay was first above TARGET (epoch: it is not)
+        Clock::time_point dropNext;
+    };
+
+    struct Node {
+        Packet packet;
+        int32_t next;
+    };
+
+    bool pop(Flow& flow, Packet& out);
+    void drop(Flow& flow);
+    bool shouldDrop(Flow& flow, const Packet& packet, Clock::time_point now);
+    // CoDel's head of queue: the next packet CoDel lets through, if any
+    bool codelDequeue(Flow& flow, Packet& out, Clock::time_point now, size_t& dropped);
+    static Clock::time_point controlLaw(Clock::time_point t, uint32_t count);
+
+    std::vector<Flow> flows_;            // Allocated on first use
+    std::vector<Node> nodes_;            // Packet storage, grown up to LIMIT
+    int32_t free_ = -1;                  // Unused nodes, linked through next
+    std::deque<uint16_t> newFlows_, oldFlows_;
+    size_t packets_ = 0;
+    size_t memory_ = 0;                  // Buffer bytes held, see MEMORY_LIMIT
+};
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+
+// Hash of the flow an IP packet belongs to: addresses, protocol and, for TCP and UDP, the
+// ports. Every packet of a flow hashes alike, so a flow striped onto one stream stays in
+// order. Fragments hash by addresses and protocol only, as only the first has the ports.
+inline uint32_t flowHash(const char* packet, size_t len) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(packet);
+    uint32_t words[10] = {};
+    size_t offset;
+    uint8_t protocol;
+    bool fragment;
+    if (len >= 20 && (p[0] >> 4) == 4) {
+        offset = (p[0] & 0x0f) * 4;
+        protocol = p[9];
+        fragment = (p[6] & 0x3f) || p[7];  // More fragments flag or a fragment offset
+        memcpy(words, p + 12, 8);
+    } else if (len >= 40 && (p[0] >> 4) == 6) {
+        offset = 40;
+        protocol = p[6];
+        fragment = protocol == IPPROTO_FRAGMENT;
+        memcpy(words, p + 8, 32);
+    } else {
+        return 0;
+    }
+    words[8] = protocol;
+    if (!fragment && (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) && len >= offset + 4)
+        memcpy(&words[9], p + offset, 4);
+
+    // FNV-1a over the words, then a final mix so the low bits spread well for small stream counts
+    uint32_t hash = 2166136261u;
+    for (uint32_t word : words) {
+        hash = (hash ^ word) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    return hash;
+}
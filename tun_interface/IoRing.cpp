@@ -0,0 +1,134 @@
+#include "IoRing.hpp"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+IoRing::IoRing()
+    : fd_(-1), sqRing_(MAP_FAILED), cqRing_(MAP_FAILED), sqRingSize_(0), cqRingSize_(0),
+      sqes_((struct io_uring_sqe*)MAP_FAILED), sqesSize_(0), sqTailShared_(nullptr), sqHead_(nullptr),
+      sqMask_(0), sqEntries_(0), sqTail_(0), submitted_(0), cqHead_(nullptr), cqTail_(nullptr), cqMask_(0),
+      cqes_(nullptr), enters_(0) {
+}
+
+IoRing::~IoRing() {
+    if (sqes_ != MAP_FAILED)
+        munmap(sqes_, sqesSize_);
+    if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+        munmap(cqRing_, cqRingSize_);
+    if (sqRing_ != MAP_FAILED)
+        munmap(sqRing_, sqRingSize_);
+    // Closing the ring cancels whatever is still in flight
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+bool IoRing::initialize(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0)
+        return false;
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Since 5.4 both queues share one mapping
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sqRingSize_ = cqRingSize_ = max(sqRingSize_, cqRingSize_);
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED)
+        return false;
+    cqRing_ = single ? sqRing_
+                     : mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                            IORING_OFF_CQ_RING);
+    if (cqRing_ == MAP_FAILED)
+        return false;
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = (struct io_uring_sqe*)mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED)
+        return false;
+
+    char* sq = static_cast<char*>(sqRing_);
+    sqHead_ = (unsigned*)(sq + params.sq_off.head);
+    sqTailShared_ = (unsigned*)(sq + params.sq_off.tail);
+    sqMask_ = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sqEntries_ = params.sq_entries;
+    sqTail_ = submitted_ = *sqTailShared_;
+    // Entry i of the submission array always names sqes_[i]: entries are used in ring order
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sqEntries_; i++)
+        array[i] = i;
+
+    char* cq = static_cast<char*>(cqRing_);
+    cqHead_ = (unsigned*)(cq + params.cq_off.head);
+    cqTail_ = (unsigned*)(cq + params.cq_off.tail);
+    cqMask_ = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+struct io_uring_sqe* IoRing::prepare() {
+    if (sqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_)
+        return nullptr;
+    struct io_uring_sqe* sqe = &sqes_[sqTail_ & sqMask_];
+    memset(sqe, 0, sizeof(*sqe));
+    sqTail_++;
+    return sqe;
+}
+
+bool IoRing::submit(unsigned waitFor) {
+    unsigned toSubmit = sqTail_ - submitted_;
+    if (toSubmit == 0 && waitFor == 0)
+        return true;
+    __atomic_store_n(sqTailShared_, sqTail_, __ATOMIC_RELEASE);
+    while (toSubmit > 0 || waitFor > 0) {
+        int n = enter(toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        // A short count only happens when the completion queue is backed up; the rest
+        // goes in on the next call
+        submitted_ += n;
+        toSubmit -= n;
+        waitFor = 0;
+        if (n == 0)
+            break;
+    }
+    return true;
+}
+
+int IoRing::enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    enters_++;
+    return syscall(__NR_io_uring_enter, fd_, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+bool IoRing::registerEventFd(int fd) {
+    return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_EVENTFD, &fd, 1) == 0;
+}
+
+bool IoRing::registerBuffers(unsigned count) {
+    struct io_uring_rsrc_register table;
+    memset(&table, 0, sizeof(table));
+    table.nr = count;
+    table.flags = IORING_RSRC_REGISTER_SPARSE;
+    return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS2, &table, sizeof(table)) == 0;
+}
+
+bool IoRing::updateBuffer(unsigned index, void* base, size_t len) {
+    struct iovec iov = {base, len};
+    struct io_uring_rsrc_update2 update;
+    memset(&update, 0, sizeof(update));
+    update.offset = index;
+    update.data = (uintptr_t)&iov;
+    update.nr = 1;
+    return syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == 1;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+
+// Minimal io_uring instance driven through the raw system calls (no liburing): a submission
+// queue the caller fills with prepare() and hands over with submit(), and a completion
+// queue drained with complete(). Only the owning thread uses it.
+class IoRing {
+public:
+    IoRing();
+    ~IoRing();
+
+    // Creates the ring with room for `entries` submissions; false (with errno set) if the
+    // kernel has no io_uring or does not allow it
+    bool initialize(unsigned entries);
+
+    // Zeroed submission queue entry to fill in, or nullptr if the queue is full
+    struct io_uring_sqe* prepare();
+
+    // Entries prepared since the last submit()
+    unsigned prepared() const { return sqTail_ - submitted_; }
+
+    // Hands the prepared entries to the kernel, and waits until at least `waitFor`
+    // completions are queued, in one io_uring_enter. Returns false on error
+    bool submit(unsigned waitFor = 0);
+
+    // Completions queued and not yet taken
+    unsigned completions() const { return __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) - *cqHead_; }
+
+    // Calls f(const io_uring_cqe&) for every queued completion; returns how many there were
+    template <typename F>
+    unsigned complete(F f) {
+        unsigned head = *cqHead_;
+        unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        unsigned count = tail - head;
+        for (; head != tail; head++)
+            f(cqes_[head & cqMask_]);
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // Signals an eventfd whenever a completion is queued, so epoll or select can wait for them
+    bool registerEventFd(int fd);
+
+    // Reserves a table of `count` fixed buffers, all empty, for updateBuffer() to fill
+    bool registerBuffers(unsigned count);
+    // Makes [base, base + len) fixed buffer `index`, for READ_FIXED/WRITE_FIXED entries
+    bool updateBuffer(unsigned index, void* base, size_t len);
+
+    // io_uring_enter calls made so far
+    uint64_t enters() const { return enters_; }
+
+private:
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+
+    int fd_;
+    void* sqRing_;
+    void* cqRing_;
+    size_t sqRingSize_, cqRingSize_;
+    struct io_uring_sqe* sqes_;
+    size_t sqesSize_;
+    unsigned* sqTailShared_;  // Kernel-visible tail, published by submit()
+    unsigned* sqHead_;
+    unsigned sqMask_, sqEntries_;
+    unsigned sqTail_;         // Next entry to prepare
+    unsigned submitted_;      // sqTail_ as of the last submit()
+    unsigned* cqHead_;
+    unsigned* cqTail_;
+    unsigned cqMask_;
+    struct io_uring_cqe* cqes_;
+    uint64_t enters_;
+
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+};
@@ -0,0 +1,157 @@
+#include "Logger.hpp"
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <signal.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+atomic<int> Logger::level_(Logger::Info);
+atomic<unsigned long> Logger::dropped_(0);
+
+namespace {
+
+// One queued message. sequence implements Vyukov's bounded MPMC queue: a producer may
+// fill the slot when sequence == its ticket, the consumer may read it at ticket + 1.
+struct Slot {
+    atomic<size_t> sequence;
+    Logger::Level level;
+    struct timespec time;
+    char text[Logger::MESSAGE_SIZE];
+};
+
+struct Ring {
+    Slot slots[Logger::RING_SLOTS];
+    alignas(64) atomic<size_t> enqueuePos{0};  // Next ticket for producers
+    alignas(64) size_t dequeuePos = 0;         // Next slot for the writer thread
+
+    Ring() {
+        for (size_t i = 0; i < Logger::RING_SLOTS; i++)
+            slots[i].sequence.store(i, memory_order_relaxed);
+    }
+};
+
+Ring ring;
+thread writer;
+atomic<bool> running(false);
+
+const char* levelName(Logger::Level level) {
+    switch (level) {
+    case Logger::Trace: return "TRACE";
+    case Logger::Debug: return "DEBUG";
+    case Logger::Info: return "INFO ";
+    case Logger::Warn: return "WARN ";
+    default: return "ERROR";
+    }
+}
+
+// Moves every queued message into one buffer and writes it with a single fwrite
+bool drain() {
+    char out[64 * 1024];
+    size_t used = 0;
+    bool any = false;
+    while (true) {
+        Slot& slot = ring.slots[ring.dequeuePos & (Logger::RING_SLOTS - 1)];
+        if (slot.sequence.load(memory_order_acquire) != ring.dequeuePos + 1)
+            break;
+
+        if (used + Logger::MESSAGE_SIZE + 64 > sizeof(out)) {
+            fwrite(out, 1, used, stderr);
+            used = 0;
+        }
+        struct tm tm;
+        localtime_r(&slot.time.tv_sec, &tm);
+        int n = snprintf(out + used, sizeof(out) - used, "%02d:%02d:%02d.%06ld %s %s\n",
+                         tm.tm_hour, tm.tm_min, tm.tm_sec, slot.time.tv_nsec / 1000,
+                         levelName(slot.level), slot.text);
+        used += min((size_t)n, sizeof(out) - used - 1);
+
+        slot.sequence.store(ring.dequeuePos + Logger::RING_SLOTS, memory_order_release);
+        ring.dequeuePos++;
+        any = true;
+    }
+    if (used) {
+        fwrite(out, 1, used, stderr);
+        fflush(stderr);
+    }
+    return any;
+}
+
+void run() {
+    // Signals are for the packet threads (the server takes SIGHUP through a signalfd)
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+    unsigned long reported = 0;
+    while (running.load(memory_order_acquire)) {
+        if (!drain())
+            this_thread::sleep_for(chrono::milliseconds(2));
+        unsigned long dropped = Logger::dropped();
+        if (dropped != reported) {
+            fprintf(stderr, "%lu log messages dropped (ring full)\n", dropped - reported);
+            reported = dropped;
+        }
+    }
+    drain();
+}
+
+// Flushes the ring if main() returns without calling stop()
+struct StopAtExit {
+    ~StopAtExit() { Logger::stop(); }
+} stopAtExit;
+
+}  // namespace
+
+void Logger::start() {
+    if (running.exchange(true))
+        return;
+    writer = thread(run);
+}
+
+void Logger::stop() {
+    if (!running.exchange(false)) {
+        drain();
+        return;
+    }
+    writer.join();
+}
+
+void Logger::write(Level level, const char* format, ...) {
+    // Claim a ticket; a full ring drops the message instead of waiting
+    size_t pos = ring.enqueuePos.load(memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &ring.slots[pos & (RING_SLOTS - 1)];
+        intptr_t diff = (intptr_t)slot->sequence.load(memory_order_acquire) - (intptr_t)pos;
+        if (diff == 0) {
+            if (ring.enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            dropped_.fetch_add(1, memory_order_relaxed);
+            return;
+        } else {
+            pos = ring.enqueuePos.load(memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    slot->sequence.store(pos + 1, memory_order_release);
+}
+
+bool Logger::RateLimiter::allow() {
+    uint64_t second = chrono::duration_cast<chrono::seconds>(
+                          chrono::steady_clock::now().time_since_epoch()).count();
+    uint64_t current = second_.load(memory_order_relaxed);
+    if (current != second && second_.compare_exchange_strong(current, second, memory_order_relaxed))
+        count_.store(0, memory_order_relaxed);
+    return count_.fetch_add(1, memory_order_relaxed) < perSecond_;
+}
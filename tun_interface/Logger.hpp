@@ -1,12 +1,89 @@
 #pragma once
-#include <string>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 
+// Severity levels. Statements below LOG_LEVEL are removed at compile time, arguments
+// included, so e.g. per-packet tracing costs nothing in a normal build.
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+
+// Build with -DLOG_LEVEL=LOG_LEVEL_TRACE (LOG_LEVEL=trace ./run.sh compile) to keep tracing
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Asynchronous logger: callers format into a slot of a lock-free ring and return;
+// a background thread writes the ring to stderr in batches. When the ring is full the
+// message is dropped (and counted) rather than blocking a packet loop.
 class Logger {
 public:
-    static void setDebug(bool enable) { debug_ = enable; }
-    static void debug(const std::string& msg);
-    static void error(const std::string& msg);
+    enum Level {
+        Trace = LOG_LEVEL_TRACE,
+        Debug = LOG_LEVEL_DEBUG,
+        Info = LOG_LEVEL_INFO,
+        Warn = LOG_LEVEL_WARN,
+        Error = LOG_LEVEL_ERROR,
+    };
+
+    static constexpr size_t RING_SLOTS = 4096;   // Power of two
+    static constexpr size_t MESSAGE_SIZE = 232;  // Longer messages are truncated
+
+    // Starts the writer thread; messages logged earlier wait in the ring
+    static void start();
+    // Writes whatever is still queued and stops the writer thread
+    static void stop();
+
+    // Runtime floor on top of the compile-time one (default Info)
+    static void setLevel(Level level) { level_.store(level, std::memory_order_relaxed); }
+    static bool enabled(Level level) { return level >= level_.load(std::memory_order_relaxed); }
+
+    // Formats a message into the ring; never blocks
+    static void write(Level level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+    // Messages lost because the ring was full
+    static unsigned long dropped() { return dropped_.load(std::memory_order_relaxed); }
+
+    // Lets at most perSecond messages per second through one call site
+    class RateLimiter {
+    public:
+        explicit RateLimiter(unsigned perSecond) : perSecond_(perSecond) {}
+        bool allow();
+
+    private:
+        unsigned perSecond_;
+        std::atomic<uint64_t> second_{0};
+        std::atomic<unsigned> count_{0};
+    };
 
 private:
-    static bool debug_;
+    static std::atomic<int> level_;
+    static std::atomic<unsigned long> dropped_;
 };
+
+#define LOG_AT(level, ...)                                          \
+    do {                                                            \
+        if constexpr ((level) >= LOG_LEVEL) {                       \
+            if (Logger::enabled((Logger::Level)(level)))            \
+                Logger::write((Logger::Level)(level), __VA_ARGS__); \
+        }                                                           \
+    } while (0)
+
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Per-packet tracing: at most perSecond lines per second from this statement
+#define LOG_TRACE_RATE(perSecond, ...)                                          \
+    do {                                                                        \
+        if constexpr (LOG_LEVEL_TRACE >= LOG_LEVEL) {                           \
+            static Logger::RateLimiter limiter_(perSecond);                     \
+            if (Logger::enabled(Logger::Trace) && limiter_.allow())             \
+                Logger::write(Logger::Trace, __VA_ARGS__);                      \
+        }                                                                       \
+    } while (0)
@@ -0,0 +1,291 @@
+#include "Metrics.hpp"
+#include "Logger.hpp"
+#include "PacketPool.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+Histogram::Histogram(initializer_list<double> bounds) : size_(min(bounds.size(), MAX_BUCKETS)) {
+    copy_n(bounds.begin(), size_, bounds_);
+}
+
+void Histogram::observe(double value, uint64_t count) {
+    size_t i = 0;
+    while (i < size_ && value > bounds_[i])
+        i++;
+    counts_[i].add(count);
+    count_.add(count);
+    sum_.store(sum_.load(memory_order_relaxed) + value * count, memory_order_relaxed);
+}
+
+namespace {
+
+// Never destroyed, so the exporter thread can still scrape while the process exits
+struct Registry {
+    mutex lock;
+    vector<MetricsShard*> shards;
+    vector<SessionMetrics*> sessions;
+    vector<const PacketPool*> pools;
+};
+
+Registry& registry() {
+    static Registry* instance = new Registry();
+    return *instance;
+}
+
+// Appends one "# HELP"/"# TYPE" header
+void header(string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+void sample(string& out, const char* name, const string& labels, double value) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s%s %.17g\n", name, labels.c_str(), value);
+    out += line;
+}
+
+// A counter or gauge summed over every shard, times scale (e.g. nanoseconds to seconds)
+template <typename Metric>
+void global(string& out, const vector<MetricsShard*>& shards, const char* name, const char* type,
+            const char* help, Metric MetricsShard::*metric, double scale = 1) {
+    double total = 0;
+    for (MetricsShard* shard : shards)
+        total += (shard->*metric).get();
+    header(out, name, type, help);
+    sample(out, name, "", total * scale);
+}
+
+// A histogram merged over every shard, with cumulative buckets as Prometheus expects
+void histogram(string& out, const vector<MetricsShard*>& shards, const char* name, const char* help,
+               Histogram MetricsShard::*metric) {
+    header(out, name, "histogram", help);
+    if (shards.empty())
+        return;
+
+    const Histogram& layout = shards.front()->*metric;
+    string bucket = string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    double sum = 0;
+    for (size_t i = 0; i <= layout.bucketCount(); i++) {
+        for (MetricsShard* shard : shards)
+            cumulative += (shard->*metric).bucket(i);
+        char le[64];
+        if (i < layout.bucketCount())
+            snprintf(le, sizeof(le), "{le=\"%g\"}", layout.bound(i));
+        else
+            snprintf(le, sizeof(le), "{le=\"+Inf\"}");
+        sample(out, bucket.c_str(), le, cumulative);
+    }
+    for (MetricsShard* shard : shards)
+        sum += (shard->*metric).sum();
+    sample(out, (string(name) + "_sum").c_str(), "", sum);
+    // Count as the +Inf bucket, so the series stay consistent under concurrent updates
+    sample(out, (string(name) + "_count").c_str(), "", cumulative);
+}
+
+// One series per session
+template <typename Metric>
+void perSession(string& out, const vector<SessionMetrics*>& sessions, const char* name, const char* type,
+                const char* help, Metric SessionMetrics::*metric) {
+    header(out, name, type, help);
+    for (SessionMetrics* session : sessions) {
+        string labels = "{session=\"" + session->address + "\",peer=\"" + session->peer + "\"}";
+        sample(out, name, labels, (session->*metric).get());
+    }
+}
+
+// Answers each connection with the current metrics, whatever the request was
+void exporterLoop(int listenFd) {
+    // Signals are for the packet threads
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+    while (true) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Metrics endpoint accept failed: %s", strerror(errno));
+            break;
+        }
+
+        // Read (and ignore) the request so the client does not see a reset
+        struct timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[2048];
+        recv(fd, request, sizeof(request), 0);
+
+        string body = Metrics::render();
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                          to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+        close(fd);
+    }
+    close(listenFd);
+}
+
+} // namespace
+
+void Metrics::addShard(MetricsShard* shard) {
+    lock_guard<mutex> guard(registry().lock);
+    registry().shards.push_back(shard);
+}
+
+void Metrics::removeShard(MetricsShard* shard) {
+    lock_guard<mutex> guard(registry().lock);
+    auto& shards = registry().shards;
+    shards.erase(remove(shards.begin(), shards.end(), shard), shards.end());
+}
+
+void Metrics::addSession(SessionMetrics* session) {
+    lock_guard<mutex> guard(registry().lock);
+    registry().sessions.push_back(session);
+}
+
+void Metrics::removeSession(SessionMetrics* session) {
+    lock_guard<mutex> guard(registry().lock);
+    auto& sessions = registry().sessions;
+    sessions.erase(remove(sessions.begin(), sessions.end(), session), sessions.end());
+}
+
+void Metrics::addPool(const PacketPool* pool) {
+    lock_guard<mutex> guard(registry().lock);
+    registry().pools.push_back(pool);
+}
+
+void Metrics::removePool(const PacketPool* pool) {
+    lock_guard<mutex> guard(registry().lock);
+    auto& pools = registry().pools;
+    pools.erase(remove(pools.begin(), pools.end(), pool), pools.end());
+}
+
+uint64_t Metrics::total(Counter MetricsShard::*counter) {
+    lock_guard<mutex> guard(registry().lock);
+    uint64_t sum = 0;
+    for (MetricsShard* shard : registry().shards)
+        sum += (shard->*counter).get();
+    return sum;
+}
+
+string Metrics::render() {
+    lock_guard<mutex> guard(registry().lock);
+    const auto& shards = registry().shards;
+    const auto& sessions = registry().sessions;
+    string out;
+    out.reserve(8192 + sessions.size() * 1024);
+
+    global(out, shards, "vpn_packets_sent_total", "counter", "Packets read from TUN and queued to a tunnel", &MetricsShard::packetsSent);
+    global(out, shards, "vpn_bytes_sent_total", "counter", "Bytes read from TUN and queued to a tunnel", &MetricsShard::bytesSent);
+    global(out, shards, "vpn_packets_received_total", "counter", "Packets received from a tunnel and written to TUN", &MetricsShard::packetsReceived);
+    global(out, shards, "vpn_bytes_received_total", "counter", "Bytes received from a tunnel and written to TUN", &MetricsShard::bytesReceived);
+    global(out, shards, "vpn_drops_no_route_total", "counter", "TUN packets for an address no session owns", &MetricsShard::dropsNoRoute);
+    global(out, shards, "vpn_drops_queue_full_total", "counter", "TUN packets dropped because the send queue or fair queue was full", &MetricsShard::dropsQueueFull);
+    global(out, shards, "vpn_drops_codel_total", "counter", "TUN packets CoDel dropped from the fair queue for waiting too long", &MetricsShard::dropsCodel);
+    global(out, shards, "vpn_drops_tun_write_total", "counter", "Tunnel packets the TUN device refused", &MetricsShard::dropsTunWrite);
+    global(out, shards, "vpn_drops_held_total", "counter", "TUN packets held during a reconnect that expired or overflowed the hold limit", &MetricsShard::dropsHeld);
+    global(out, shards, "vpn_ssl_read_errors_total", "counter", "Tunnels closed by a TLS or socket read error", &MetricsShard::sslReadErrors);
+    global(out, shards, "vpn_ssl_write_errors_total", "counter", "Tunnels closed by a TLS or socket write error", &MetricsShard::sslWriteErrors);
+    global(out, shards, "vpn_sessions_added_total", "counter", "Client sessions established", &MetricsShard::sessionsAdded);
+    global(out, shards, "vpn_sessions_resumed_total", "counter", "Sessions that resumed from a ticket instead of a full handshake", &MetricsShard::sessionsResumed);
+    global(out, shards, "vpn_handshakes_failed_total", "counter", "TLS handshakes that failed", &MetricsShard::handshakesFailed);
+    global(out, shards, "vpn_handshakes_timed_out_total", "counter", "TLS handshakes abandoned at the time limit", &MetricsShard::handshakesTimedOut);
+    global(out, shards, "vpn_handshakes_pending", "gauge", "TLS handshakes in progress", &MetricsShard::handshakesPending);
+    global(out, shards, "vpn_sessions_closed_total", "counter", "Client sessions closed", &MetricsShard::sessionsClosed);
+    global(out, shards, "vpn_streams_joined_total", "counter", "Client connections that joined a session as an extra stream", &MetricsShard::streamsJoined);
+    global(out, shards, "vpn_reconnects_total", "counter", "Tunnels the client re-established after losing them", &MetricsShard::reconnects);
+    global(out, shards, "vpn_packets_held_total", "counter", "TUN packets held while the tunnel was down", &MetricsShard::packetsHeld);
+    global(out, shards, "vpn_sessions_ktls_send_total", "counter", "Sessions whose records the kernel encrypts", &MetricsShard::sessionsKtlsSend);
+    global(out, shards, "vpn_sessions_ktls_receive_total", "counter", "Sessions whose records the kernel decrypts", &MetricsShard::sessionsKtlsReceive);
+    global(out, shards, "vpn_sessions_active", "gauge", "Client sessions currently connected", &MetricsShard::sessionsActive);
+    global(out, shards, "vpn_tun_ring_enters_total", "counter", "io_uring_enter calls made for TUN reads and writes", &MetricsShard::ringEnters);
+    global(out, shards, "vpn_tun_ring_packets_total", "counter", "TUN reads completed and writes submitted through io_uring", &MetricsShard::ringPackets);
+    global(out, shards, "vpn_keepalives_sent_total", "counter", "Keepalive frames sent on idle connections", &MetricsShard::keepalivesSent);
+    global(out, shards, "vpn_keepalives_received_total", "counter", "Keepalive frames received", &MetricsShard::keepalivesReceived);
+    global(out, shards, "vpn_connections_timed_out_total", "counter", "Connections closed because the peer stopped sending keepalives", &MetricsShard::connectionsTimedOut);
+    global(out, shards, "vpn_timers_armed", "gauge", "Handshake and keepalive timers armed", &MetricsShard::timersArmed);
+    global(out, shards, "vpn_packets_compressed_total", "counter", "Packets sent as compressed frames", &MetricsShard::packetsCompressed);
+    global(out, shards, "vpn_packets_uncompressed_total", "counter", "Packets sent as is on compressing sessions (incompressible or no gain)", &MetricsShard::packetsUncompressed);
+    global(out, shards, "vpn_compress_input_bytes_total", "counter", "Bytes of the packets that were compressed", &MetricsShard::compressInputBytes);
+    global(out, shards, "vpn_compress_output_bytes_total", "counter", "Bytes those packets were compressed to", &MetricsShard::compressOutputBytes);
+    global(out, shards, "vpn_compress_seconds_total", "counter", "Time spent checking and compressing packets", &MetricsShard::compressNanoseconds, 1e-9);
+    global(out, shards, "vpn_decompress_seconds_total", "counter", "Time spent decompressing received frames", &MetricsShard::decompressNanoseconds, 1e-9);
+
+    histogram(out, shards, "vpn_sent_packet_size_bytes", "Size of packets read from TUN", &MetricsShard::sentSize);
+    histogram(out, shards, "vpn_received_packet_size_bytes", "Size of packets written to TUN", &MetricsShard::receivedSize);
+    histogram(out, shards, "vpn_tun_to_socket_seconds", "Time from reading a packet off TUN to handing it to the socket", &MetricsShard::tunToSocketSeconds);
+    histogram(out, shards, "vpn_fair_queue_seconds", "Time packets waited in a fair queue", &MetricsShard::fairQueueSeconds);
+
+    PacketPool::Stats pool = {0, 0, 0};
+    for (const PacketPool* p : registry().pools) {
+        PacketPool::Stats stats = p->stats();
+        pool.buffers += stats.buffers;
+        pool.inUse += stats.inUse;
+        pool.highWater += stats.highWater;
+    }
+    header(out, "vpn_packet_pool_buffers", "gauge", "Packet buffers allocated by the pools");
+    sample(out, "vpn_packet_pool_buffers", "", pool.buffers);
+    header(out, "vpn_packet_pool_in_use", "gauge", "Packet buffers handed out and not yet reclaimed");
+    sample(out, "vpn_packet_pool_in_use", "", pool.inUse);
+    header(out, "vpn_packet_pool_high_water", "gauge", "Peak packet buffers in use, summed over the per-thread caches");
+    sample(out, "vpn_packet_pool_high_water", "", pool.highWater);
+
+    perSession(out, sessions, "vpn_session_packets_sent_total", "counter", "Packets queued to the session", &SessionMetrics::packetsSent);
+    perSession(out, sessions, "vpn_session_bytes_sent_total", "counter", "Bytes queued to the session", &SessionMetrics::bytesSent);
+    perSession(out, sessions, "vpn_session_packets_received_total", "counter", "Packets received from the session", &SessionMetrics::packetsReceived);
+    perSession(out, sessions, "vpn_session_bytes_received_total", "counter", "Bytes received from the session", &SessionMetrics::bytesReceived);
+    perSession(out, sessions, "vpn_session_packets_dropped_total", "counter", "Packets for the session dropped on a full send queue or by CoDel", &SessionMetrics::packetsDropped);
+    perSession(out, sessions, "vpn_session_send_queue_bytes", "gauge", "Bytes waiting in the session's send queue", &SessionMetrics::sendQueueBytes);
+    perSession(out, sessions, "vpn_session_fair_queue_packets", "gauge", "Packets waiting in the session's fair queue", &SessionMetrics::fairQueuePackets);
+    return out;
+}
+
+bool Metrics::serve(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Metrics socket creation failed");
+        return false;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    // Loopback only: the endpoint has no authentication
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("Metrics endpoint bind failed");
+        close(fd);
+        return false;
+    }
+
+    thread(exporterLoop, fd).detach();
+    LOG_INFO("Serving metrics on http://127.0.0.1:%d/metrics", port);
+    return true;
+}
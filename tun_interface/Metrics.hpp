@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+
+class PacketPool;
+
+// Counter written by a single thread: a relaxed load and store instead of a locked
+// read-modify-write, so updates never contend. Any thread may read it.
+class Counter {
+public:
+    void add(uint64_t n = 1) { value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+// Current level of something, e.g. a queue depth; single writer like Counter
+class Gauge {
+public:
+    void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+    void add(int64_t n) { set(get() + n); }
+    int64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+// Distribution over fixed upper bounds (plus +Inf); single writer like Counter
+class Histogram {
+public:
+    static constexpr size_t MAX_BUCKETS = 16;
+
+    explicit Histogram(std::initializer_list<double> bounds);
+
+    void observe(double value, uint64_t count = 1);
+
+    size_t bucketCount() const { return size_; }
+    double bound(size_t i) const { return bounds_[i]; }
+    // Observations in bucket i alone (i == bucketCount() is +Inf); rendering makes them cumulative
+    uint64_t bucket(size_t i) const { return counts_[i].get(); }
+    uint64_t count() const { return count_.get(); }
+    double sum() const { return sum_.load(std::memory_order_relaxed); }
+
+private:
+    double bounds_[MAX_BUCKETS];
+    size_t size_;
+    Counter counts_[MAX_BUCKETS + 1];
+    Counter count_;
+    std::atomic<double> sum_{0};
+};
+
+// Everything one packet thread (a server worker or the client) counts. Each thread
+// owns its shard, so there is no sharing on the write side; exports sum the shards.
+struct MetricsShard {
+    Counter packetsSent, bytesSent;          // TUN packets queued to a tunnel
+    Counter packetsReceived, bytesReceived;  // Tunnel packets written to TUN
+    Counter dropsNoRoute;                    // No session owns the destination
+    Counter dropsQueueFull;                  // The session's send queue (or fair queue) was full
+    Counter dropsCodel;                      // Fair queueing (-f): dropped by CoDel for waiting too long
+    Counter dropsTunWrite;                   // The TUN device refused the packet
+    Counter sslReadErrors, sslWriteErrors;   // Tunnels lost to TLS/socket errors
+    Counter sessionsAdded, sessionsClosed;
+    Counter sessionsResumed;                 // Handshakes that resumed a ticket (abbreviated)
+    Counter handshakesFailed, handshakesTimedOut;
+    Gauge handshakesPending;                 // Handshakes in progress
+    Counter sessionsKtlsSend, sessionsKtlsReceive;
+    Counter streamsJoined;                   // Connections that joined a session as an extra stream
+    Gauge sessionsActive;
+    // Compression (-z): packets sent compressed and sent as is (they looked incompressible
+    // or did not shrink), bytes in and out of the compressor, and the time spent on it
+    Counter packetsCompressed, packetsUncompressed;
+    Counter compressInputBytes, compressOutputBytes;
+    Counter compressNanoseconds, decompressNanoseconds;
+    // Client reconnect mode (-x): tunnels brought back, TUN packets held while the tunnel
+    // was down, and held packets dropped for age or for the hold limit
+    Counter reconnects, packetsHeld, dropsHeld;
+    // io_uring TUN backend (-I): io_uring_enter calls, and the TUN reads and writes they carried
+    Counter ringEnters, ringPackets;
+    // Keepalives (-K): sent on idle connections and received, connections closed because
+    // their peer went silent, and the timers armed on the thread's timer wheel
+    Counter keepalivesSent, keepalivesReceived;
+    Counter connectionsTimedOut;
+    Gauge timersArmed;
+
+    // Packet sizes in each direction and the time from a TUN read to handing the packet to the socket
+    Histogram sentSize{64, 128, 256, 512, 1024, 1500, 4096, 16384, 65535};
+    Histogram receivedSize{64, 128, 256, 512, 1024, 1500, 4096, 16384, 65535};
+    Histogram tunToSocketSeconds{10e-6, 25e-6, 50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 10e-3, 100e-3};
+    // Fair queueing (-f): time packets waited in the scheduler before going to the tunnel
+    Histogram fairQueueSeconds{100e-6, 500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3, 25e-3, 50e-3, 100e-3, 250e-3, 1};
+};
+
+// Per-session counters, written by the session's owning thread
+struct SessionMetrics {
+    std::string address;  // Inner address, the "session" label
+    std::string peer;     // Outer address, the "peer" label
+    Counter packetsSent, bytesSent;
+    Counter packetsReceived, bytesReceived;
+    Counter packetsDropped;
+    Gauge sendQueueBytes;
+    Gauge fairQueuePackets;  // Waiting in the session's fair queue (-f)
+};
+
+// Registry of shards and sessions plus the Prometheus text exporter. Registration
+// takes a lock; updates never do.
+class Metrics {
+public:
+    static void addShard(MetricsShard* shard);
+    static void removeShard(MetricsShard* shard);
+    static void addSession(SessionMetrics* session);
+    static void removeSession(SessionMetrics* session);
+    static void addPool(const PacketPool* pool);
+    static void removePool(const PacketPool* pool);
+
+    // Sum of every registered shard's counter, e.g. for exit statistics
+    static uint64_t total(Counter MetricsShard::*counter);
+
+    // All metrics in the Prometheus text exposition format
+    static std::string render();
+
+    // Answers every HTTP request on 127.0.0.1:port with render(), from a background thread
+    static bool serve(int port);
+};
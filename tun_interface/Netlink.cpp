@@ -0,0 +1,316 @@
+#include "Netlink.hpp"
+#include "Logger.hpp"
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+// Large enough for any acknowledgement or address dump part the kernel sends
+static constexpr size_t RECEIVE_BUFFER = 32768;
+
+Netlink::Netlink() : fd_(-1), seq_(0)
+{
+}
+
+Netlink::~Netlink()
+{
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+bool Netlink::open()
+{
+    fd_ = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd_ < 0)
+    {
+        perror("socket(AF_NETLINK)");
+        return false;
+    }
+    struct sockaddr_nl local;
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    if (bind(fd_, (struct sockaddr *)&local, sizeof(local)) < 0)
+    {
+        perror("bind(AF_NETLINK)");
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    // Acknowledgements of failed requests need not echo the whole request back
+    int one = 1;
+    setsockopt(fd_, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+    return true;
+}
+
+bool Netlink::parseCidr(const string &cidr, int &family, unsigned char *addr, int &prefixLen)
+{
+    size_t slash = cidr.find('/');
+    string host = cidr.substr(0, slash);
+    if (inet_pton(AF_INET, host.c_str(), addr) == 1)
+        family = AF_INET;
+    else if (inet_pton(AF_INET6, host.c_str(), addr) == 1)
+        family = AF_INET6;
+    else
+        return false;
+
+    int maxPrefix = family == AF_INET ? 32 : 128;
+    if (slash == string::npos)
+    {
+        prefixLen = maxPrefix;
+        return true;
+    }
+    char *end;
+    long prefix = strtol(cidr.c_str() + slash + 1, &end, 10);
+    if (end == cidr.c_str() + slash + 1 || *end || prefix < 0 || prefix > maxPrefix)
+        return false;
+    prefixLen = prefix;
+    return true;
+}
+
+size_t Netlink::begin(uint16_t type, uint16_t flags, const void *body, size_t len,
+                      const string &description, bool missingOk)
+{
+    size_t message = batch_.size();
+    batch_.resize(message + NLMSG_SPACE(len));
+    struct nlmsghdr header;
+    memset(&header, 0, sizeof(header));
+    header.nlmsg_len = NLMSG_LENGTH(len);
+    header.nlmsg_type = type;
+    header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    header.nlmsg_seq = ++seq_;
+    memcpy(&batch_[message], &header, sizeof(header));
+    memcpy(&batch_[message + NLMSG_HDRLEN], body, len);
+    requests_.push_back({seq_, description, missingOk});
+    return message;
+}
+
+void Netlink::attribute(size_t message, uint16_t type, const void *data, size_t len)
+{
+    struct nlmsghdr header;
+    memcpy(&header, &batch_[message], sizeof(header));
+    size_t offset = message + NLMSG_ALIGN(header.nlmsg_len);
+    batch_.resize(offset + RTA_SPACE(len));
+    struct rtattr attr;
+    attr.rta_len = RTA_LENGTH(len);
+    attr.rta_type = type;
+    memcpy(&batch_[offset], &attr, sizeof(attr));
+    memcpy(&batch_[offset + RTA_LENGTH(0)], data, len);
+    header.nlmsg_len = NLMSG_ALIGN(header.nlmsg_len) + RTA_LENGTH(len);
+    memcpy(&batch_[message], &header, sizeof(header));
+}
+
+bool Netlink::addAddress(int ifindex, const string &cidr)
+{
+    int family, prefixLen;
+    unsigned char addr[16];
+    if (!parseCidr(cidr, family, addr, prefixLen))
+        return false;
+    struct ifaddrmsg body;
+    memset(&body, 0, sizeof(body));
+    body.ifa_family = family;
+    body.ifa_prefixlen = prefixLen;
+    body.ifa_index = ifindex;
+    size_t message = begin(RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &body, sizeof(body), "add address " + cidr);
+    size_t len = family == AF_INET ? 4 : 16;
+    attribute(message, IFA_LOCAL, addr, len);
+    attribute(message, IFA_ADDRESS, addr, len);
+    return true;
+}
+
+bool Netlink::route(uint16_t type, uint16_t flags, int ifindex, const string &cidr, bool missingOk)
+{
+    int family, prefixLen;
+    unsigned char addr[16];
+    if (!parseCidr(cidr, family, addr, prefixLen))
+        return false;
+    struct rtmsg body;
+    memset(&body, 0, sizeof(body));
+    body.rtm_family = family;
+    body.rtm_dst_len = prefixLen;
+    body.rtm_table = RT_TABLE_MAIN;
+    if (type == RTM_NEWROUTE)
+    {
+        // What `ip route add <cidr> dev <interface>` creates
+        body.rtm_protocol = RTPROT_BOOT;
+        body.rtm_scope = RT_SCOPE_LINK;
+        body.rtm_type = RTN_UNICAST;
+    }
+    else
+    {
+        // Matches the route whatever its scope
+        body.rtm_scope = RT_SCOPE_NOWHERE;
+    }
+    size_t message = begin(type, flags, &body, sizeof(body),
+                           (type == RTM_NEWROUTE ? "add route " : "delete route ") + cidr, missingOk);
+    // Host bits are cleared, as the kernel rejects a destination that has any
+    for (int bit = prefixLen; bit < (family == AF_INET ? 32 : 128); bit++)
+        addr[bit / 8] &= ~(0x80 >> (bit % 8));
+    uint32_t oif = ifindex;
+    attribute(message, RTA_DST, addr, family == AF_INET ? 4 : 16);
+    attribute(message, RTA_OIF, &oif, sizeof(oif));
+    return true;
+}
+
+bool Netlink::addRoute(int ifindex, const string &cidr)
+{
+    return route(RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, ifindex, cidr, false);
+}
+
+bool Netlink::deleteRoute(int ifindex, const string &cidr)
+{
+    return route(RTM_DELROUTE, 0, ifindex, cidr, true);
+}
+
+void Netlink::setLinkUp(int ifindex)
+{
+    struct ifinfomsg body;
+    memset(&body, 0, sizeof(body));
+    body.ifi_family = AF_UNSPEC;
+    body.ifi_index = ifindex;
+    body.ifi_flags = IFF_UP;
+    body.ifi_change = IFF_UP;
+    begin(RTM_NEWLINK, 0, &body, sizeof(body), "set link up");
+}
+
+void Netlink::setMtu(int ifindex, int mtu)
+{
+    struct ifinfomsg body;
+    memset(&body, 0, sizeof(body));
+    body.ifi_family = AF_UNSPEC;
+    body.ifi_index = ifindex;
+    size_t message = begin(RTM_NEWLINK, 0, &body, sizeof(body), "set MTU " + to_string(mtu));
+    uint32_t value = mtu;
+    attribute(message, IFLA_MTU, &value, sizeof(value));
+}
+
+bool Netlink::flushAddresses(int ifindex)
+{
+    // The dump goes out on its own, ahead of whatever is queued
+    struct
+    {
+        struct nlmsghdr header;
+        struct ifaddrmsg body;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = RTM_GETADDR;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = ++seq_;
+    request.body.ifa_family = AF_UNSPEC;
+    if (send(fd_, &request, sizeof(request), 0) < 0)
+    {
+        LOG_ERROR("Failed to list addresses: %s", strerror(errno));
+        return false;
+    }
+
+    vector<char> buffer(RECEIVE_BUFFER);
+    uint32_t seq = seq_;
+    for (;;)
+    {
+        ssize_t n = recv(fd_, buffer.data(), buffer.size(), 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Failed to list addresses: %s", strerror(errno));
+            return false;
+        }
+        int len = n;
+        for (struct nlmsghdr *header = (struct nlmsghdr *)buffer.data(); NLMSG_OK(header, len);
+             header = NLMSG_NEXT(header, len))
+        {
+            if (header->nlmsg_seq != seq)
+                continue;
+            if (header->nlmsg_type == NLMSG_DONE)
+                return true;
+            if (header->nlmsg_type == NLMSG_ERROR)
+            {
+                struct nlmsgerr *err = (struct nlmsgerr *)NLMSG_DATA(header);
+                LOG_ERROR("Failed to list addresses: %s", strerror(-err->error));
+                return false;
+            }
+            if (header->nlmsg_type != RTM_NEWADDR)
+                continue;
+            struct ifaddrmsg *found = (struct ifaddrmsg *)NLMSG_DATA(header);
+            if ((int)found->ifa_index != ifindex)
+                continue;
+
+            // Deleted by the same local and peer address it was listed with
+            struct ifaddrmsg body;
+            memset(&body, 0, sizeof(body));
+            body.ifa_family = found->ifa_family;
+            body.ifa_prefixlen = found->ifa_prefixlen;
+            body.ifa_index = ifindex;
+            size_t message = begin(RTM_DELADDR, 0, &body, sizeof(body), "delete address", true);
+            int attrLen = IFA_PAYLOAD(header);
+            for (struct rtattr *attr = IFA_RTA(found); RTA_OK(attr, attrLen); attr = RTA_NEXT(attr, attrLen))
+            {
+                if (attr->rta_type == IFA_LOCAL || attr->rta_type == IFA_ADDRESS)
+                    attribute(message, attr->rta_type, RTA_DATA(attr), RTA_PAYLOAD(attr));
+            }
+        }
+    }
+}
+
+bool Netlink::commit()
+{
+    if (requests_.empty())
+        return true;
+    if (send(fd_, batch_.data(), batch_.size(), 0) < 0)
+    {
+        LOG_ERROR("Failed to send %zu netlink requests: %s", requests_.size(), strerror(errno));
+        clear();
+        return false;
+    }
+
+    // Every request is acknowledged, failed or not, in the order sent
+    bool ok = true;
+    size_t acknowledged = 0;
+    vector<char> buffer(RECEIVE_BUFFER);
+    while (acknowledged < requests_.size())
+    {
+        ssize_t n = recv(fd_, buffer.data(), buffer.size(), 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Failed to read netlink acknowledgements: %s", strerror(errno));
+            ok = false;
+            break;
+        }
+        int len = n;
+        for (struct nlmsghdr *header = (struct nlmsghdr *)buffer.data(); NLMSG_OK(header, len);
+             header = NLMSG_NEXT(header, len))
+        {
+            if (header->nlmsg_type != NLMSG_ERROR)
+                continue;
+            auto request = find_if(requests_.begin(), requests_.end(),
+                                   [header](const Request &r) { return r.seq == header->nlmsg_seq; });
+            if (request == requests_.end())
+                continue;
+            acknowledged++;
+            int error = -((struct nlmsgerr *)NLMSG_DATA(header))->error;
+            bool gone = error == ESRCH || error == ENOENT || error == EADDRNOTAVAIL || error == ENODEV;
+            if (error && !(request->missingOk && gone))
+            {
+                LOG_ERROR("Failed to %s: %s", request->description.c_str(), strerror(error));
+                ok = false;
+            }
+        }
+    }
+    clear();
+    return ok;
+}
+
+void Netlink::clear()
+{
+    batch_.clear();
+    requests_.clear();
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Configures addresses, links and routes over an rtnetlink socket instead of running ip(8).
+// Requests are queued and sent together in one message by commit(), which then collects
+// the kernel's acknowledgement of each, so configuring an interface costs one round trip
+// instead of a fork and exec per step. Not thread-safe: callers share one under a lock.
+class Netlink {
+public:
+    Netlink();
+    ~Netlink();
+
+    bool open();
+
+    // Queue a request. Addresses and routes are CIDRs ("10.0.1.2/24", "fd00::/64");
+    // false if the CIDR does not parse, in which case nothing is queued
+    bool addAddress(int ifindex, const std::string& cidr);
+    bool addRoute(int ifindex, const std::string& cidr);     // Replaces an existing route
+    bool deleteRoute(int ifindex, const std::string& cidr);  // Gone already is not an error
+    void setLinkUp(int ifindex);
+    void setMtu(int ifindex, int mtu);
+
+    // Queues the removal of every address on the interface, like `ip addr flush`.
+    // Lists them first, which is a round trip of its own
+    bool flushAddresses(int ifindex);
+
+    // Sends the queued requests and waits for all of them; false if any failed
+    bool commit();
+
+    // Drops the queued requests without sending them
+    void clear();
+
+private:
+    struct Request {
+        uint32_t seq;
+        std::string description;  // For error messages, e.g. "add route 10.0.1.0/24"
+        bool missingOk;           // Deletions of what is already gone succeed
+    };
+
+    // Parses a CIDR into family, address bytes (4 or 16) and prefix length
+    static bool parseCidr(const std::string& cidr, int& family, unsigned char* addr, int& prefixLen);
+
+    // Starts a message of the given type; the body is zeroed and appended right after
+    size_t begin(uint16_t type, uint16_t flags, const void* body, size_t len,
+                 const std::string& description, bool missingOk = false);
+    void attribute(size_t message, uint16_t type, const void* data, size_t len);
+    bool route(uint16_t type, uint16_t flags, int ifindex, const std::string& cidr, bool missingOk);
+
+    int fd_;
+    uint32_t seq_;                   // Sequence number of the last request
+    std::vector<char> batch_;        // Queued messages, back to back
+    std::vector<Request> requests_;  // One per queued message
+};
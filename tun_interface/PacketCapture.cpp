@@ -0,0 +1,195 @@
+#include "PacketCapture.hpp"
+#include "Logger.hpp"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <sstream>
+
+using namespace std;
+
+// Option codes used in the blocks written here
+static constexpr uint16_t OPT_END = 0;
+static constexpr uint16_t OPT_EPB_FLAGS = 2;
+static constexpr uint16_t OPT_IF_TSRESOL = 9;
+// epb_flags direction bits
+static constexpr uint32_t FLAG_INBOUND = 1;
+static constexpr uint32_t FLAG_OUTBOUND = 2;
+
+// Block bodies are padded to 32 bits
+static size_t padded(size_t len) {
+    return (len + 3) & ~(size_t)3;
+}
+
+PacketCapture::PacketCapture(const string &name, size_t fileSize, int files, unsigned sample,
+                             const vector<IpAddress> &hosts)
+    : name_(name), fileSize_(max(fileSize, MIN_FILE_SIZE)), files_(max(files, 1)), sample_(max(sample, 1u)),
+      skipped_(0), hosts_(hosts), fd_(-1), index_(0), map_(nullptr), used_(0)
+{
+}
+
+PacketCapture::~PacketCapture()
+{
+    closeFile();
+}
+
+bool PacketCapture::parseHosts(const string &list, vector<IpAddress> &hosts)
+{
+    stringstream stream(list);
+    string host;
+    while (getline(stream, host, ','))
+    {
+        if (host.empty())
+            continue;
+        unsigned char addr[16];
+        if (inet_pton(AF_INET, host.c_str(), addr) == 1)
+        {
+            uint32_t v4;
+            memcpy(&v4, addr, sizeof(v4));
+            hosts.push_back(IpAddress::fromV4(v4));
+        }
+        else if (inet_pton(AF_INET6, host.c_str(), addr) == 1)
+        {
+            hosts.push_back(IpAddress::fromV6(addr));
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PacketCapture::open()
+{
+    index_ = 0;
+    return openFile();
+}
+
+bool PacketCapture::matches(const char *packet, size_t len) const
+{
+    if (hosts_.empty())
+        return true;
+    IpAddress src, dst;
+    if (!IpAddress::sourceOf(packet, len, src) || !IpAddress::destinationOf(packet, len, dst))
+        return false;
+    for (const IpAddress &host : hosts_)
+    {
+        if (host == src || host == dst)
+            return true;
+    }
+    return false;
+}
+
+void PacketCapture::record(const char *packet, size_t len, bool outbound)
+{
+    if (!map_ || !matches(packet, len))
+        return;
+    if (++skipped_ < sample_)
+        return;
+    skipped_ = 0;
+
+    // Enhanced Packet Block: header, packet, epb_flags and end-of-options, trailing length
+    uint32_t total = 28 + padded(len) + 8 + 4 + 4;
+    if (used_ + total > fileSize_)
+    {
+        // The ring moves on to the next file, overwriting the oldest
+        closeFile();
+        index_ = (index_ + 1) % files_;
+        if (!openFile())
+            return;
+        if (used_ + total > fileSize_)
+            return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    uint32_t header[7] = {ENHANCED_PACKET, total, 0, (uint32_t)(ns >> 32), (uint32_t)ns, (uint32_t)len, (uint32_t)len};
+    append(header, sizeof(header));
+    append(packet, len);
+    static const char zeros[4] = {};
+    append(zeros, padded(len) - len);
+    uint16_t flagsOption[2] = {OPT_EPB_FLAGS, 4};
+    uint32_t flags = outbound ? FLAG_OUTBOUND : FLAG_INBOUND;
+    append(flagsOption, sizeof(flagsOption));
+    append(&flags, sizeof(flags));
+    append(zeros, 4);
+    append(&total, sizeof(total));
+}
+
+bool PacketCapture::openFile()
+{
+    string path = name_ + "." + to_string(index_);
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+    {
+        LOG_ERROR("Failed to open capture file %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    // The whole file is mapped up front, so recording a packet is a memcpy
+    if (ftruncate(fd_, fileSize_) < 0 ||
+        (map_ = (char *)mmap(nullptr, fileSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0)) == MAP_FAILED)
+    {
+        LOG_ERROR("Failed to map capture file %s: %s", path.c_str(), strerror(errno));
+        map_ = nullptr;
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    used_ = 0;
+
+    // Section Header Block: native byte order, version 1.0, section length unknown
+    uint32_t section[3] = {SECTION_HEADER, 28, BYTE_ORDER_MAGIC};
+    uint16_t version[2] = {1, 0};
+    int64_t sectionLength = -1;
+    uint32_t sectionTotal = 28;
+    append(section, sizeof(section));
+    append(version, sizeof(version));
+    append(&sectionLength, sizeof(sectionLength));
+    append(&sectionTotal, sizeof(sectionTotal));
+
+    // Interface Description Block: raw IP packets, no snap length, nanosecond timestamps
+    uint32_t interface[2] = {INTERFACE_DESCRIPTION, 32};
+    uint16_t linkType[2] = {LINKTYPE_RAW, 0};
+    uint32_t snapLength = 0;
+    uint16_t tsresol[2] = {OPT_IF_TSRESOL, 1};
+    uint8_t nanoseconds[4] = {9, 0, 0, 0};
+    uint16_t end[2] = {OPT_END, 0};
+    uint32_t interfaceTotal = 32;
+    append(interface, sizeof(interface));
+    append(linkType, sizeof(linkType));
+    append(&snapLength, sizeof(snapLength));
+    append(tsresol, sizeof(tsresol));
+    append(nanoseconds, sizeof(nanoseconds));
+    append(end, sizeof(end));
+    append(&interfaceTotal, sizeof(interfaceTotal));
+    return true;
+}
+
+void PacketCapture::closeFile()
+{
+    if (map_)
+    {
+        munmap(map_, fileSize_);
+        map_ = nullptr;
+    }
+    if (fd_ >= 0)
+    {
+        // Readers stop at the zeros past the last block, so trim them off
+        if (ftruncate(fd_, used_) < 0)
+            LOG_WARN("Failed to trim capture file %s.%d", name_.c_str(), index_);
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+void PacketCapture::append(const void *data, size_t len)
+{
+    memcpy(map_ + used_, data, len);
+    used_ += len;
+}
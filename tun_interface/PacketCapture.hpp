@@ -0,0 +1,59 @@
+#pragma once
+#include "RouteTable.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Writes the packets passing one TUN queue to a ring of memory-mapped pcapng files,
+// <name>.0 ... <name>.<files-1>, starting over at .0 once the last one is full.
+// Not thread safe: a queue's capture is only used by the thread serving that queue.
+class PacketCapture {
+public:
+    static constexpr size_t DEFAULT_FILE_SIZE = 64 << 20;
+    static constexpr size_t MIN_FILE_SIZE = 1 << 20;
+    static constexpr int DEFAULT_FILES = 4;
+
+    // pcapng block types and the link type of packets without a link-layer header
+    static constexpr uint32_t SECTION_HEADER = 0x0A0D0D0A;
+    static constexpr uint32_t INTERFACE_DESCRIPTION = 1;
+    static constexpr uint32_t SIMPLE_PACKET = 3;
+    static constexpr uint32_t ENHANCED_PACKET = 6;
+    static constexpr uint32_t BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+    static constexpr uint16_t LINKTYPE_RAW = 101;
+
+    // Keeps one in every `sample` matching packets; with hosts, only packets from or to
+    // one of those inner addresses match (e.g. a single client's session)
+    PacketCapture(const std::string& name, size_t fileSize, int files, unsigned sample,
+                  const std::vector<IpAddress>& hosts);
+    ~PacketCapture();
+
+    // Creates the first file of the ring
+    bool open();
+
+    // Records a packet if it passes the filters. outbound: read from the TUN device
+    // (sent by the host); otherwise it is about to be written to it.
+    void record(const char* packet, size_t len, bool outbound);
+
+    // Parses a comma separated list of IPv4/IPv6 addresses
+    static bool parseHosts(const std::string& list, std::vector<IpAddress>& hosts);
+
+private:
+    bool matches(const char* packet, size_t len) const;
+    bool openFile();
+    // Unmaps the current file and trims it to the blocks written
+    void closeFile();
+    void append(const void* data, size_t len);
+
+    std::string name_;               // File names are <name>.<index>
+    size_t fileSize_;                // Bytes mapped per file
+    int files_;                      // Files in the ring
+    unsigned sample_;                // Keep one in this many matching packets
+    unsigned skipped_;               // Matching packets since the last kept one
+    std::vector<IpAddress> hosts_;   // Empty: every packet matches
+
+    int fd_;                         // Current file
+    int index_;                      // Its position in the ring
+    char* map_;                      // Its mapping; nullptr once capturing failed
+    size_t used_;                    // Bytes written to it
+};
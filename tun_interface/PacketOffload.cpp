@@ -0,0 +1,159 @@
+#include "PacketOffload.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// One's complement sum of a byte range, continuing from `sum`
+static uint32_t checksumAdd(const unsigned char *data, size_t len, uint32_t sum)
+{
+    while (len > 1)
+    {
+        sum += (data[0] << 8) | data[1];
+        data += 2;
+        len -= 2;
+    }
+    if (len)
+        sum += data[0] << 8;
+    return sum;
+}
+
+static uint16_t checksumFold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum & 0xffff);
+}
+
+bool PacketOffload::needsOffload(const struct virtio_net_hdr &vnet)
+{
+    return vnet.gso_type != VIRTIO_NET_HDR_GSO_NONE || (vnet.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM);
+}
+
+bool PacketOffload::resolve(char *packet, size_t len, const struct virtio_net_hdr &vnet, const PacketSink &emit)
+{
+    uint8_t type = vnet.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    if (type == VIRTIO_NET_HDR_GSO_TCPV4 || type == VIRTIO_NET_HDR_GSO_TCPV6)
+        return segmentTcp(packet, len, vnet, emit);
+    if (type != VIRTIO_NET_HDR_GSO_NONE)
+        return false;  // UDP fragmentation offload is never enabled on the device
+
+    if ((vnet.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && !finishChecksum(packet, len, vnet))
+        return false;
+    return emit(packet, len);
+}
+
+bool PacketOffload::finishChecksum(char *packet, size_t len, const struct virtio_net_hdr &vnet)
+{
+    // The kernel already stored the pseudo-header sum in the checksum field,
+    // so summing from csum_start to the end yields the final value
+    size_t start = vnet.csum_start;
+    size_t field = start + vnet.csum_offset;
+    if (field + 2 > len)
+        return false;
+
+    unsigned char *p = reinterpret_cast<unsigned char *>(packet);
+    uint16_t csum = checksumFold(checksumAdd(p + start, len - start, 0));
+    memcpy(p + field, &csum, sizeof(csum));
+    return true;
+}
+
+bool PacketOffload::segmentTcp(const char *packet, size_t len, const struct virtio_net_hdr &vnet, const PacketSink &emit)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(packet);
+    if (len < 20)
+        return false;
+
+    bool v4 = (p[0] >> 4) == 4;
+    size_t ipLen = v4 ? (p[0] & 0x0f) * 4 : 40;
+    // Extension headers are not expected on kernel-generated TCP superpackets
+    if (len < ipLen + 20 || p[v4 ? 9 : 6] != IPPROTO_TCP)
+        return false;
+
+    size_t tcpLen = (p[ipLen + 12] >> 4) * 4;
+    size_t headerLen = ipLen + tcpLen;
+    size_t mss = vnet.gso_size;
+    if (tcpLen < 20 || headerLen > len || mss == 0)
+        return false;
+
+    size_t payload = len - headerLen;
+    uint32_t seq;
+    memcpy(&seq, p + ipLen + 4, sizeof(seq));
+    seq = ntohl(seq);
+    uint16_t ipId = v4 ? (p[4] << 8) | p[5] : 0;
+    uint8_t flags = p[ipLen + 13];
+
+    vector<unsigned char> segment(headerLen + mss);
+    for (size_t offset = 0, index = 0; offset < payload; offset += mss, index++)
+    {
+        size_t chunk = min(mss, payload - offset);
+        bool last = offset + chunk == payload;
+        unsigned char *s = segment.data();
+        memcpy(s, p, headerLen);
+        memcpy(s + headerLen, p + headerLen + offset, chunk);
+        size_t segLen = headerLen + chunk;
+
+        // IP header: length, identification and (IPv4) header checksum
+        if (v4)
+        {
+            uint16_t totLen = htons(segLen);
+            uint16_t id = htons(ipId + index);
+            memcpy(s + 2, &totLen, 2);
+            memcpy(s + 4, &id, 2);
+            memset(s + 10, 0, 2);
+            uint16_t ipCsum = checksumFold(checksumAdd(s, ipLen, 0));
+            memcpy(s + 10, &ipCsum, 2);
+        }
+        else
+        {
+            uint16_t payloadLen = htons(segLen - 40);
+            memcpy(s + 4, &payloadLen, 2);
+        }
+
+        // TCP header: sequence number, flags that belong to the first/last segment only
+        unsigned char *tcp = s + ipLen;
+        uint32_t segSeq = htonl(seq + offset);
+        memcpy(tcp + 4, &segSeq, 4);
+        uint8_t segFlags = flags;
+        if (!last)
+            segFlags &= ~(0x01 | 0x08);  // FIN, PSH
+        if (index > 0)
+            segFlags &= ~0x80;           // CWR
+        tcp[13] = segFlags;
+
+        // TCP checksum over the pseudo header and the segment
+        memset(tcp + 16, 0, 2);
+        size_t l4Len = segLen - ipLen;
+        uint32_t sum = v4 ? checksumAdd(s + 12, 8, 0) : checksumAdd(s + 8, 32, 0);
+        sum += IPPROTO_TCP + l4Len;
+        uint16_t tcpCsum = checksumFold(checksumAdd(tcp, l4Len, sum));
+        memcpy(tcp + 16, &tcpCsum, 2);
+
+        if (!emit(reinterpret_cast<const char *>(s), segLen))
+            return false;
+    }
+    return true;
+}
+
+void PacketOffload::encodeHeader(const struct virtio_net_hdr &vnet, GsoFrameHeader &out)
+{
+    out.marker = GSO_FRAME_MARKER | (vnet.flags & 0x0f);
+    out.gsoType = vnet.gso_type;
+    out.hdrLen = htons(vnet.hdr_len);
+    out.gsoSize = htons(vnet.gso_size);
+    out.csumStart = htons(vnet.csum_start);
+    out.csumOffset = htons(vnet.csum_offset);
+}
+
+void PacketOffload::decodeHeader(const GsoFrameHeader &in, struct virtio_net_hdr &vnet)
+{
+    vnet.flags = in.marker & 0x0f;
+    vnet.gso_type = in.gsoType;
+    vnet.hdr_len = ntohs(in.hdrLen);
+    vnet.gso_size = ntohs(in.gsoSize);
+    vnet.csum_start = ntohs(in.csumStart);
+    vnet.csum_offset = ntohs(in.csumOffset);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "../tunneling/Frame.hpp"
+#include "TunDevice.hpp"
+#include <functional>
+#include <cstddef>
+
+// Helpers for packets read from / written to a TUN device in IFF_VNET_HDR mode,
+// where the kernel leaves segmentation (GSO) and checksums to the consumer
+class PacketOffload {
+public:
+    // Receives each finished packet; returning false stops the iteration
+    using PacketSink = std::function<bool(const char* packet, size_t len)>;
+
+    // True if the virtio-net header asks for segmentation or a checksum
+    static bool needsOffload(const struct virtio_net_hdr& vnet);
+
+    // Does in software what the virtio-net header asks for: splits a TCP superpacket
+    // into gso_size segments and/or completes a partial checksum, emitting plain packets.
+    // May modify the packet in place. Returns false for packets it cannot handle.
+    static bool resolve(char* packet, size_t len, const struct virtio_net_hdr& vnet, const PacketSink& emit);
+
+    // Converts between the kernel's virtio-net header and the tunnel's wire header
+    static void encodeHeader(const struct virtio_net_hdr& vnet, GsoFrameHeader& out);
+    static void decodeHeader(const GsoFrameHeader& in, struct virtio_net_hdr& vnet);
+
+private:
+    // Completes the checksum at csum_start + csum_offset in place
+    static bool finishChecksum(char* packet, size_t len, const struct virtio_net_hdr& vnet);
+
+    // Splits a TCPv4/TCPv6 superpacket into segments with valid checksums
+    static bool segmentTcp(const char* packet, size_t len, const struct virtio_net_hdr& vnet, const PacketSink& emit);
+};
@@ -0,0 +1,100 @@
+#include "PacketPool.hpp"
+#include <stdlib.h>
+#include <new>
+
+using namespace std;
+
+PacketHandle PacketCache::get() {
+    if (!local_) {
+        // Take over everything other threads have released in one exchange
+        local_ = returned_.exchange(nullptr, memory_order_acquire);
+        int64_t reclaimed = 0;
+        for (PacketBuffer* b = local_; b; b = b->next)
+            reclaimed++;
+        inUse_.add(-reclaimed);
+        if (!local_)
+            local_ = pool_.grow(this);
+    }
+
+    PacketBuffer* buffer = local_;
+    local_ = buffer->next;
+    buffer->refs.store(1, memory_order_relaxed);
+    buffer->length = 0;
+
+    inUse_.add(1);
+    if (inUse_.get() > highWater_.get())
+        highWater_.set(inUse_.get());
+    return PacketHandle(buffer);
+}
+
+size_t PacketCache::bufferSize() const {
+    return pool_.bufferSize();
+}
+
+void PacketCache::release(PacketBuffer* buffer) {
+    // Treiber push; the owner only ever detaches the whole stack, so there is no ABA
+    PacketBuffer* head = returned_.load(memory_order_relaxed);
+    do {
+        buffer->next = head;
+    } while (!returned_.compare_exchange_weak(head, buffer, memory_order_release, memory_order_relaxed));
+}
+
+PacketPool::PacketPool(size_t bufferSize)
+    : bufferSize_(bufferSize),
+      stride_(sizeof(PacketBuffer) + (bufferSize + alignof(PacketBuffer) - 1) / alignof(PacketBuffer) * alignof(PacketBuffer)) {
+    Metrics::addPool(this);
+}
+
+PacketPool::~PacketPool() {
+    Metrics::removePool(this);
+    for (void* slab : slabs_)
+        free(slab);
+}
+
+PacketCache* PacketPool::cache() {
+    lock_guard<mutex> guard(lock_);
+    caches_.emplace_back(new PacketCache(*this));
+    return caches_.back().get();
+}
+
+PacketBuffer* PacketPool::grow(PacketCache* cache) {
+    char* slab = static_cast<char*>(aligned_alloc(alignof(PacketBuffer), stride_ * SLAB_BUFFERS));
+    if (!slab)
+        throw bad_alloc();
+
+    uint32_t index;
+    {
+        lock_guard<mutex> guard(lock_);
+        index = slabs_.size();
+        slabs_.push_back(slab);
+        buffers_.add(SLAB_BUFFERS);
+    }
+
+    PacketBuffer* head = nullptr;
+    for (size_t i = SLAB_BUFFERS; i-- > 0;) {
+        PacketBuffer* buffer = new (slab + i * stride_) PacketBuffer;
+        buffer->home = cache;
+        buffer->refs.store(0, memory_order_relaxed);
+        buffer->length = 0;
+        buffer->slab = index;
+        buffer->next = head;
+        head = buffer;
+    }
+    return head;
+}
+
+void* PacketPool::slab(uint32_t index, size_t& bytes) const {
+    lock_guard<mutex> guard(lock_);
+    bytes = stride_ * SLAB_BUFFERS;
+    return index < slabs_.size() ? slabs_[index] : nullptr;
+}
+
+PacketPool::Stats PacketPool::stats() const {
+    lock_guard<mutex> guard(lock_);
+    Stats stats = {buffers_.get(), 0, 0};
+    for (const auto& cache : caches_) {
+        stats.inUse += cache->inUse_.get();
+        stats.highWater += cache->highWater_.get();
+    }
+    return stats;
+}
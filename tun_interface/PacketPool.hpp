@@ -0,0 +1,148 @@
+#pragma once
+#include "Metrics.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class PacketCache;
+class PacketPool;
+
+// Header in front of every pooled buffer; the payload starts on the next cache line
+struct alignas(64) PacketBuffer {
+    PacketCache* home;           // Cache the buffer returns to when the last handle drops
+    std::atomic<uint32_t> refs;  // Handles pointing at the buffer
+    uint32_t length;             // Bytes of packet data in the payload
+    uint32_t slab;               // Index of the slab the buffer was carved out of
+    PacketBuffer* next;          // Free list link
+
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+};
+
+// Reference-counted pointer to a pooled buffer. Handles move between stages (and
+// threads) without copying the packet; the buffer is recycled when the last one drops.
+class PacketHandle {
+public:
+    PacketHandle() : buffer_(nullptr) {}
+    explicit PacketHandle(PacketBuffer* buffer) : buffer_(buffer) {}
+    PacketHandle(const PacketHandle& other) : buffer_(other.buffer_) { retain(); }
+    PacketHandle(PacketHandle&& other) noexcept : buffer_(other.buffer_) { other.buffer_ = nullptr; }
+    ~PacketHandle() { reset(); }
+
+    PacketHandle& operator=(PacketHandle other) noexcept {
+        std::swap(buffer_, other.buffer_);
+        return *this;
+    }
+
+    explicit operator bool() const { return buffer_ != nullptr; }
+
+    char* data() const { return buffer_->data(); }
+    size_t length() const { return buffer_->length; }
+    // Payload bytes the buffer holds room for, whatever the packet's length
+    inline size_t capacity() const;
+    void setLength(size_t length) { buffer_->length = length; }
+    // See PacketPool::slab()
+    uint32_t slab() const { return buffer_->slab; }
+    // Whether this is the only handle, i.e. the buffer may be overwritten
+    bool unique() const { return buffer_->refs.load(std::memory_order_acquire) == 1; }
+
+    // Drops this handle's reference
+    inline void reset();
+
+private:
+    void retain() {
+        if (buffer_)
+            buffer_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    PacketBuffer* buffer_;
+};
+
+// One thread's free list. get() is for the owning thread only; buffers released by
+// any thread come back through a lock-free stack the owner takes over in one exchange.
+class PacketCache {
+public:
+    // Returns an empty buffer of the pool's size, growing the pool when none is free
+    PacketHandle get();
+
+    // The pool's buffer size, in bytes of payload
+    size_t bufferSize() const;
+
+    PacketPool& pool() const { return pool_; }
+
+private:
+    friend class PacketPool;
+    friend class PacketHandle;
+
+    explicit PacketCache(PacketPool& pool) : pool_(pool) {}
+
+    // Called by whichever thread drops the last handle
+    void release(PacketBuffer* buffer);
+
+    PacketPool& pool_;
+    PacketBuffer* local_ = nullptr;  // Owner-only free list
+    // Released buffers not yet reclaimed, on their own cache line as other threads write it
+    alignas(64) std::atomic<PacketBuffer*> returned_{nullptr};
+
+    // Owner-written statistics
+    alignas(64) Gauge inUse_;  // Handed out and not yet reclaimed
+    Gauge highWater_;          // Peak of inUse_
+};
+
+// Slab allocator of equally sized, cache-line aligned packet buffers. Memory is taken
+// in slabs and never returned before the pool is destroyed, so after warm-up the
+// packet path does no heap allocation. Every thread gets its own PacketCache.
+// Handles must all be dropped before the pool is destroyed.
+class PacketPool {
+public:
+    // Buffers carved out of one slab
+    static constexpr size_t SLAB_BUFFERS = 64;
+
+    explicit PacketPool(size_t bufferSize);
+    ~PacketPool();
+
+    PacketPool(const PacketPool&) = delete;
+    PacketPool& operator=(const PacketPool&) = delete;
+
+    // Creates a free list for one thread; it lives as long as the pool
+    PacketCache* cache();
+
+    size_t bufferSize() const { return bufferSize_; }
+
+    // Memory of one slab, SLAB_BUFFERS buffers back to back, e.g. for registering it with
+    // the kernel as an I/O buffer; slabs are never moved or freed while the pool lives
+    void* slab(uint32_t index, size_t& bytes) const;
+
+    struct Stats {
+        uint64_t buffers;    // Buffers allocated in total
+        uint64_t inUse;      // Buffers handed out and not yet reclaimed
+        uint64_t highWater;  // Sum of every cache's peak in-use count
+    };
+    Stats stats() const;
+
+private:
+    friend class PacketCache;
+
+    // Allocates a slab and links its buffers into a free list for cache
+    PacketBuffer* grow(PacketCache* cache);
+
+    size_t bufferSize_;  // Payload bytes per buffer
+    size_t stride_;      // Header plus payload, rounded up to a cache line
+
+    mutable std::mutex lock_;                           // Guards slabs_ and caches_
+    std::vector<void*> slabs_;
+    std::vector<std::unique_ptr<PacketCache>> caches_;
+    Counter buffers_;                                   // Written under lock_
+};
+
+size_t PacketHandle::capacity() const {
+    return buffer_->home->bufferSize();
+}
+
+void PacketHandle::reset() {
+    if (buffer_ && buffer_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        buffer_->home->release(buffer_);
+    buffer_ = nullptr;
+}
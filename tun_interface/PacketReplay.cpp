@@ -0,0 +1,129 @@
+#include "PacketReplay.hpp"
+#include "PacketCapture.hpp"
+#include "Logger.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+// Link types that carry bare IP packets: raw, raw IPv4, raw IPv6
+static bool rawLinkType(uint16_t linkType)
+{
+    return linkType == PacketCapture::LINKTYPE_RAW || linkType == 228 || linkType == 229;
+}
+
+static uint32_t load32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+PacketReplay::PacketReplay() : map_(nullptr), size_(0), start_(0), offset_(0)
+{
+}
+
+PacketReplay::~PacketReplay()
+{
+    close();
+}
+
+void PacketReplay::close()
+{
+    if (map_)
+        munmap((void *)map_, size_);
+    map_ = nullptr;
+    size_ = start_ = offset_ = 0;
+}
+
+bool PacketReplay::open(const string &path)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(("Failed to open " + path).c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 28)
+    {
+        cerr << path << " is not a pcapng file" << endl;
+        ::close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror(("Failed to map " + path).c_str());
+        return false;
+    }
+    map_ = (const char *)map;
+    size_ = st.st_size;
+    // The file is read front to back exactly once per pass
+    madvise(map, size_, MADV_SEQUENTIAL);
+
+    if (load32(map_) != PacketCapture::SECTION_HEADER)
+    {
+        cerr << path << " is not a pcapng file" << endl;
+        close();
+        return false;
+    }
+    if (load32(map_ + 8) != PacketCapture::BYTE_ORDER_MAGIC)
+    {
+        cerr << path << " was written with the other byte order" << endl;
+        close();
+        return false;
+    }
+    start_ = offset_ = load32(map_ + 4);
+    return true;
+}
+
+bool PacketReplay::next(const char *&packet, size_t &len)
+{
+    while (offset_ + 12 <= size_)
+    {
+        const char *block = map_ + offset_;
+        uint32_t type = load32(block);
+        uint32_t total = load32(block + 4);
+        // A zero length is the unwritten tail of a capture file still being recorded
+        if (total < 12 || total % 4 != 0 || offset_ + total > size_)
+            return false;
+        offset_ += total;
+
+        if (type == PacketCapture::ENHANCED_PACKET && total >= 32)
+        {
+            uint32_t captured = load32(block + 20);
+            if (captured > total - 32)
+                return false;
+            packet = block + 28;
+            len = captured;
+            return true;
+        }
+        if (type == PacketCapture::SIMPLE_PACKET && total >= 16)
+        {
+            packet = block + 12;
+            len = min<size_t>(load32(block + 8), total - 16);
+            return true;
+        }
+        if (type == PacketCapture::INTERFACE_DESCRIPTION && total >= 20)
+        {
+            uint16_t linkType;
+            memcpy(&linkType, block + 8, sizeof(linkType));
+            if (!rawLinkType(linkType))
+            {
+                LOG_ERROR("Capture interface has link type %u, only raw IP packets can be replayed", linkType);
+                offset_ = size_;
+                return false;
+            }
+        }
+        // Other blocks (statistics, a following section header) carry no packets
+    }
+    return false;
+}
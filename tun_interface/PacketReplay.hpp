@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Reads the packets of a pcapng file of raw IP packets, such as one written by
+// PacketCapture. The file is memory-mapped, so replaying it costs no copies or reads.
+class PacketReplay {
+public:
+    PacketReplay();
+    ~PacketReplay();
+
+    // Maps the file and checks that it holds raw IP packets in this host's byte order
+    bool open(const std::string& path);
+
+    // Points at the next packet; false once the file is exhausted
+    bool next(const char*& packet, size_t& len);
+
+    // Starts over at the first packet
+    void rewind() { offset_ = start_; }
+
+private:
+    void close();
+
+    const char* map_;  // The whole file
+    size_t size_;      // Its length
+    size_t start_;     // Offset of the block after the section header
+    size_t offset_;    // Offset of the next block
+};
@@ -0,0 +1,176 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// 128-bit inner address; IPv4 is stored IPv4-mapped (::ffff:a.b.c.d) so both families share one table
+struct IpAddress {
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+
+    bool operator==(const IpAddress& other) const { return hi == other.hi && lo == other.lo; }
+    bool operator!=(const IpAddress& other) const { return !(*this == other); }
+
+    // Builds a key from an IPv4 address in network byte order
+    static IpAddress fromV4(uint32_t addr) {
+        IpAddress ip;
+        ip.lo = 0x0000ffff00000000ULL | __builtin_bswap32(addr);
+        return ip;
+    }
+
+    // Builds a key from a 16-byte IPv6 address in network byte order
+    static IpAddress fromV6(const unsigned char* addr) {
+        IpAddress ip;
+        ip.hi = __builtin_bswap64(load64(addr));
+        ip.lo = __builtin_bswap64(load64(addr + 8));
+        return ip;
+    }
+
+    // Extracts the destination address of a raw IP packet; false if it is not IPv4/IPv6
+    static bool destinationOf(const char* packet, size_t len, IpAddress& out) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(packet);
+        if (len >= 20 && (p[0] >> 4) == 4) {
+            uint32_t dst;
+            memcpy(&dst, p + 16, sizeof(dst));
+            out = fromV4(dst);
+            return true;
+        }
+        if (len >= 40 && (p[0] >> 4) == 6) {
+            out = fromV6(p + 24);
+            return true;
+        }
+        return false;
+    }
+
+    // Extracts the source address of a raw IP packet; false if it is not IPv4/IPv6
+    static bool sourceOf(const char* packet, size_t len, IpAddress& out) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(packet);
+        if (len >= 20 && (p[0] >> 4) == 4) {
+            uint32_t src;
+            memcpy(&src, p + 12, sizeof(src));
+            out = fromV4(src);
+            return true;
+        }
+        if (len >= 40 && (p[0] >> 4) == 6) {
+            out = fromV6(p + 8);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    static uint64_t load64(const unsigned char* p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+};
+
+// Exact-match table from inner host address to a value (the owning session on the server).
+// Open addressing with linear probing in one flat array: a hit costs one hash and,
+// at the enforced load factor of 1/2, usually a single cache line.
+template <typename Value>
+class RouteTable {
+public:
+    explicit RouteTable(size_t expectedEntries = 64) : size_(0) {
+        rehash(capacityFor(expectedEntries));
+    }
+
+    // Adds or replaces the value for an address
+    void insert(const IpAddress& addr, Value value) {
+        if ((size_ + 1) * 2 > slots_.size())
+            rehash(slots_.size() * 2);
+        size_t i = indexOf(addr);
+        while (slots_[i].used) {
+            if (slots_[i].key == addr) {
+                slots_[i].value = value;
+                return;
+            }
+            i = (i + 1) & mask_;
+        }
+        slots_[i].used = true;
+        slots_[i].key = addr;
+        slots_[i].value = value;
+        size_++;
+    }
+
+    // Returns a pointer to the stored value, or nullptr when the address is unknown
+    Value* find(const IpAddress& addr) {
+        size_t i = indexOf(addr);
+        while (slots_[i].used) {
+            if (slots_[i].key == addr)
+                return &slots_[i].value;
+            i = (i + 1) & mask_;
+        }
+        return nullptr;
+    }
+
+    // Removes an address; returns false if it was not present
+    bool erase(const IpAddress& addr) {
+        size_t i = indexOf(addr);
+        while (slots_[i].used && slots_[i].key != addr)
+            i = (i + 1) & mask_;
+        if (!slots_[i].used)
+            return false;
+
+        // Backward-shift deletion keeps probe chains intact without tombstones
+        size_t hole = i;
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask_;
+            if (!slots_[j].used)
+                break;
+            size_t home = indexOf(slots_[j].key);
+            // Move the entry into the hole unless its home slot lies cyclically in (hole, j]
+            bool stays = (hole <= j) ? (hole < home && home <= j) : (hole < home || home <= j);
+            if (!stays) {
+                slots_[hole] = slots_[j];
+                hole = j;
+            }
+        }
+        slots_[hole].used = false;
+        size_--;
+        return true;
+    }
+
+    size_t size() const { return size_; }
+
+private:
+    struct Slot {
+        IpAddress key;
+        Value value{};
+        bool used = false;
+    };
+
+    static size_t capacityFor(size_t entries) {
+        size_t capacity = 16;
+        while (capacity < entries * 2)
+            capacity <<= 1;
+        return capacity;
+    }
+
+    size_t indexOf(const IpAddress& addr) const {
+        // 64-bit finalizer from MurmurHash3 spreads the low address bits over the table
+        uint64_t h = addr.lo ^ (addr.hi * 0x9e3779b97f4a7c15ULL);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h & mask_;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> old;
+        old.swap(slots_);
+        slots_.assign(capacity, Slot());
+        mask_ = capacity - 1;
+        size_ = 0;
+        for (const Slot& slot : old) {
+            if (slot.used)
+                insert(slot.key, slot.value);
+        }
+    }
+
+    std::vector<Slot> slots_;    // Power-of-two sized slot array
+    size_t mask_;                // slots_.size() - 1
+    size_t size_;                // Number of used slots
+};
@@ -0,0 +1,122 @@
+#include "TimerWheel.hpp"
+#include <algorithm>
+
+using namespace std;
+
+void TimerWheel::Timer::cancel() {
+    if (wheel_)
+        wheel_->unlink(*this);
+}
+
+TimerWheel::TimerWheel(Clock::duration tick, Clock::time_point start)
+    : tick_(tick), start_(start), current_(0), armed_(0) {
+    for (auto& level : slots_) {
+        for (Timer& head : level)
+            initList(head);
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    // Timers that outlive the wheel must not reach back into it
+    for (auto& level : slots_) {
+        for (Timer& head : level) {
+            while (head.next_ != &head)
+                unlink(*head.next_);
+        }
+    }
+}
+
+void TimerWheel::schedule(Timer& timer, Clock::time_point when) {
+    timer.cancel();
+    // Rounded up, so a timer never fires early
+    uint64_t expires = 0;
+    if (when > start_)
+        expires = (when - start_ + tick_ - Clock::duration(1)) / tick_;
+    // Already due: fires on the next advance()
+    timer.expires_ = max(expires, current_);
+    timer.wheel_ = this;
+    armed_++;
+    insert(timer);
+}
+
+int TimerWheel::timeout(Clock::time_point now) const {
+    if (armed_ == 0)
+        return -1;
+    // The next tick with timers in the first wheel; failing that, its next turn, when a
+    // coarser slot moves down. Slots behind the current one only hold timers for that turn
+    uint64_t next = current_;
+    while ((next & (SLOTS - 1)) != 0 && slots_[0][next & (SLOTS - 1)].next_ == &slots_[0][next & (SLOTS - 1)])
+        next++;
+    auto wait = start_ + tick_ * static_cast<Clock::rep>(next) - now;
+    if (wait <= Clock::duration::zero())
+        return 0;
+    return (wait + chrono::milliseconds(1) - Clock::duration(1)) / chrono::milliseconds(1);
+}
+
+uint64_t TimerWheel::ticks(Clock::time_point time) const {
+    return time > start_ ? (time - start_) / tick_ : 0;
+}
+
+void TimerWheel::insert(Timer& timer) {
+    uint64_t delta = timer.expires_ - current_;
+    if (delta > MAX_TICKS) {
+        delta = MAX_TICKS;
+        timer.expires_ = current_ + MAX_TICKS;
+    }
+    // The level whose slots are the smallest that still reach the expiry
+    unsigned level = 0;
+    while (level + 1 < LEVELS && delta >= (1ull << (SLOT_BITS * (level + 1))))
+        level++;
+    Timer& head = slots_[level][(timer.expires_ >> (SLOT_BITS * level)) & (SLOTS - 1)];
+    timer.prev_ = head.prev_;
+    timer.next_ = &head;
+    head.prev_->next_ = &timer;
+    head.prev_ = &timer;
+}
+
+void TimerWheel::unlink(Timer& timer) {
+    timer.prev_->next_ = timer.next_;
+    timer.next_->prev_ = timer.prev_;
+    timer.prev_ = timer.next_ = nullptr;
+    timer.wheel_ = nullptr;
+    armed_--;
+}
+
+void TimerWheel::collect(Timer& due) {
+    unsigned index = current_ & (SLOTS - 1);
+    // The first wheel starts a new turn: the next slot of each coarser wheel whose own
+    // turn it finishes comes down, its timers now close enough for a finer slot
+    if (index == 0) {
+        for (unsigned level = 1; level < LEVELS; level++) {
+            unsigned slot = (current_ >> (SLOT_BITS * level)) & (SLOTS - 1);
+            cascade(level, slot);
+            if (slot != 0)
+                break;
+        }
+    }
+    current_++;
+
+    take(slots_[0][index], due);
+}
+
+void TimerWheel::cascade(unsigned level, unsigned slot) {
+    Timer moving;
+    take(slots_[level][slot], moving);
+    while (moving.next_ != &moving) {
+        Timer& timer = *moving.next_;
+        moving.next_ = timer.next_;
+        timer.next_->prev_ = &moving;
+        insert(timer);
+    }
+}
+
+void TimerWheel::take(Timer& from, Timer& to) {
+    initList(to);
+    if (from.next_ == &from)
+        return;
+    to.next_ = from.next_;
+    to.prev_ = from.prev_;
+    to.next_->prev_ = &to;
+    to.prev_->next_ = &to;
+    initList(from);
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Hierarchical timing wheel (Varghese & Lauck, as in the Linux kernel's classic timer code):
+// LEVELS wheels of SLOTS lists each, the first holding timers due within SLOTS ticks, each
+// next one ranges SLOTS times as long. Arming and cancelling a timer are O(1) list
+// operations, and a tick only touches the timers that are due, plus, once per SLOTS ticks,
+// the timers of one slot of a coarser wheel, which move down a level. That keeps 100k+
+// session timers cheap where a heap would pay O(log n) on every re-arm. Timers are
+// intrusive, so the wheel never allocates. Only the owning thread uses it.
+class TimerWheel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr unsigned SLOT_BITS = 6;
+    static constexpr unsigned SLOTS = 1u << SLOT_BITS;
+    static constexpr unsigned LEVELS = 4;
+    // Furthest a timer can be set, in ticks; later ones fire then
+    static constexpr uint64_t MAX_TICKS = (1ull << (SLOT_BITS * LEVELS)) - 1;
+
+    // Embedded in whatever it times. Destroying an armed timer cancels it
+    class Timer {
+    public:
+        // The caller's value identifying the timer when it fires, like epoll_event's data
+        uint64_t data = 0;
+
+        Timer() = default;
+        ~Timer() { cancel(); }
+
+        // Disarms the timer if it is armed
+        void cancel();
+        bool armed() const { return wheel_ != nullptr; }
+
+    private:
+        friend class TimerWheel;
+        Timer* prev_ = nullptr;
+        Timer* next_ = nullptr;
+        uint64_t expires_ = 0;          // Tick it fires at
+        TimerWheel* wheel_ = nullptr;   // Wheel it is armed on
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+    };
+
+    // Ticks of `tick` length, counted from `start`
+    explicit TimerWheel(Clock::duration tick, Clock::time_point start = Clock::now());
+    ~TimerWheel();
+
+    // Arms (or re-arms) a timer to fire at the first tick at or after `when`
+    void schedule(Timer& timer, Clock::time_point when);
+
+    // Fires every timer due by `now`, calling f(Timer&) for each once it is disarmed. f may
+    // arm, cancel or destroy any timer, the fired one included
+    template <typename F>
+    void advance(Clock::time_point now, F f) {
+        uint64_t target = ticks(now);
+        if (armed_ == 0) {
+            // Nothing to fire or move down: skip the idle ticks
+            if (target >= current_)
+                current_ = target + 1;
+            return;
+        }
+        while (current_ <= target) {
+            Timer due;
+            collect(due);
+            while (due.next_ != &due) {
+                Timer* timer = due.next_;
+                unlink(*timer);
+                f(*timer);
+            }
+        }
+    }
+
+    // Milliseconds until advance() has something to do (rounded up), -1 if no timer is
+    // armed: a ready-made epoll_wait()/select() timeout
+    int timeout(Clock::time_point now) const;
+
+    size_t armed() const { return armed_; }
+
+private:
+    uint64_t ticks(Clock::time_point time) const;
+    // Puts an armed timer in the slot its expiry falls into
+    void insert(Timer& timer);
+    void unlink(Timer& timer);
+    // Moves the timers due at current_ onto `due` and steps to the next tick, first
+    // refiling the coarser slot whose range starts there
+    void collect(Timer& due);
+    void cascade(unsigned level, unsigned slot);
+    // Moves the whole list at `from` to the empty head `to`
+    static void take(Timer& from, Timer& to);
+    static void initList(Timer& head) { head.prev_ = head.next_ = &head; }
+
+    Clock::duration tick_;
+    Clock::time_point start_;
+    uint64_t current_;    // Next tick to process
+    size_t armed_;
+    Timer slots_[LEVELS][SLOTS];  // List heads
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+};
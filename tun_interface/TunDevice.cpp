@@ -1,9 +1,12 @@
 #include "TunDevice.hpp"
 #include "Logger.hpp"
+#include "PacketCapture.hpp"
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/if_tun.h>
 #include <net/if.h>
 #include <iostream>
@@ -11,42 +14,144 @@
 
 using namespace std;
 
-TunDevice::TunDevice(const string &name, bool isServer)
-    : name_(name), isServer_(isServer), fd_(-1)
+bool TunDevice::memoryQueues = false;
+
+TunDevice::TunDevice(const string &name, bool isServer, int queues, bool offload)
+    : name_(name), isServer_(isServer), queues_(max(queues, 1)), offload_(offload), memory_(memoryQueues), index_(0)
+{
+}
+
+void TunDevice::setMemoryQueues(bool enable)
 {
+    memoryQueues = enable;
 }
 
 TunDevice::~TunDevice()
 {
-    if (fd_ >= 0)
-        close(fd_);
+    cleanupRouting();
+    closeQueues();
 }
 
-bool TunDevice::initialize()
+void TunDevice::closeQueues()
 {
-    // Open TUN device with read/write permissions
-    if ((fd_ = open("/dev/net/tun", O_RDWR)) < 0)
+    for (int fd : fds_)
+        close(fd);
+    for (int fd : peers_)
+        close(fd);
+    fds_.clear();
+    peers_.clear();
+}
+
+bool TunDevice::enableCapture(const string &path, size_t fileSize, int files, unsigned sample, const string &hosts)
+{
+    vector<IpAddress> filter;
+    if (!PacketCapture::parseHosts(hosts, filter))
     {
-        perror("Failed to open /dev/net/tun");
+        cerr << "Invalid capture host list: " << hosts << endl;
         return false;
     }
+    captures_.clear();
+    for (int q = 0; q < queues_; q++)
+    {
+        string name = queues_ > 1 ? path + "-q" + to_string(q) : path;
+        captures_.push_back(make_unique<PacketCapture>(name, fileSize, files, sample, filter));
+        if (!captures_.back()->open())
+        {
+            captures_.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+string TunDevice::getAddress() const
+{
+    lock_guard<mutex> guard(addressLock_);
+    return address_;
+}
+
+bool TunDevice::initialize()
+{
+    if (memory_)
+    {
+        // SOCK_SEQPACKET keeps packet boundaries like a TUN queue, and closing the
+        // peer ends the queue like deleting the interface
+        for (int q = 0; q < queues_; q++)
+        {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0)
+            {
+                perror("socketpair()");
+                closeQueues();
+                return false;
+            }
+            fds_.push_back(pair[0]);
+            peers_.push_back(pair[1]);
+        }
+        return true;
+    }
 
-    // Create and initialize interface request structure
-    struct ifreq ifr;
-    memset(&ifr, 0, sizeof(ifr));
+    for (int q = 0; q < queues_; q++)
+    {
+        // Open TUN device with read/write permissions
+        int fd = open("/dev/net/tun", O_RDWR);
+        if (fd < 0)
+        {
+            perror("Failed to open /dev/net/tun");
+            closeQueues();
+            return false;
+        }
 
-    // Set flags for TUN device (IFF_TUN: TUN device, IFF_NO_PI: No packet info)
-    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+        // Create and initialize interface request structure
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
 
-    // Copy interface name to the request structure
-    strncpy(ifr.ifr_name, name_.c_str(), IFNAMSIZ);
+        // Set flags for TUN device (IFF_TUN: TUN device, IFF_NO_PI: No packet info)
+        // IFF_MULTI_QUEUE attaches every open with the same name as another queue
+        ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+        if (queues_ > 1)
+            ifr.ifr_flags |= IFF_MULTI_QUEUE;
+        // IFF_VNET_HDR prefixes every packet with a struct virtio_net_hdr
+        if (offload_)
+            ifr.ifr_flags |= IFF_VNET_HDR;
 
-    // Configure TUN device using ioctl system call
-    if (ioctl(fd_, TUNSETIFF, (void *)&ifr) < 0)
+        // Copy interface name to the request structure
+        strncpy(ifr.ifr_name, name_.c_str(), IFNAMSIZ);
+
+        // Configure TUN device using ioctl system call
+        if (ioctl(fd, TUNSETIFF, (void *)&ifr) < 0)
+        {
+            perror("ioctl(TUNSETIFF)");
+            close(fd);
+            closeQueues();
+            return false;
+        }
+        fds_.push_back(fd);
+
+        if (offload_)
+        {
+            // Let the kernel hand us TCP superpackets and partial checksums
+            int hdrSize = sizeof(struct virtio_net_hdr);
+            unsigned long offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+            if (ioctl(fd, TUNSETVNETHDRSZ, &hdrSize) < 0 || ioctl(fd, TUNSETOFFLOAD, offloads) < 0)
+            {
+                perror("ioctl(TUNSETOFFLOAD)");
+                closeQueues();
+                return false;
+            }
+        }
+    }
+
+    index_ = if_nametoindex(name_.c_str());
+    if (index_ == 0)
+    {
+        perror("if_nametoindex()");
+        closeQueues();
+        return false;
+    }
+    if (!netlink_.open())
     {
-        perror("ioctl(TUNSETIFF)");
-        close(fd_);
-        fd_ = -1;
+        closeQueues();
         return false;
     }
 
@@ -60,91 +165,184 @@ bool TunDevice::configureInterface(const string &ip)
     // Define network ranges for server and client
     string serverNet = "10.0.0.0/24"; // Server network range
     string clientNet = "10.0.1.0/24"; // Client network range
-    string ipAddress;
-    string routeNet;
+    // Route to the opposite network
+    string routeNet = isServer_ ? clientNet : serverNet;
 
-    if (isServer_)
+    // Address, link up, then the route, which needs the link up
+    lock_guard<mutex> guard(netlinkLock_);
+    if (!netlink_.addAddress(index_, ip))
     {
-        ipAddress = "10.0.0.1/24"; // Server IP
-        routeNet = clientNet;      // Route to client network
+        cerr << "Invalid interface address " << ip << endl;
+        return false;
     }
-    else
+    netlink_.setLinkUp(index_);
+    netlink_.addRoute(index_, routeNet);
+    if (!netlink_.commit())
     {
-        ipAddress = "10.0.1.2/24"; // Client IP
-        routeNet = serverNet;      // Route to server network
+        cerr << "Failed to configure " << name_ << endl;
+        return false;
     }
+    routes_.push_back(routeNet);
+    cout << "Configured " << name_ << ": address " << ip << ", up, route " << routeNet << endl;
+    return true;
+}
 
-    // Set IP address for the interface
-    string cmd = "ip addr add " + ipAddress + " dev " + name_;
-    cout << "Executing: " << cmd << endl;
-    if (system(cmd.c_str()) != 0)
+bool TunDevice::assignAddress(const string &cidr)
+{
     {
-        perror("Failed to set IP address");
-        return false;
+        lock_guard<mutex> guard(addressLock_);
+        // E.g. the same address again after a reconnect: flushing it would disturb its sockets
+        if (address_ == cidr)
+            return true;
+        address_ = cidr;
     }
+    if (memory_)
+        return true;
 
-    // Bring up the network interface
-    cmd = "ip link set dev " + name_ + " up";
-    cout << "Executing: " << cmd << endl;
-    if (system(cmd.c_str()) != 0)
+    // Drop the current address first so the interface ends up with exactly one.
+    // The flush also removes the routes to the interface, so they are put back
+    lock_guard<mutex> guard(netlinkLock_);
+    if (!netlink_.flushAddresses(index_))
     {
-        perror("Failed to bring up interface");
+        netlink_.clear();
         return false;
     }
-
-    // Add route to the opposite network
-    cmd = "ip route add " + routeNet + " dev " + name_;
-    cout << "Executing: " << cmd << endl;
-    if (system(cmd.c_str()) != 0)
+    if (!netlink_.addAddress(index_, cidr))
     {
-        perror("Failed to add route");
+        cerr << "Invalid interface address " << cidr << endl;
+        netlink_.clear();
         return false;
     }
+    for (const string &route : routes_)
+        netlink_.addRoute(index_, route);
+    return netlink_.commit();
+}
 
-    // Clean up any incorrect routes (silently ignore errors)
-    // if (isServer_) {
-    //     cmd = "ip route del " + serverNet + " dev " + name_ + " 2>/dev/null || true";
-    //     system(cmd.c_str());
-    // } else {
-    //     cmd = "ip route del " + clientNet + " dev " + name_ + " 2>/dev/null || true";
-    //     system(cmd.c_str());
-    // }
+bool TunDevice::setMtu(int mtu)
+{
+    if (memory_)
+        return true;
+    lock_guard<mutex> guard(netlinkLock_);
+    netlink_.setMtu(index_, mtu);
+    return netlink_.commit();
+}
 
+bool TunDevice::addRoute(const string &cidr)
+{
+    if (memory_)
+        return true;
+    lock_guard<mutex> guard(netlinkLock_);
+    if (!netlink_.addRoute(index_, cidr) || !netlink_.commit())
+        return false;
+    if (find(routes_.begin(), routes_.end(), cidr) == routes_.end())
+        routes_.push_back(cidr);
     return true;
 }
 
-ssize_t TunDevice::read(char *buffer, size_t len)
+bool TunDevice::removeRoute(const string &cidr)
 {
-    // Read data from TUN device into buffer
-    ssize_t n = ::read(fd_, buffer, len);
-    if (n > 0)
-    {
-        // Debug output: Show first 16 bytes of packet
-        printf("Packet: ");
-        for (int i = 0; i < min(n, (ssize_t)16); i++)
-        {
-            printf("%02x ", (unsigned char)buffer[i]);
-        }
-        printf("\n");
+    if (memory_)
+        return true;
+    lock_guard<mutex> guard(netlinkLock_);
+    routes_.erase(remove(routes_.begin(), routes_.end(), cidr), routes_.end());
+    return netlink_.deleteRoute(index_, cidr) && netlink_.commit();
+}
 
-        // Extract and display IP version from packet header
-        if (n >= 1)
+bool TunDevice::cleanupRouting()
+{
+    if (memory_ || index_ == 0)
+        return true;
+    // The routes that were added, then every address, in one batch
+    lock_guard<mutex> guard(netlinkLock_);
+    for (const string &route : routes_)
+        netlink_.deleteRoute(index_, route);
+    routes_.clear();
+    if (!netlink_.flushAddresses(index_))
+    {
+        netlink_.clear();
+        return false;
+    }
+    return netlink_.commit();
+}
+ssize_t TunDevice::read(char *buffer, size_t len, int queue, struct virtio_net_hdr *vnet)
+{
+    ssize_t n;
+    if (offload_)
+    {
+        // The virtio-net header and the packet arrive in one read
+        struct virtio_net_hdr hdr;
+        struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {buffer, len}};
+        n = ::readv(fds_[queue], iov, 2);
+        if (n >= 0 && n < (ssize_t)sizeof(hdr))
         {
-            unsigned char version = (buffer[0] >> 4) & 0xF;
-            printf("IP Version: %d\n", version);
+            errno = EINVAL;
+            return -1;
         }
+        if (n > 0)
+            n -= sizeof(hdr);
+        if (vnet)
+            *vnet = hdr;
+    }
+    else
+    {
+        // Read data from TUN device into buffer
+        n = ::read(fds_[queue], buffer, len);
+        if (vnet)
+            memset(vnet, 0, sizeof(*vnet));
     }
+    if (n > 0 && !captures_.empty())
+        captures_[queue]->record(buffer, n, true);
+    // Extract and display IP version from packet header (trace builds only)
+    if (n > 0)
+        LOG_TRACE_RATE(20, "TUN queue %d read %zd bytes, IP version %d", queue, n, (buffer[0] >> 4) & 0xF);
     return n;
 }
+void TunDevice::capture(int queue, const char *packet, size_t len, bool outbound)
+{
+    if (!captures_.empty())
+        captures_[queue]->record(packet, len, outbound);
+}
+
+bool TunDevice::setNonBlocking(bool enable)
+{
+    for (int fd : fds_)
+    {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags < 0)
+            return false;
+        flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+        if (fcntl(fd, F_SETFL, flags) != 0)
+            return false;
+    }
+    return true;
+}
+
 // Write data to the TUN device
-ssize_t TunDevice::write(const char *buffer, size_t len)
+ssize_t TunDevice::write(const char *buffer, size_t len, int queue, const struct virtio_net_hdr *vnet)
 {
+    if (!captures_.empty())
+        captures_[queue]->record(buffer, len, false);
+
+    if (offload_)
+    {
+        // Every write needs a header; a zeroed one means "nothing to offload"
+        struct virtio_net_hdr none;
+        memset(&none, 0, sizeof(none));
+        struct iovec iov[2] = {{(void *)(vnet ? vnet : &none), sizeof(none)}, {(void *)buffer, len}};
+        ssize_t n;
+        do
+        {
+            n = ::writev(fds_[queue], iov, 2);
+        } while (n < 0 && (errno == EINTR || errno == EAGAIN));
+        return n < 0 ? -1 : n - (ssize_t)sizeof(none);
+    }
+
     ssize_t total = 0;
     ssize_t n;
 
     while (total < len)
     {
-        n = ::write(fd_, buffer + total, len - total);
+        n = ::write(fds_[queue], buffer + total, len - total);
         if (n < 0)
         {
             // Continue if interrupted or would block
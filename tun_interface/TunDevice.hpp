@@ -1,31 +1,113 @@
 #pragma once  // Ensure header is only included once
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
+#include "Netlink.hpp"
+// linux/virtio_net.h names a struct field "class", which is a keyword in C++
+#define class class_
+#include <linux/virtio_net.h>
+#undef class
+
+class PacketCapture;
 
 // Class to manage a TUN network interface device
 class TunDevice {
 public:
     // Maximum buffer size for reading/writing network packets
     static constexpr size_t BUFFER_SIZE = 2000;
+    // Largest packet (a GSO superpacket) the device hands out in offload mode
+    static constexpr size_t MAX_PACKET_SIZE = 65535;
 
-    TunDevice(const std::string& name, bool isServer);
+    // queues > 1 creates an IFF_MULTI_QUEUE device with one file descriptor per queue;
+    // offload enables IFF_VNET_HDR with TCP segmentation and checksum offload
+    TunDevice(const std::string& name, bool isServer, int queues = 1, bool offload = false);
     
     ~TunDevice();
 
+    // Backs every device created afterwards with in-process socket pairs instead of
+    // /dev/net/tun, e.g. for benchmarks: nothing is configured on the host and no root
+    // is needed. Each queue's other end, getPeerFd(), sends and receives the packets.
+    static void setMemoryQueues(bool enable);
+
     bool initialize();
     
+    // Gives the interface its address, brings it up and routes the opposite network to it,
+    // in one batch of netlink requests
     bool configureInterface(const std::string& ip);
+
+    // Replaces the interface address, e.g. with the one assigned by the server
+    bool assignAddress(const std::string& cidr);
+
+    // Sets the interface MTU, e.g. to leave room for per-datagram tunnel overhead
+    bool setMtu(int mtu);
+
+    // Routes a network (CIDR) to the interface, or removes such a route again, e.g. as
+    // clients come and go; callable from any thread
+    bool addRoute(const std::string& cidr);
+    bool removeRoute(const std::string& cidr);
+
+    // Removes the routes and addresses put on the interface; done on destruction too
+    bool cleanupRouting();
     
-    // Reads network packets from the TUN device
-    ssize_t read(char* buffer, size_t len);
+    // Reads network packets from the TUN device (from the given queue).
+    // In offload mode the kernel's virtio-net header is stored in *vnet.
+    ssize_t read(char* buffer, size_t len, int queue = 0, struct virtio_net_hdr* vnet = nullptr);
     
-    // Writes network packets to the TUN device
-    ssize_t write(const char* buffer, size_t len);
+    // Writes network packets to the TUN device (through the given queue).
+    // In offload mode vnet asks the kernel to segment/checksum the packet.
+    ssize_t write(const char* buffer, size_t len, int queue = 0, const struct virtio_net_hdr* vnet = nullptr);
     
-    // Returns the file descriptor of the TUN device
-    int getFd() const { return fd_; }
+    // Records the packets read from and written to every queue in pcapng files named
+    // <path>.<n> (<path>-q<queue>.<n> with several queues); see PacketCapture for the rest
+    bool enableCapture(const std::string& path, size_t fileSize, int files, unsigned sample,
+                       const std::string& hosts);
+
+    // Records a packet read or written around read() and write(), e.g. through a TunRing,
+    // in the queue's capture if there is one
+    void capture(int queue, const char* packet, size_t len, bool outbound);
+
+    // Switches every queue between blocking and non-blocking mode
+    bool setNonBlocking(bool enable);
+
+    // Returns the file descriptor of the TUN device (the first queue)
+    int getFd() const { return fds_.empty() ? -1 : fds_[0]; }
+
+    // Returns the file descriptor of one queue
+    int getQueueFd(int queue) const { return fds_[queue]; }
+
+    // Memory queues only: the end of a queue standing in for the host's network stack
+    int getPeerFd(int queue) const { return peers_[queue]; }
+
+    // Address last applied by assignAddress() (empty before); callable from any thread
+    std::string getAddress() const;
+
+    int getQueueCount() const { return queues_; }
+
+    bool hasOffload() const { return offload_; }
+
+    // Largest packet read() can return
+    size_t getMaxPacketSize() const { return offload_ ? MAX_PACKET_SIZE : BUFFER_SIZE; }
 
 private:
-    std::string name_;    // TUN interface
-    int fd_;             // File descriptor for the TUN device
+    // Closes every queue that was opened
+    void closeQueues();
+
+    std::string name_;      // TUN interface
+    std::vector<int> fds_;  // One file descriptor per queue
+    std::vector<int> peers_; // Memory queues: the other end of each queue
     bool isServer_;     
+    int queues_;            // Number of queues requested
+    bool offload_;          // IFF_VNET_HDR mode
+    bool memory_;           // Queues are socket pairs, see setMemoryQueues()
+    // One capture per queue, used by the thread serving it; empty unless enabled
+    std::vector<std::unique_ptr<PacketCapture>> captures_;
+    std::string address_;   // Assigned address
+    mutable std::mutex addressLock_;
+    int index_;             // Interface index, for netlink requests
+    Netlink netlink_;       // Shared by every thread changing routes
+    std::mutex netlinkLock_;
+    std::vector<std::string> routes_; // Routes to the interface that were added
+
+    static bool memoryQueues;
 };
@@ -0,0 +1,262 @@
+#include "TunRing.hpp"
+#include "Logger.hpp"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+// Submission queue entries: more than can be in flight (every read and write, and the
+// cancellation on the way out), so prepare() never finds the ring full
+static constexpr unsigned ENTRIES = 128;
+
+// Read and write at the file's own position: a TUN queue has none, every call is one packet
+static constexpr uint64_t NO_OFFSET = (uint64_t)-1;
+
+TunRing::TunRing(TunDevice& tun, int queue, PacketCache* packets, MetricsShard& metrics)
+    : tun_(tun), queue_(queue), fd_(tun.getQueueFd(queue)), packets_(packets), metrics_(metrics), eventFd_(-1),
+      fixed_(false), writeFixed_(false), headerSize_(tun.hasOffload() ? sizeof(struct virtio_net_hdr) : 0),
+      readyHead_(0), readyCount_(0), writeArea_(nullptr), slotSize_(0), inFlight_(0), enters_(0) {
+}
+
+TunRing::~TunRing() {
+    // Posted reads may still be filled until the kernel lets go of them, so they are
+    // cancelled and waited for before their buffers go back to the pool
+    if (inFlight_ > 0) {
+        struct io_uring_sqe* sqe = prepare();
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = fd_;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = CANCEL << 32;
+            inFlight_++;
+            while (inFlight_ > 0 && ring_.submit(1))
+                reap();
+        }
+    }
+    if (eventFd_ >= 0)
+        close(eventFd_);
+    free(writeArea_);
+}
+
+bool TunRing::initialize() {
+    if (!ring_.initialize(ENTRIES))
+        return false;
+    eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd_ < 0 || !ring_.registerEventFd(eventFd_))
+        return false;
+
+    slotSize_ = (headerSize_ + tun_.getMaxPacketSize() + 63) / 64 * 64;
+    size_t areaSize = (WRITE_SLOTS * slotSize_ + 4095) / 4096 * 4096;
+    writeArea_ = static_cast<char*>(aligned_alloc(4096, areaSize));
+    if (!writeArea_)
+        return false;
+    for (unsigned slot = WRITE_SLOTS; slot-- > 0;)
+        freeSlots_.push_back(slot);
+
+    // Fixed buffers spare the kernel pinning the pages on every call. Without them
+    // (before Linux 5.19, or over the locked memory limit) the same calls go unregistered
+    fixed_ = ring_.registerBuffers(SLAB_BUFFERS + 1);
+    if (fixed_) {
+        slabState_.assign(SLAB_BUFFERS, 0);
+        writeFixed_ = ring_.updateBuffer(SLAB_BUFFERS, writeArea_, areaSize);
+    }
+    return true;
+}
+
+bool TunRing::start() {
+    for (unsigned slot = 0; slot < READS; slot++) {
+        reads_[slot].buffer = packets_->get();
+        if (!postRead(slot))
+            return false;
+    }
+    return submit();
+}
+
+bool TunRing::registered(const PacketHandle& buffer) {
+    uint32_t slab = buffer.slab();
+    if (!fixed_ || slab >= SLAB_BUFFERS)
+        return false;
+    if (slabState_[slab] == 0) {
+        size_t bytes;
+        void* base = packets_->pool().slab(slab, bytes);
+        slabState_[slab] = base && ring_.updateBuffer(slab, base, bytes) ? 1 : 2;
+    }
+    return slabState_[slab] == 1;
+}
+
+bool TunRing::postRead(unsigned slot) {
+    ReadSlot& read = reads_[slot];
+    struct io_uring_sqe* sqe = prepare();
+    if (!sqe)
+        return false;
+    char* data = read.buffer.data();
+    size_t len = packets_->bufferSize();
+    sqe->fd = fd_;
+    sqe->off = NO_OFFSET;
+    if (headerSize_) {
+        // The header arrives in front of the packet in the same read, as with TunDevice::read()
+        read.iov[0] = {&read.vnet, headerSize_};
+        read.iov[1] = {data, len};
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uintptr_t)read.iov;
+        sqe->len = 2;
+    } else {
+        sqe->opcode = registered(read.buffer) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->buf_index = read.buffer.slab();
+        sqe->addr = (uintptr_t)data;
+        sqe->len = len;
+    }
+    sqe->user_data = READ << 32 | slot;
+    inFlight_++;
+    return true;
+}
+
+ssize_t TunRing::read(PacketHandle& buffer, struct virtio_net_hdr* vnet) {
+    while (true) {
+        if (readyCount_ == 0) {
+            // Cleared before looking, so a completion that comes in after the look signals again
+            uint64_t count;
+            while (::read(eventFd_, &count, sizeof(count)) > 0) {
+            }
+            if (!submit())
+                return -1;
+            reap();
+            if (readyCount_ == 0) {
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+
+        unsigned slot = ready_[readyHead_];
+        readyHead_ = (readyHead_ + 1) % READS;
+        readyCount_--;
+        ReadSlot& read = reads_[slot];
+        ssize_t n = read.result;
+        if (n == -EINTR || n == -EAGAIN) {
+            if (!postRead(slot))
+                return -1;
+            continue;
+        }
+        if (n < 0) {
+            errno = -n;
+            return -1;
+        }
+        if (n < (ssize_t)headerSize_) {
+            errno = EINVAL;
+            return -1;
+        }
+        n -= headerSize_;
+        if (vnet) {
+            if (headerSize_)
+                *vnet = read.vnet;
+            else
+                memset(vnet, 0, sizeof(*vnet));
+        }
+
+        // The filled buffer goes to the caller, and the caller's spare one takes its place
+        PacketHandle filled = move(read.buffer);
+        read.buffer = buffer && buffer.unique() ? move(buffer) : packets_->get();
+        buffer = move(filled);
+        if (!postRead(slot))
+            return -1;
+
+        metrics_.ringPackets.add();
+        if (n > 0) {
+            tun_.capture(queue_, buffer.data(), n, true);
+            LOG_TRACE_RATE(20, "TUN queue %d read %zd bytes, IP version %d", queue_, n, (buffer.data()[0] >> 4) & 0xF);
+        }
+        return n;
+    }
+}
+
+bool TunRing::write(const char* packet, size_t len, const struct virtio_net_hdr* vnet) {
+    if (headerSize_ + len > slotSize_) {
+        errno = EMSGSIZE;
+        return false;
+    }
+    if (freeSlots_.empty()) {
+        reap();
+        // Every slot is in flight: wait for the device to take one
+        while (freeSlots_.empty()) {
+            bool ok = ring_.submit(1);
+            countEnters();
+            if (!ok)
+                return false;
+            reap();
+        }
+    }
+    struct io_uring_sqe* sqe = prepare();
+    if (!sqe)
+        return false;
+
+    unsigned slot = freeSlots_.back();
+    freeSlots_.pop_back();
+    char* data = writeArea_ + slot * slotSize_;
+    // Every write needs a header in offload mode; a zeroed one means "nothing to offload"
+    if (headerSize_) {
+        if (vnet)
+            memcpy(data, vnet, headerSize_);
+        else
+            memset(data, 0, headerSize_);
+    }
+    memcpy(data + headerSize_, packet, len);
+    tun_.capture(queue_, packet, len, false);
+
+    sqe->opcode = writeFixed_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd_;
+    sqe->off = NO_OFFSET;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = headerSize_ + len;
+    sqe->buf_index = SLAB_BUFFERS;
+    sqe->user_data = WRITE << 32 | slot;
+    inFlight_++;
+    metrics_.ringPackets.add();
+    return true;
+}
+
+bool TunRing::submit() {
+    bool ok = ring_.submit();
+    countEnters();
+    return ok;
+}
+
+void TunRing::reap() {
+    ring_.complete([this](const struct io_uring_cqe& cqe) {
+        inFlight_--;
+        unsigned index = cqe.user_data & 0xffffffff;
+        switch (cqe.user_data >> 32) {
+        case READ:
+            reads_[index].result = cqe.res;
+            ready_[(readyHead_ + readyCount_++) % READS] = index;
+            break;
+        case WRITE:
+            freeSlots_.push_back(index);
+            if (cqe.res < 0) {
+                metrics_.dropsTunWrite.add();
+                LOG_WARN("Failed to write to TUN: %s", strerror(-cqe.res));
+            }
+            break;
+        case CANCEL:
+            // Nothing was left (a thread's requests end with it), or cancelling all of a
+            // file's requests is not supported before Linux 5.19 and closing the ring will do
+            if (cqe.res < 0)
+                inFlight_ = 0;
+            break;
+        }
+    });
+}
+
+struct io_uring_sqe* TunRing::prepare() {
+    struct io_uring_sqe* sqe = ring_.prepare();
+    if (!sqe && submit())
+        sqe = ring_.prepare();
+    return sqe;
+}
+
+void TunRing::countEnters() {
+    metrics_.ringEnters.add(ring_.enters() - enters_);
+    enters_ = ring_.enters();
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "IoRing.hpp"
+#include "TunDevice.hpp"
+#include "PacketPool.hpp"
+#include "Metrics.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/uio.h>
+
+// io_uring backend for one TUN queue (-I). READS reads stay posted at all times, into pooled
+// packet buffers whose slabs are registered with the kernel as fixed buffers. Packets to
+// write are copied into registered slots. Reads and writes are batched: one io_uring_enter
+// queues every write and re-posts every read since the last one. Completions signal
+// getEventFd(), which the event loop watches in place of the queue's file descriptor.
+// The queue must stay in blocking mode, so the kernel waits for packets instead of
+// failing reads with EAGAIN. Only the owning thread uses it.
+class TunRing {
+public:
+    // Reads kept posted
+    static constexpr unsigned READS = 32;
+    // Writes that may be in flight; when all are taken, write() waits for one
+    static constexpr unsigned WRITE_SLOTS = 64;
+    // Fixed buffer table: the packet pool's slabs by index, then the write slots
+    static constexpr unsigned SLAB_BUFFERS = 1024;
+
+    TunRing(TunDevice& tun, int queue, PacketCache* packets, MetricsShard& metrics);
+    ~TunRing();
+
+    // Sets up the ring; false if io_uring is unavailable
+    bool initialize();
+
+    // Posts the reads. Called on the thread that uses the ring: the kernel finishes each
+    // request in the context of the thread that submitted it
+    bool start();
+
+    int getEventFd() const { return eventFd_; }
+
+    // Takes the next packet read, like TunDevice::read() but without a copy: the packet is in
+    // the buffer handed back in `buffer`, and the caller's buffer, if it has one, is used for
+    // the next read. -1 with errno EAGAIN once nothing is left; a drain that gets there
+    // puts the reposted reads in first, which picks up packets that arrived meanwhile
+    ssize_t read(PacketHandle& buffer, struct virtio_net_hdr* vnet);
+
+    // Reads have completed that read() has not handed out. Their eventfd signal may have been
+    // taken already, so a caller that stopped draining early checks this before it sleeps
+    bool pending() const { return readyCount_ > 0 || ring_.completions() > 0; }
+
+    // Queues a packet for the device like TunDevice::write(). The packet is copied, so the
+    // caller may reuse its memory at once. False only if the ring failed; a packet the
+    // device refuses is counted in dropsTunWrite when its completion comes in
+    bool write(const char* packet, size_t len, const struct virtio_net_hdr* vnet = nullptr);
+
+    // Hands queued writes and reposted reads to the kernel; due before the caller sleeps
+    bool submit();
+
+private:
+    enum Operation : uint64_t { READ = 1, WRITE = 2, CANCEL = 3 };
+
+    struct ReadSlot {
+        PacketHandle buffer;
+        struct virtio_net_hdr vnet;  // Offload mode: the header read in front of the packet
+        struct iovec iov[2];
+        int result;                  // Of the completed read
+    };
+
+    bool postRead(unsigned slot);
+    // Whether the buffer's slab is a fixed buffer, registering it on first sight
+    bool registered(const PacketHandle& buffer);
+    // Takes every queued completion: reads join ready_, write slots are freed
+    void reap();
+    // Prepares an entry, submitting what is queued first if the ring is full
+    struct io_uring_sqe* prepare();
+    void countEnters();
+
+    TunDevice& tun_;
+    int queue_;
+    int fd_;                          // The TUN queue
+    PacketCache* packets_;
+    MetricsShard& metrics_;
+    IoRing ring_;
+    int eventFd_;
+    bool fixed_;                      // The fixed buffer table is registered
+    bool writeFixed_;                 // The write slots are in it
+    std::vector<uint8_t> slabState_;  // Per pool slab: 0 not tried, 1 registered, 2 failed
+    size_t headerSize_;               // Virtio-net header in front of each packet, 0 without offload
+
+    ReadSlot reads_[READS];
+    unsigned ready_[READS];           // Completed reads in completion order, a circular queue
+    unsigned readyHead_, readyCount_;
+
+    char* writeArea_;                 // WRITE_SLOTS slots of slotSize_ bytes, fixed buffer SLAB_BUFFERS
+    size_t slotSize_;
+    std::vector<unsigned> freeSlots_;
+    unsigned inFlight_;               // Entries the kernel has not completed yet
+    uint64_t enters_;                 // ring_.enters() as last counted
+
+    TunRing(const TunRing&) = delete;
+    TunRing& operator=(const TunRing&) = delete;
+};
@@ -2,7 +2,9 @@
 #include "Logger.hpp" 
 #include <sys/socket.h> 
 #include <arpa/inet.h> 
+#include <netinet/tcp.h>
 #include <unistd.h> 
+#include <fcntl.h>
 #include <netdb.h>
 #include <string.h> 
 #include <iostream> 
@@ -10,9 +12,9 @@
 
 using namespace std; 
 
-VPNConnection::VPNConnection(bool isServer) : isServer_(isServer), listenFd_(-1) // Constructor to initialize the VPN connection
+VPNConnection::VPNConnection(bool isServer, bool datagram) : isServer_(isServer), datagram_(datagram), listenFd_(-1) // Constructor to initialize the VPN connection
 {
-    tunnel = make_unique<Tunnel>(); // Create a unique pointer to the Tunnel object
+    tunnel = make_unique<Tunnel>(datagram); // Create a unique pointer to the Tunnel object
 
     filesystem::path current_path = filesystem::current_path(); 
     filesystem::path cert_base = current_path.parent_path(); 
@@ -21,20 +23,18 @@ VPNConnection::VPNConnection(bool isServer) : isServer_(isServer), listenFd_(-1)
     if (isServer_) // Check if the connection is a server
     {
         cert_dir = cert_base / "server_certs"; 
-        cout << "Using server certificates from: " << cert_dir << endl;
+        LOG_DEBUG("Using server certificates from: %s", cert_dir.c_str());
     }
     else // If the connection is a client
     {
         cert_dir = cert_base / "client_certs"; 
-        cout << "Using client certificates from: " << cert_dir << endl; 
+        LOG_DEBUG("Using client certificates from: %s", cert_dir.c_str());
     }
 
     string cert_path = (cert_dir / (isServer_ ? "server.crt" : "client.crt")).string(); 
     string key_path = (cert_dir / (isServer_ ? "server.key" : "client.key")).string(); 
 
-    cout << "Certificate paths:\n"
-         << "Cert: " << cert_path << "\n"
-         << "Key: " << key_path << endl; 
+    LOG_DEBUG("Certificate paths: cert %s, key %s", cert_path.c_str(), key_path.c_str());
 
     Tunnel::setCertificatePaths(cert_path, key_path); 
 }
@@ -49,11 +49,11 @@ bool VPNConnection::connect(const string &host, int port)
 {
     cout << "Attempting VPN connection to " << host << ":" << port << endl; 
 
-    // // Verify certificates exist before attempting connection
-    // filesystem::path cert_dir = filesystem::current_path().parent_path() / "client_certs"; // Get the client certificate directory
-    // string client_cert = (cert_dir / "client.crt").string(); // Set the client certificate path
-    // string client_key = (cert_dir / "client.key").string(); // Set the client key path
-    // string ca_cert = (cert_dir / "ca.crt").string(); // Set the CA certificate path
+    // Verify certificates exist before attempting connection
+    filesystem::path cert_dir = filesystem::current_path().parent_path() / "client_certs"; // Get the client certificate directory
+    string client_cert = (cert_dir / "client.crt").string(); // Set the client certificate path
+    string client_key = (cert_dir / "client.key").string(); // Set the client key path
+    string ca_cert = (cert_dir / "ca.crt").string(); // Set the CA certificate path
 
     cout << "Verifying certificate files..." << endl; // Print the verification message
     if (!filesystem::exists(client_cert) || !filesystem::exists(client_key) || !filesystem::exists(ca_cert)) // Check if the certificate files exist
@@ -62,12 +62,12 @@ bool VPNConnection::connect(const string &host, int port)
         return false; // Return false if the certificate files are missing
     }
 
-    // const int MAX_RETRIES = 3;
-    // const int BASE_DELAY = 2; 
+    const int MAX_RETRIES = 3;
+    const int BASE_DELAY = 2; 
 
-    // for (int i = 0; i < MAX_RETRIES; i++) // Loop through the retries
-    // {
-    //     cout << "\nConnection attempt " << (i + 1) << " of " << MAX_RETRIES << endl; 
+    for (int i = 0; i < MAX_RETRIES; i++) // Loop through the retries
+    {
+        cout << "\nConnection attempt " << (i + 1) << " of " << MAX_RETRIES << endl; 
 
         if (tunnel->connect(host, to_string(port))) 
         {
@@ -81,12 +81,24 @@ bool VPNConnection::connect(const string &host, int port)
             cout << "Connection failed, waiting " << delay << " seconds before retry..." << endl; 
             sleep(delay); 
         }
-    // }
+    }
 
     cerr << "Failed to establish VPN connection after " << MAX_RETRIES << " attempts" << endl; 
     return false; 
 }
 
+bool VPNConnection::reconnect(const string &host, int port)
+{
+    tunnel = make_unique<Tunnel>(datagram_);
+    return tunnel->connect(host, to_string(port));
+}
+
+bool VPNConnection::startConnect(const string &host, int port)
+{
+    tunnel = make_unique<Tunnel>(datagram_);
+    return tunnel->start_connect(host, to_string(port));
+}
+
 bool VPNConnection::bind(int port) // Bind to a port for listening
 {
     return setupServer(port);
@@ -96,8 +108,8 @@ bool VPNConnection::setupServer(int port)
 {
     cout << "Setting up server on port " << port << "..." << endl; // Print the setup message
 
-    // First set up the TCP socket
-    if (!setupTCPServer(port)) 
+    // First set up the TCP (or UDP) socket
+    if (!(datagram_ ? setupUDPServer(port) : setupTCPServer(port))) 
     {
         return false; 
     }
@@ -154,35 +166,129 @@ bool VPNConnection::setupTCPServer(int port)
     }
     cout << "Successfully listening on port " << port << endl; 
 
+    // The server accepts from an edge-triggered event loop, so never block here
+    int flags = fcntl(listenFd_, F_GETFL, 0);
+    if (flags < 0 || fcntl(listenFd_, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        cerr << "Failed to make listen socket non-blocking: " << strerror(errno) << endl; 
+        close(listenFd_); 
+        return false; 
+    }
+
     return true; 
 }
 
-bool VPNConnection::accept()
+bool VPNConnection::setupUDPServer(int port) 
 {
-    cout << "Waiting for client connection..." << endl; 
-    struct sockaddr_in client; 
-    socklen_t len = sizeof(client); 
-    int client_fd = ::accept(listenFd_, (struct sockaddr *)&client, &len);
-    if (client_fd < 0) 
+    listenFd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0); 
+    if (listenFd_ < 0) 
+    {
+        cerr << "Failed to create socket: " << strerror(errno) << endl; 
+        return false;
+    }
+
+    // Every client's connected socket binds the same port
+    int optval = 1; 
+    if (setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) 
     {
-        cerr << "Accept failed: " << strerror(errno) << endl; 
+        cerr << "Failed to set socket options: " << strerror(errno) << endl; 
+        close(listenFd_); 
         return false; 
     }
 
-    cout << "Client connected from " << inet_ntoa(client.sin_addr) << endl; 
-    cout << "Initializing SSL connection..." << endl;
+    memset(&addr_, 0, sizeof(addr_)); 
+    addr_.sin_family = AF_INET; 
+    addr_.sin_addr.s_addr = htonl(INADDR_ANY); 
+    addr_.sin_port = htons(port);
+
+    if (::bind(listenFd_, (struct sockaddr *)&addr_, sizeof(addr_)) < 0) // Bind the socket to the address
+    {
+        cerr << "Bind failed: " << strerror(errno) << endl; 
+        close(listenFd_);
+        return false; 
+    }
+    cout << "Successfully bound to UDP port " << port << endl; 
 
-    if (!tunnel->accept_client(client_fd))
+    // New clients are taken from an edge-triggered event loop, so never block here
+    int flags = fcntl(listenFd_, F_GETFL, 0);
+    if (flags < 0 || fcntl(listenFd_, F_SETFL, flags | O_NONBLOCK) < 0)
     {
-        cerr << "SSL connection failed" << endl; 
-        close(client_fd); 
+        cerr << "Failed to make listen socket non-blocking: " << strerror(errno) << endl; 
+        close(listenFd_); 
         return false; 
     }
 
-    cout << "Client connection fully established" << endl; 
     return true; 
 }
 
+unique_ptr<Tunnel> VPNConnection::acceptDatagramSession(string &peer)
+{
+    // Work through the datagrams queued on the shared socket; only hellos that carry a
+    // valid cookie turn into sessions, everything else is answered or dropped by OpenSSL
+    while (true)
+    {
+        char probe;
+        if (::recv(listenFd_, &probe, sizeof(probe), MSG_PEEK | MSG_DONTWAIT) < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                cerr << "Receive failed: " << strerror(errno) << endl; 
+            return nullptr; 
+        }
+
+        // The listening tunnel runs the cookie exchange; a client gets a Tunnel only once it passed
+        unique_ptr<Tunnel> session;
+        int r = tunnel->accept_datagram(listenFd_, session, peer);
+        if (r == 0)
+            continue;
+        if (r < 0)
+        {
+            LOG_WARN("DTLS handshake failed");
+            errno = ECONNABORTED;
+            return nullptr; 
+        }
+
+        LOG_DEBUG("Client %s passed the cookie exchange", peer.c_str());
+        return session; 
+    }
+}
+
+unique_ptr<Tunnel> VPNConnection::acceptSession(string &peer)
+{
+    if (datagram_)
+        return acceptDatagramSession(peer);
+
+    struct sockaddr_in client; 
+    socklen_t len = sizeof(client); 
+    int client_fd = ::accept4(listenFd_, (struct sockaddr *)&client, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) 
+    {
+        // EAGAIN just means every queued connection has been taken
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            cerr << "Accept failed: " << strerror(errno) << endl; 
+        return nullptr; 
+    }
+
+    peer = string(inet_ntoa(client.sin_addr)) + ":" + to_string(ntohs(client.sin_port));
+    LOG_DEBUG("Client connected from %s", peer.c_str());
+
+    // Frames are already coalesced into records, so Nagle would only hold them back
+    int nodelay = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // Every session gets its own Tunnel so it owns its SSL state
+    unique_ptr<Tunnel> session = make_unique<Tunnel>();
+    if (!session->accept_client(client_fd))
+    {
+        LOG_WARN("SSL connection with %s failed", peer.c_str());
+        if (session->get_socket_fd() != client_fd)
+            close(client_fd); 
+        errno = ECONNABORTED;
+        return nullptr; 
+    }
+
+    return session; 
+}
+
 bool VPNConnection::setupClient(const string &host, int port) 
 {
     return tunnel->connect(host, to_string(port)); 
@@ -211,9 +317,7 @@ bool VPNConnection::configureCertificates(const string &certPath, const string &
 
     Tunnel::setCertificatePaths(certPath, keyPath); 
 
-    cout << "Successfully configured certificates:\n"
-         << "Cert: " << certPath << "\n"
-         << "Key: " << keyPath << endl;
+    LOG_DEBUG("Configured certificates: cert %s, key %s", certPath.c_str(), keyPath.c_str());
 
     return true; 
 }
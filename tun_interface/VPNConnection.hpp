@@ -8,27 +8,55 @@ using namespace std;
 class VPNConnection
 {
 public:
-    // Main VPN connection interface
-    VPNConnection(bool isServer);
+    // Main VPN connection interface; datagram selects DTLS over UDP instead of TLS over TCP
+    VPNConnection(bool isServer, bool datagram = false);
     ~VPNConnection();
 
     // Core networking operations
     bool connect(const string &host, int port);
+    // Replaces the tunnel with a fresh one and makes a single connection attempt, which
+    // resumes the last session if the server still takes its ticket; the caller paces retries
+    bool reconnect(const string &host, int port);
+    // Like reconnect(), but only starts connecting (see Tunnel::start_connect); handshake()
+    // then advances the connection from the caller's event loop until it returns 1
+    bool startConnect(const string &host, int port);
+    int handshake() { return tunnel->handshake(); }
+    bool handshakeWantsWrite() const { return tunnel->handshake_wants_write(); }
     bool bind(int port);
-    bool accept();
+    // Accepts one pending client on a non-blocking socket; the caller runs its handshake
+    // with Tunnel::handshake(). Returns nullptr with errno == EAGAIN once the backlog is drained
+    unique_ptr<Tunnel> acceptSession(string &peer);
     ssize_t read(char *buffer, size_t len);
     ssize_t write(const char *buffer, size_t len);
+    // Non-blocking send path (see Tunnel::enqueue/flush)
+    void enqueue(const char *buffer, size_t len) { tunnel->enqueue(buffer, len); }
+    int flush() { return tunnel->flush(); }
+    bool sendQueueFull() const { return tunnel->send_queue_full(); }
+    bool wantsWrite() const { return tunnel->wants_write(); }
+    size_t queued() const { return tunnel->queued(); }
+    // Whether the kernel took over record encryption (kTLS) in each direction
+    bool kernelTlsSend() const { return tunnel && tunnel->ktls_send(); }
+    bool kernelTlsReceive() const { return tunnel && tunnel->ktls_receive(); }
+    bool resumedSession() const { return tunnel && tunnel->session_reused(); }
+    // Decrypted bytes waiting inside the tunnel that select() cannot see
+    size_t pending() const { return tunnel ? tunnel->pending() : 0; }
+    // In non-blocking mode read() returns -1 with errno == EAGAIN when no record is complete
+    bool setNonBlocking(bool enable) { return tunnel && tunnel->set_nonblocking(enable); }
+    // See Tunnel::set_unsent_limit
+    bool setUnsentLimit(int bytes) { return tunnel && tunnel->set_unsent_limit(bytes); }
     int getFd() const { return tunnel ? tunnel->get_socket_fd() : -1; }
+    int getListenFd() const { return listenFd_; }
 
     // Network configuration methods
     bool setupRouting();
-    bool cleanupRouting();
     bool configureCertificates(const string &certPath, const string &keyPath);
 
 private:
     // Connection setup helpers
     bool setupServer(int port);
     bool setupTCPServer(int port);
+    bool setupUDPServer(int port);
+    unique_ptr<Tunnel> acceptDatagramSession(string &peer);
     bool setupClient(const string &host, int port);
     bool configureIPForwarding();
     bool setupNATRules();
@@ -36,6 +64,7 @@ private:
 
     // Member variables
     bool isServer_;
+    bool datagram_;
     int listenFd_;
     struct sockaddr_in addr_;
     unique_ptr<Tunnel> tunnel;
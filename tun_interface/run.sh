@@ -20,13 +20,36 @@ compile() {
     
     # Get absolute paths
     ROOT_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+
+    # LOG_LEVEL=trace|debug|info|warn|error sets the lowest log level compiled in
+    LOG_FLAGS=""
+    if [ -n "$LOG_LEVEL" ]; then
+        LOG_FLAGS="-DLOG_LEVEL=LOG_LEVEL_${LOG_LEVEL^^}"
+    fi
     
     g++ -o vpn \
         "${ROOT_DIR}/src/main.cpp" \
         "${ROOT_DIR}/tun_interface/VPNConnection.cpp" \
         "${ROOT_DIR}/tun_interface/TunDevice.cpp" \
+        "${ROOT_DIR}/tun_interface/Netlink.cpp" \
+        "${ROOT_DIR}/tun_interface/EventLoop.cpp" \
+        "${ROOT_DIR}/tun_interface/AddressPool.cpp" \
         "${ROOT_DIR}/tunneling/Tunnel.cpp" \
-        -std=c++17 -lssl -lcrypto \
+        "${ROOT_DIR}/tunneling/CipherPolicy.cpp" \
+        "${ROOT_DIR}/tunneling/FrameBatcher.cpp" \
+        "${ROOT_DIR}/tunneling/FrameReader.cpp" \
+        "${ROOT_DIR}/tunneling/FrameCompressor.cpp" \
+        "${ROOT_DIR}/tun_interface/PacketOffload.cpp" \
+        "${ROOT_DIR}/tun_interface/Logger.cpp" \
+        "${ROOT_DIR}/tun_interface/Metrics.cpp" \
+        "${ROOT_DIR}/tun_interface/PacketPool.cpp" \
+        "${ROOT_DIR}/tun_interface/PacketCapture.cpp" \
+        "${ROOT_DIR}/tun_interface/PacketReplay.cpp" \
+        "${ROOT_DIR}/tun_interface/FairQueue.cpp" \
+        "${ROOT_DIR}/tun_interface/IoRing.cpp" \
+        "${ROOT_DIR}/tun_interface/TunRing.cpp" \
+        "${ROOT_DIR}/tun_interface/TimerWheel.cpp" \
+        -std=c++17 ${LOG_FLAGS} -lssl -lcrypto \
         -I"${ROOT_DIR}" \
         -I"${ROOT_DIR}/tun_interface" \
         -I"${ROOT_DIR}/tunneling"
@@ -38,10 +61,60 @@ compile() {
     print_status "Compilation successful!"
 }
 
+# Build and run the benchmarks in bench/
+bench() {
+    ROOT_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+
+    print_status "Running route table benchmark..."
+    g++ -O2 -o route_table_bench "${ROOT_DIR}/bench/route_table_bench.cpp" \
+        -std=c++17 -I"${ROOT_DIR}" || { print_error "Benchmark build failed!"; exit 1; }
+    ./route_table_bench
+
+    print_status "Running timer wheel benchmark..."
+    g++ -O2 -o timer_wheel_bench "${ROOT_DIR}/bench/timer_wheel_bench.cpp" "${ROOT_DIR}/tun_interface/TimerWheel.cpp" \
+        -std=c++17 -I"${ROOT_DIR}" || { print_error "Benchmark build failed!"; exit 1; }
+    ./timer_wheel_bench
+
+    print_status "Running crypto benchmark..."
+    g++ -O2 -o crypto_bench "${ROOT_DIR}/bench/crypto_bench.cpp" \
+        "${ROOT_DIR}/tunneling/Tunnel.cpp" "${ROOT_DIR}/tunneling/CipherPolicy.cpp" \
+        -std=c++17 -pthread -I"${ROOT_DIR}" -I"${ROOT_DIR}/tunneling" -lssl -lcrypto \
+        || { print_error "Benchmark build failed!"; exit 1; }
+    ./crypto_bench "${ROOT_DIR}/server_certs"
+
+    print_status "Running loopback benchmark..."
+    g++ -O2 -o loopback_bench "${ROOT_DIR}/bench/loopback_bench.cpp" \
+        "${ROOT_DIR}/tun_interface/VPNConnection.cpp" \
+        "${ROOT_DIR}/tun_interface/TunDevice.cpp" \
+        "${ROOT_DIR}/tun_interface/Netlink.cpp" \
+        "${ROOT_DIR}/tun_interface/EventLoop.cpp" \
+        "${ROOT_DIR}/tun_interface/AddressPool.cpp" \
+        "${ROOT_DIR}/tunneling/Tunnel.cpp" \
+        "${ROOT_DIR}/tunneling/CipherPolicy.cpp" \
+        "${ROOT_DIR}/tunneling/FrameBatcher.cpp" \
+        "${ROOT_DIR}/tunneling/FrameReader.cpp" \
+        "${ROOT_DIR}/tunneling/FrameCompressor.cpp" \
+        "${ROOT_DIR}/tun_interface/PacketOffload.cpp" \
+        "${ROOT_DIR}/tun_interface/Logger.cpp" \
+        "${ROOT_DIR}/tun_interface/Metrics.cpp" \
+        "${ROOT_DIR}/tun_interface/PacketPool.cpp" \
+        "${ROOT_DIR}/tun_interface/PacketCapture.cpp" \
+        "${ROOT_DIR}/tun_interface/PacketReplay.cpp" \
+        "${ROOT_DIR}/tun_interface/FairQueue.cpp" \
+        "${ROOT_DIR}/tun_interface/IoRing.cpp" \
+        "${ROOT_DIR}/tun_interface/TunRing.cpp" \
+        "${ROOT_DIR}/tun_interface/TimerWheel.cpp" \
+        -std=c++17 -pthread -lssl -lcrypto \
+        -I"${ROOT_DIR}" -I"${ROOT_DIR}/tun_interface" -I"${ROOT_DIR}/tunneling" \
+        || { print_error "Benchmark build failed!"; exit 1; }
+    # Machine-readable results for comparing runs
+    ./loopback_bench loopback_bench.json
+}
+
 # Clean function
 clean() {
     print_status "Cleaning up..."
-    rm -f vpn
+    rm -f vpn route_table_bench timer_wheel_bench crypto_bench loopback_bench loopback_bench.json
 }
 
 # Cleanup function
@@ -81,14 +154,18 @@ case "$1" in
         sudo ./vpn -i tun1 -c 127.0.0.1 -p 55555
         sudo ip route replace default dev tun1
         ;;
+    "bench")
+        bench
+        ;;
     "clean")
         clean
         ;;
     *)
-        echo "Usage: $0 {server|client|clean}"
+        echo "Usage: $0 {server|client|bench|clean}"
         echo "Commands:"
         echo "  server    - Compile and run as server"
         echo "  client    - Compile and run as client"
+        echo "  bench     - Build and run benchmarks"
         echo "  clean     - Clean build files"
         exit 1
         ;;
@@ -0,0 +1,79 @@
+#include "CipherPolicy.hpp"
+#include <openssl/err.h>
+#include <iostream>
+#include <sstream>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// AEAD suites in order of preference for each kind of CPU
+static const char *AES_FIRST = "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256";
+static const char *CHACHA_FIRST = "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384";
+
+// TLS 1.2 (and DTLS 1.2) cipher names with the same bulk cipher as a TLS 1.3 suite
+static string tls12_equivalent(const string &suite)
+{
+    if (suite == "TLS_AES_128_GCM_SHA256")
+        return "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256";
+    if (suite == "TLS_AES_256_GCM_SHA384")
+        return "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384";
+    if (suite == "TLS_CHACHA20_POLY1305_SHA256")
+        return "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305";
+    return "";
+}
+
+bool CipherPolicy::hardwareAes()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+#else
+    return false;
+#endif
+}
+
+string CipherPolicy::resolvedSuites() const
+{
+    if (suites == AUTO)
+        return hardwareAes() ? AES_FIRST : CHACHA_FIRST;
+    return suites;
+}
+
+bool CipherPolicy::apply(SSL_CTX *ctx) const
+{
+    string resolved = resolvedSuites();
+    if (!resolved.empty())
+    {
+        string tls12;
+        stringstream names(resolved);
+        string name;
+        while (getline(names, name, ':'))
+        {
+            string equivalent = tls12_equivalent(name);
+            if (!equivalent.empty())
+                tls12 += (tls12.empty() ? "" : ":") + equivalent;
+        }
+
+        if (SSL_CTX_set_ciphersuites(ctx, resolved.c_str()) != 1 ||
+            (!tls12.empty() && SSL_CTX_set_cipher_list(ctx, tls12.c_str()) != 1))
+        {
+            cerr << "Invalid cipher suites: " << resolved << endl;
+            ERR_print_errors_fp(stderr);
+            return false;
+        }
+        // The server picks by its own order, except that a client listing ChaCha20 first
+        // (typically one without AES instructions) gets ChaCha20
+        SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_PRIORITIZE_CHACHA);
+    }
+
+    if (!groups.empty() && SSL_CTX_set1_groups_list(ctx, groups.c_str()) != 1)
+    {
+        cerr << "Invalid key exchange groups: " << groups << endl;
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+    return true;
+}
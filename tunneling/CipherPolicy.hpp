@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <openssl/ssl.h>
+using namespace std;
+
+// Cipher suite and key exchange group preferences applied to every SSL context
+struct CipherPolicy
+{
+    // Resolves to AES-GCM first on CPUs with AES instructions, ChaCha20-Poly1305 first otherwise
+    static constexpr const char *AUTO = "auto";
+
+    // TLS 1.3 suite names in preference order, colon separated (e.g.
+    // "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256"), or AUTO. The TLS 1.2
+    // equivalents are used for DTLS. Empty keeps OpenSSL's defaults.
+    string suites;
+    // Key exchange groups in preference order (e.g. "X25519:P-256"); empty keeps the defaults
+    string groups;
+
+    // Whether this CPU has AES and carry-less multiply instructions (AES-NI and PCLMULQDQ
+    // on x86, the crypto extensions on ARMv8), which make AES-GCM faster than ChaCha20
+    static bool hardwareAes();
+
+    // The suite list with AUTO replaced by this CPU's preference
+    string resolvedSuites() const;
+
+    // Applies the policy to a context; false if OpenSSL rejects a name
+    bool apply(SSL_CTX *ctx) const;
+};
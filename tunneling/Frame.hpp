@@ -0,0 +1,120 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// Wire format of the tunnel: every frame is a 2-byte big-endian payload length
+// followed by the payload. A payload whose first nibble is an IP version (4 or 6)
+// is a tunneled packet, GSO_FRAME_MARKER in the high nibble marks an offloaded
+// superpacket, COMPRESSED_FRAME_MARKER one of those two compressed, and any other
+// first byte identifies a control message.
+constexpr size_t FRAME_HEADER_SIZE = sizeof(uint16_t);
+
+enum FrameKind {
+    FRAME_PACKET,     // Plain IPv4/IPv6 packet
+    FRAME_GSO,        // GsoFrameHeader followed by a packet the receiver's kernel must segment/checksum
+    FRAME_CONTROL,    // Control message, type in the first byte
+    FRAME_COMPRESSED, // CompressedFrameHeader followed by a FRAME_PACKET/FRAME_GSO payload in LZ4 block format
+};
+
+// Control message types (first payload byte). The server waits for a client's first frame
+// before giving it an address: CONTROL_FEATURES for a new session, CONTROL_JOIN_STREAM for
+// a connection joining one
+enum ControlType : uint8_t {
+    CONTROL_ASSIGN_ADDRESS = 0x01,  // Server -> client: address for the client's TUN interface
+    CONTROL_FEATURES = 0x02,        // Either direction: optional frame kinds the sender accepts
+    CONTROL_REQUEST_ADDRESS = 0x03, // Client -> server: address wanted back after a reconnect
+    CONTROL_STREAM_TOKEN = 0x04,    // Server -> client: credential for joining streams to the session
+    CONTROL_JOIN_STREAM = 0x05,     // Client -> server, first frame only: makes the connection a stream of a session
+    CONTROL_KEEPALIVE = 0x06,       // Either direction: the connection is alive, sent when it is idle
+};
+
+// Feature bits carried in CONTROL_FEATURES
+enum FeatureFlag : uint32_t {
+    FEATURE_GSO = 1u << 0,          // Peer accepts FRAME_GSO frames
+    FEATURE_COMPRESSION = 1u << 1,  // Peer accepts FRAME_COMPRESSED frames
+    FEATURE_STREAMS = 1u << 2,      // Client stripes flows over several streams (asks for a token)
+};
+
+// CONTROL_ASSIGN_ADDRESS payload, also used for CONTROL_REQUEST_ADDRESS
+struct AssignAddressMessage {
+    uint8_t type;        // CONTROL_ASSIGN_ADDRESS or CONTROL_REQUEST_ADDRESS
+    uint8_t prefixLen;   // Prefix length of the client network
+    uint8_t reserved[2];
+    uint32_t address;    // IPv4 address in network byte order
+} __attribute__((packed));
+
+// CONTROL_FEATURES payload
+struct FeaturesMessage {
+    uint8_t type;        // CONTROL_FEATURES
+    uint8_t reserved[3];
+    uint32_t features;   // FeatureFlag bits, network byte order
+} __attribute__((packed));
+
+// Most connections ("streams") one session stripes its flows over
+constexpr size_t MAX_STREAMS = 16;
+
+// CONTROL_STREAM_TOKEN payload, echoed back in CONTROL_JOIN_STREAM. Opaque to the client:
+// it names the server worker and session, and the secret proves the client holds the session
+struct StreamTokenMessage {
+    uint8_t type;        // CONTROL_STREAM_TOKEN or CONTROL_JOIN_STREAM
+    uint8_t reserved[3];
+    uint32_t worker;
+    uint64_t session;
+    uint8_t secret[16];
+} __attribute__((packed));
+
+// CONTROL_KEEPALIVE payload. Sent on a connection that has carried nothing else for the
+// sender's interval, and once when it starts, to announce that interval
+struct KeepaliveMessage {
+    uint8_t type;        // CONTROL_KEEPALIVE
+    uint8_t reserved;
+    uint16_t interval;   // Seconds between the sender's keepalives, network byte order
+} __attribute__((packed));
+
+// A peer that announced a keepalive interval and then stays silent for this many of them
+// is taken to be gone. Peers that never announced one are never timed out
+constexpr int KEEPALIVE_MISSES = 3;
+// Seconds between keepalives unless set with -K
+constexpr int DEFAULT_KEEPALIVE = 10;
+
+// High nibble of the first byte of a FRAME_GSO payload (never an IP version)
+constexpr uint8_t GSO_FRAME_MARKER = 0x20;
+
+// Header in front of a FRAME_GSO packet: the virtio-net offload request of the
+// sending kernel in network byte order, with the virtio flags in the marker's low nibble
+struct GsoFrameHeader {
+    uint8_t marker;      // GSO_FRAME_MARKER | virtio-net flags
+    uint8_t gsoType;     // VIRTIO_NET_HDR_GSO_*
+    uint16_t hdrLen;     // Length of the headers copied into every segment
+    uint16_t gsoSize;    // Payload bytes per segment (MSS)
+    uint16_t csumStart;  // Offset where checksumming starts
+    uint16_t csumOffset; // Offset of the checksum field from csumStart
+} __attribute__((packed));
+
+// High nibble of the first byte of a FRAME_COMPRESSED payload (never an IP version)
+constexpr uint8_t COMPRESSED_FRAME_MARKER = 0x30;
+
+// Header in front of a compressed frame
+struct CompressedFrameHeader {
+    uint8_t marker;      // COMPRESSED_FRAME_MARKER
+    uint8_t reserved;
+    uint16_t length;     // Length of the original payload, network byte order
+} __attribute__((packed));
+
+inline FrameKind frameKind(const char* payload, size_t len) {
+    if (len == 0)
+        return FRAME_CONTROL;
+    unsigned char nibble = static_cast<unsigned char>(payload[0]) >> 4;
+    if (nibble == 4 || nibble == 6)
+        return FRAME_PACKET;
+    if (nibble == (GSO_FRAME_MARKER >> 4) && len > sizeof(GsoFrameHeader))
+        return FRAME_GSO;
+    if (nibble == (COMPRESSED_FRAME_MARKER >> 4) && len > sizeof(CompressedFrameHeader))
+        return FRAME_COMPRESSED;
+    return FRAME_CONTROL;
+}
+
+// True if the payload is a control message rather than an IP packet
+inline bool isControlFrame(const char* payload, size_t len) {
+    return frameKind(payload, len) == FRAME_CONTROL;
+}
@@ -0,0 +1,37 @@
+#include "FrameBatcher.hpp"
+#include <arpa/inet.h>
+#include <string.h>
+
+using namespace std;
+
+FrameBatcher::FrameBatcher(size_t recordSize)
+    : recordSize_(recordSize), used_(0), frames_(0)
+{
+    // Room for a full batch plus one oversized frame in an otherwise empty batch
+    buffer_.resize(recordSize_ + FRAME_HEADER_SIZE + UINT16_MAX);
+}
+
+bool FrameBatcher::append(const char *payload, size_t len)
+{
+    return append(nullptr, 0, payload, len);
+}
+
+bool FrameBatcher::append(const char *header, size_t headerLen, const char *payload, size_t len)
+{
+    size_t total = headerLen + len;
+    if (total > UINT16_MAX)
+        return false;
+    if (frames_ > 0 && used_ + FRAME_HEADER_SIZE + total > recordSize_)
+        return false;
+
+    // Length prefix in network byte order, then the payload
+    char *out = buffer_.data() + used_;
+    uint16_t plength = htons(total);
+    memcpy(out, &plength, sizeof(plength));
+    if (headerLen)
+        memcpy(out + FRAME_HEADER_SIZE, header, headerLen);
+    memcpy(out + FRAME_HEADER_SIZE + headerLen, payload, len);
+    used_ += FRAME_HEADER_SIZE + total;
+    frames_++;
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "Frame.hpp"
+#include <vector>
+#include <cstddef>
+
+// Packs length-prefixed frames back to back so a burst of packets can leave in one
+// Tunnel::send (one TLS record, one MAC, one write) instead of two per packet.
+// The owner sends data()/size() through its tunnel and then calls clear().
+class FrameBatcher {
+public:
+    // Largest plaintext a single TLS record can carry
+    static constexpr size_t DEFAULT_RECORD_SIZE = 16384;
+
+    explicit FrameBatcher(size_t recordSize = DEFAULT_RECORD_SIZE);
+
+    // Appends one frame; returns false when it does not fit and the batch must be flushed first.
+    // An empty batch always accepts a frame, even one larger than the record size.
+    bool append(const char* payload, size_t len);
+
+    // Appends one frame whose payload is a small header followed by a packet
+    bool append(const char* header, size_t headerLen, const char* payload, size_t len);
+
+    void clear() { used_ = 0; frames_ = 0; }
+
+    bool empty() const { return frames_ == 0; }
+    size_t size() const { return used_; }
+    size_t frames() const { return frames_; }
+    const char* data() const { return buffer_.data(); }
+
+private:
+    size_t recordSize_;          // Flush threshold in bytes
+    std::vector<char> buffer_;   // Encoded frames
+    size_t used_;                // Bytes used in buffer_
+    size_t frames_;              // Frames in buffer_
+};
@@ -0,0 +1,321 @@
+#include "FrameCompressor.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+using namespace std;
+
+// LZ4 block format limits: matches are at least MIN_MATCH long, the last LAST_LITERALS
+// bytes are always literals, and no match starts within MATCH_LIMIT bytes of the end
+static constexpr size_t MIN_MATCH = 4;
+static constexpr size_t LAST_LITERALS = 5;
+static constexpr size_t MATCH_LIMIT = 12;
+static constexpr size_t MAX_OFFSET = 65535;
+
+// Bytes sampled from a payload to judge its variety, and the most distinct values a
+// compressible sample has (random data shows about 57 of 64, text 20 to 35)
+static constexpr size_t SAMPLE_BYTES = 64;
+static constexpr size_t MAX_DISTINCT = 48;
+
+static uint32_t load32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Appends a length of 15 or more as LZ4 does: a run of 255s and the remainder
+static size_t putLength(unsigned char *out, size_t len)
+{
+    size_t n = 0;
+    for (; len >= 255; len -= 255)
+        out[n++] = 255;
+    out[n++] = (unsigned char)len;
+    return n;
+}
+
+FrameCompressor::FrameCompressor()
+    : input_(UINT16_MAX), output_(sizeof(CompressedFrameHeader) + UINT16_MAX), restored_(UINT16_MAX)
+{
+}
+
+bool FrameCompressor::looksCompressible(const char *packet, size_t len)
+{
+    if (len < MIN_PACKET_SIZE)
+        return false;
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(packet);
+
+    // Find the transport payload
+    size_t offset;
+    uint8_t protocol;
+    if ((p[0] >> 4) == 4)
+    {
+        offset = (p[0] & 0x0f) * 4;
+        if (offset < 20)
+            return false;
+        protocol = p[9];
+        // Later fragments carry no transport header
+        uint16_t fragment;
+        memcpy(&fragment, p + 6, sizeof(fragment));
+        if (ntohs(fragment) & 0x1fff)
+            protocol = 0;
+    }
+    else if ((p[0] >> 4) == 6)
+    {
+        offset = 40;
+        protocol = p[6];
+    }
+    else
+    {
+        return false;
+    }
+
+    if (protocol == IPPROTO_ESP)
+        return false;
+    if (protocol == IPPROTO_TCP && len >= offset + 20)
+    {
+        offset += (p[offset + 12] >> 4) * 4;
+    }
+    else if (protocol == IPPROTO_UDP && len >= offset + 8)
+    {
+        // QUIC and DTLS (443), IPsec NAT traversal (4500) and WireGuard (51820) are encrypted
+        uint16_t ports[2];
+        memcpy(ports, p + offset, sizeof(ports));
+        for (uint16_t port : ports)
+        {
+            port = ntohs(port);
+            if (port == 443 || port == 4500 || port == 51820)
+                return false;
+        }
+        offset += 8;
+    }
+    // Headers alone (e.g. TCP ACKs) are not worth it
+    if (offset >= len || len - offset < SAMPLE_BYTES)
+        return false;
+    const unsigned char *payload = p + offset;
+    size_t payloadLen = len - offset;
+
+    // Streams that start with a TLS record or the magic of a compressed format
+    if (payload[0] >= 0x14 && payload[0] <= 0x17 && payload[1] == 0x03 && payload[2] <= 0x04)
+        return false;
+    static const unsigned char magics[][4] = {
+        {0x1f, 0x8b, 0x08, 0},    // gzip
+        {0x28, 0xb5, 0x2f, 0xfd}, // zstd
+        {0x89, 'P', 'N', 'G'},    // PNG
+        {0xff, 0xd8, 0xff, 0},    // JPEG
+        {'P', 'K', 0x03, 0x04},   // zip
+    };
+    for (const auto &magic : magics)
+    {
+        size_t n = magic[3] ? 4 : 3;
+        if (memcmp(payload, magic, n) == 0)
+            return false;
+    }
+
+    // Byte variety of a sample spread over the payload: encrypted or compressed data
+    // uses nearly every value, text and structured data far fewer
+    uint64_t seen[4] = {0, 0, 0, 0};
+    size_t distinct = 0;
+    size_t step = payloadLen / SAMPLE_BYTES;
+    for (size_t i = 0; i < SAMPLE_BYTES; i++)
+    {
+        unsigned char b = payload[i * step];
+        uint64_t bit = 1ULL << (b & 63);
+        if (!(seen[b >> 6] & bit))
+        {
+            seen[b >> 6] |= bit;
+            distinct++;
+        }
+    }
+    return distinct <= MAX_DISTINCT;
+}
+
+bool FrameCompressor::compress(const char *header, size_t headerLen, const char *packet, size_t len,
+                               const char *&out, size_t &outLen)
+{
+    size_t total = headerLen + len;
+    if (total > UINT16_MAX || !looksCompressible(packet, len))
+        return false;
+
+    const char *src = packet;
+    if (headerLen)
+    {
+        memcpy(input_.data(), header, headerLen);
+        memcpy(input_.data() + headerLen, packet, len);
+        src = input_.data();
+    }
+
+    // Only worth the receiver's work if it saves at least 1/16
+    size_t budget = total - total / 16 - sizeof(CompressedFrameHeader);
+    size_t n = encode(src, total, output_.data() + sizeof(CompressedFrameHeader), budget);
+    if (!n)
+        return false;
+
+    CompressedFrameHeader frame;
+    frame.marker = COMPRESSED_FRAME_MARKER;
+    frame.reserved = 0;
+    frame.length = htons(total);
+    memcpy(output_.data(), &frame, sizeof(frame));
+    out = output_.data();
+    outLen = sizeof(frame) + n;
+    return true;
+}
+
+bool FrameCompressor::decompress(const char *payload, size_t len, char *&out, size_t &outLen)
+{
+    if (len <= sizeof(CompressedFrameHeader))
+        return false;
+    CompressedFrameHeader frame;
+    memcpy(&frame, payload, sizeof(frame));
+    size_t expected = ntohs(frame.length);
+    size_t n = decode(payload + sizeof(frame), len - sizeof(frame), restored_.data(), expected);
+    if (n == 0 || n != expected)
+        return false;
+
+    // Only packets are compressed, never control messages or nested compressed frames
+    FrameKind inner = frameKind(restored_.data(), n);
+    if (inner != FRAME_PACKET && inner != FRAME_GSO)
+        return false;
+    out = restored_.data();
+    outLen = n;
+    return true;
+}
+
+size_t FrameCompressor::encode(const char *source, size_t len, char *dest, size_t capacity)
+{
+    const unsigned char *src = reinterpret_cast<const unsigned char *>(source);
+    unsigned char *dst = reinterpret_cast<unsigned char *>(dest);
+    size_t ip = 0, anchor = 0, op = 0;
+
+    if (len > MATCH_LIMIT)
+    {
+        memset(table_, 0, sizeof(table_));
+        size_t lastMatchStart = len - MATCH_LIMIT;
+        size_t matchEnd = len - LAST_LITERALS;
+        while (ip < lastMatchStart)
+        {
+            uint32_t sequence = load32(src + ip);
+            uint32_t hash = (sequence * 2654435761U) >> (32 - HASH_BITS);
+            size_t ref = table_[hash];
+            table_[hash] = (uint16_t)ip;
+            if (ref >= ip || ip - ref > MAX_OFFSET || load32(src + ref) != sequence)
+            {
+                // Step faster the longer nothing matched, so random data costs little
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            size_t matchLen = MIN_MATCH;
+            while (ip + matchLen < matchEnd && src[ref + matchLen] == src[ip + matchLen])
+                matchLen++;
+
+            // Sequence: token, literal length, literals, offset, match length
+            size_t literals = ip - anchor;
+            if (op + 1 + literals / 255 + 1 + literals + 2 + matchLen / 255 + 1 > capacity)
+                return 0;
+            unsigned char *token = dst + op++;
+            *token = 0;
+            if (literals >= 15)
+            {
+                *token = 15 << 4;
+                op += putLength(dst + op, literals - 15);
+            }
+            else
+            {
+                *token = literals << 4;
+            }
+            memcpy(dst + op, src + anchor, literals);
+            op += literals;
+            uint16_t offset = ip - ref;
+            dst[op++] = offset & 0xff;
+            dst[op++] = offset >> 8;
+            size_t extra = matchLen - MIN_MATCH;
+            if (extra >= 15)
+            {
+                *token |= 15;
+                op += putLength(dst + op, extra - 15);
+            }
+            else
+            {
+                *token |= extra;
+            }
+
+            ip += matchLen;
+            anchor = ip;
+        }
+    }
+
+    // The rest goes out as literals
+    size_t literals = len - anchor;
+    if (op + 1 + literals / 255 + 1 + literals > capacity)
+        return 0;
+    if (literals >= 15)
+    {
+        dst[op++] = 15 << 4;
+        op += putLength(dst + op, literals - 15);
+    }
+    else
+    {
+        dst[op++] = literals << 4;
+    }
+    memcpy(dst + op, src + anchor, literals);
+    return op + literals;
+}
+
+size_t FrameCompressor::decode(const char *source, size_t len, char *dest, size_t capacity)
+{
+    const unsigned char *src = reinterpret_cast<const unsigned char *>(source);
+    unsigned char *dst = reinterpret_cast<unsigned char *>(dest);
+    size_t ip = 0, op = 0;
+    while (ip < len)
+    {
+        unsigned char token = src[ip++];
+
+        size_t literals = token >> 4;
+        if (literals == 15)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= len)
+                    return 0;
+                b = src[ip++];
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > len - ip || literals > capacity - op)
+            return 0;
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        // The last sequence has no match
+        if (ip == len)
+            return op;
+
+        if (len - ip < 2)
+            return 0;
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op)
+            return 0;
+        size_t matchLen = token & 0x0f;
+        if (matchLen == 15)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= len)
+                    return 0;
+                b = src[ip++];
+                matchLen += b;
+            } while (b == 255);
+        }
+        matchLen += MIN_MATCH;
+        if (matchLen > capacity - op)
+            return 0;
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t i = 0; i < matchLen; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "Frame.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Per-frame compression for the tunnel (FRAME_COMPRESSED), in the LZ4 block format:
+// greedy matching with a small hash table, fast enough to run on every packet.
+// Packets that look already compressed or encrypted are skipped after a cheap check
+// of their protocol, payload prefix and byte variety, before any compression work.
+// One instance per thread: it owns the scratch buffers.
+class FrameCompressor {
+public:
+    // Smaller packets are mostly headers and rarely shrink
+    static constexpr size_t MIN_PACKET_SIZE = 128;
+
+    FrameCompressor();
+
+    // Compresses a frame payload (header, e.g. a GsoFrameHeader, followed by the packet)
+    // into a FRAME_COMPRESSED payload. Returns false when the packet looks incompressible
+    // or would not shrink by at least 1/16; the frame is then sent as it is.
+    bool compress(const char* header, size_t headerLen, const char* packet, size_t len,
+                  const char*& out, size_t& outLen);
+
+    // Restores the original payload of a FRAME_COMPRESSED frame; false if it is malformed.
+    // The result stays valid until the next call.
+    bool decompress(const char* payload, size_t len, char*& out, size_t& outLen);
+
+    // Cheap guess whether an IP packet's payload is worth compressing
+    static bool looksCompressible(const char* packet, size_t len);
+
+private:
+    // LZ4 block encoder; returns the compressed size, or 0 if it would exceed capacity
+    size_t encode(const char* src, size_t len, char* dst, size_t capacity);
+    // LZ4 block decoder; returns the decoded size, or 0 if the block is malformed
+    static size_t decode(const char* src, size_t len, char* dst, size_t capacity);
+
+    static constexpr int HASH_BITS = 12;
+    uint16_t table_[1 << HASH_BITS];  // Last position of each 4-byte sequence's hash
+    std::vector<char> input_;         // Header and packet joined, when there is a header
+    std::vector<char> output_;        // Compressed frame payload
+    std::vector<char> restored_;      // Decompressed payload
+};
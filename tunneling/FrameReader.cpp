@@ -0,0 +1,61 @@
+#include "FrameReader.hpp"
+#include <arpa/inet.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+FrameReader::FrameReader(size_t maxFrame, size_t capacity)
+    : maxFrame_(maxFrame), head_(0), tail_(0), corrupt_(false)
+{
+    // Room for a partial maximum-size frame plus a full frame behind it
+    buffer_.resize(max(capacity, 2 * (FRAME_HEADER_SIZE + maxFrame)));
+}
+
+char *FrameReader::space()
+{
+    if (head_ == tail_)
+    {
+        // Everything was consumed: start over at the front for free
+        head_ = tail_ = 0;
+    }
+    else if (buffer_.size() - tail_ < FRAME_HEADER_SIZE + maxFrame_)
+    {
+        // The tail is too short for a whole frame: move the partial frame to the front.
+        // It is shorter than one frame, so this copy is rare and small.
+        memmove(buffer_.data(), buffer_.data() + head_, tail_ - head_);
+        tail_ -= head_;
+        head_ = 0;
+    }
+    return buffer_.data() + tail_;
+}
+
+bool FrameReader::next(char *&payload, size_t &len)
+{
+    if (!peek(payload, len))
+        return false;
+    head_ += FRAME_HEADER_SIZE + len;
+    return true;
+}
+
+bool FrameReader::peek(char *&payload, size_t &len)
+{
+    if (corrupt_ || tail_ - head_ < FRAME_HEADER_SIZE)
+        return false;
+
+    // Length prefix in network byte order
+    uint16_t plength;
+    memcpy(&plength, buffer_.data() + head_, sizeof(plength));
+    size_t frameLen = ntohs(plength);
+    if (frameLen == 0 || frameLen > maxFrame_)
+    {
+        corrupt_ = true;
+        return false;
+    }
+    if (tail_ - head_ < FRAME_HEADER_SIZE + frameLen)
+        return false;
+
+    payload = buffer_.data() + head_ + FRAME_HEADER_SIZE;
+    len = frameLen;
+    return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "Frame.hpp"
+#include <vector>
+#include <cstddef>
+
+// Receive side of FrameBatcher: the owner reads whole chunks (a full TLS record per
+// Tunnel::receive) into space() and next() then parses every complete length-prefixed
+// frame in place. A trailing partial frame stays buffered until the rest arrives.
+class FrameReader {
+public:
+    // Several TLS records' worth of plaintext
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;
+
+    // maxFrame is the largest payload accepted; longer length prefixes mark the stream corrupt
+    explicit FrameReader(size_t maxFrame, size_t capacity = DEFAULT_CAPACITY);
+
+    // Where the next receive goes. Calling it invalidates payloads returned by next():
+    // the partial frame may be moved to the front.
+    char* space();
+    // How much the next receive may write; only valid after space()
+    size_t spaceSize() const { return buffer_.size() - tail_; }
+
+    // Accounts for n bytes written into space()
+    void commit(size_t n) { tail_ += n; }
+
+    // Returns the next complete frame's payload; false when none is buffered or the
+    // stream is corrupt (check corrupt())
+    bool next(char*& payload, size_t& len);
+    // Like next(), but the frame stays buffered for the next call
+    bool peek(char*& payload, size_t& len);
+
+    bool corrupt() const { return corrupt_; }
+    // Drops everything buffered, e.g. the partial frame of a connection that broke
+    void reset() { head_ = tail_ = 0; corrupt_ = false; }
+    size_t buffered() const { return tail_ - head_; }
+
+private:
+    size_t maxFrame_;           // Largest accepted payload
+    std::vector<char> buffer_;  // Received bytes, parsed from head_ to tail_
+    size_t head_;               // Start of the first unparsed frame
+    size_t tail_;               // End of the received bytes
+    bool corrupt_;              // A length prefix was 0 or above maxFrame_
+};
@@ -1,28 +1,196 @@
 #include "Tunnel.hpp"
+#include "Frame.hpp"
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <resolv.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <openssl/err.h>
+#include <openssl/core_names.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include <iostream>
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <ctime>
 using namespace std;
 
 string Tunnel::certificatePath = "../certs/server.crt";
 string Tunnel::privateKeyPath = "../certs/server.key";
+bool Tunnel::kernelTls = false;
+int Tunnel::ticketRotation = Tunnel::DEFAULT_TICKET_ROTATION;
+CipherPolicy Tunnel::cipherPolicy;
 
-Tunnel::Tunnel()
+// DTLS cookies: an HMAC of the client's address under a per-process secret, so the
+// server keeps no state for a client until it proves it receives at that address
+static unsigned char cookie_secret[32];
+static bool cookie_secret_ready = false;
+
+static bool make_cookie(SSL *ssl, unsigned char *cookie, unsigned int *cookie_len)
+{
+    if (!cookie_secret_ready)
+    {
+        if (RAND_bytes(cookie_secret, sizeof(cookie_secret)) != 1)
+            return false;
+        cookie_secret_ready = true;
+    }
+
+    BIO_ADDR *peer = BIO_ADDR_new();
+    if (!peer || BIO_dgram_get_peer(SSL_get_rbio(ssl), peer) <= 0)
+    {
+        BIO_ADDR_free(peer);
+        return false;
+    }
+    unsigned char data[sizeof(struct in6_addr) + sizeof(unsigned short)];
+    size_t len = 0;
+    BIO_ADDR_rawaddress(peer, data, &len);
+    unsigned short port = BIO_ADDR_rawport(peer);
+    memcpy(data + len, &port, sizeof(port));
+    len += sizeof(port);
+    BIO_ADDR_free(peer);
+
+    return HMAC(EVP_sha256(), cookie_secret, sizeof(cookie_secret), data, len, cookie, cookie_len) != nullptr;
+}
+
+static int generate_cookie(SSL *ssl, unsigned char *cookie, unsigned int *cookie_len)
+{
+    return make_cookie(ssl, cookie, cookie_len) ? 1 : 0;
+}
+
+static int verify_cookie(SSL *ssl, const unsigned char *cookie, unsigned int cookie_len)
+{
+    unsigned char expected[EVP_MAX_MD_SIZE];
+    unsigned int expected_len;
+    return make_cookie(ssl, expected, &expected_len) && cookie_len == expected_len &&
+           CRYPTO_memcmp(cookie, expected, expected_len) == 0;
+}
+
+// Session ticket keys shared by every server context, so any session can resume a ticket
+// another one issued. Tickets are sealed with the current key; the previous one still
+// opens tickets issued before the last rotation.
+struct TicketKey
+{
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+    time_t created;
+    time_t retired; // When a newer key replaced it
+};
+static mutex ticket_lock;
+static TicketKey ticket_keys[2]; // [0] current, [1] previous
+static int ticket_key_count = 0;
+
+static bool new_ticket_key(TicketKey &key)
+{
+    key.created = time(nullptr);
+    key.retired = 0;
+    return RAND_bytes(key.name, sizeof(key.name)) == 1 &&
+           RAND_bytes(key.aes, sizeof(key.aes)) == 1 &&
+           RAND_bytes(key.hmac, sizeof(key.hmac)) == 1;
+}
+
+static bool use_ticket_key(const TicketKey &key, unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc)
+{
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void *)key.hmac, sizeof(key.hmac)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+    if (!EVP_MAC_CTX_set_params(mac, params))
+        return false;
+    if (enc)
+        return EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes, iv) == 1;
+    return EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes, iv) == 1;
+}
+
+int Tunnel::ticket_key_callback(SSL *, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher,
+                                EVP_MAC_CTX *mac, int enc)
+{
+    lock_guard<mutex> guard(ticket_lock);
+    time_t now = time(nullptr);
+    // The previous key is dropped once every ticket it sealed has expired. Rotation happens
+    // on the first ticket issued after the key's time is up, which may be much later, so
+    // the last of those tickets dates from its retirement, not its creation
+    if (ticket_key_count == 2 && now - ticket_keys[1].retired >= ticketRotation)
+        ticket_key_count = 1;
+
+    if (enc)
+    {
+        if (ticket_key_count == 0 || now - ticket_keys[0].created >= ticketRotation)
+        {
+            TicketKey key;
+            if (!new_ticket_key(key))
+                return -1;
+            if (ticket_key_count > 0)
+            {
+                ticket_keys[1] = ticket_keys[0];
+                ticket_keys[1].retired = now;
+            }
+            ticket_keys[0] = key;
+            ticket_key_count = min(ticket_key_count + 1, 2);
+        }
+        memcpy(name, ticket_keys[0].name, sizeof(ticket_keys[0].name));
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1)
+            return -1;
+        return use_ticket_key(ticket_keys[0], iv, cipher, mac, enc) ? 1 : -1;
+    }
+
+    for (int i = 0; i < ticket_key_count; i++)
+    {
+        if (memcmp(name, ticket_keys[i].name, sizeof(ticket_keys[i].name)) != 0)
+            continue;
+        if (!use_ticket_key(ticket_keys[i], iv, cipher, mac, enc))
+            return -1;
+        // 2 asks OpenSSL for a fresh ticket under the current key: TLS 1.3 clients use a
+        // ticket only once, so without one the connection after next is a full handshake
+        return 2;
+    }
+    return 0; // Unknown or expired key: fall back to a full handshake
+}
+
+// Client session cache: the latest resumable session per server, so a reconnect after
+// a restart or a dropped link costs one round trip and no key exchange on the server
+static mutex session_lock;
+static map<string, SSL_SESSION *> client_sessions;
+
+int Tunnel::remember_session(SSL *ssl, SSL_SESSION *session)
+{
+    Tunnel *tunnel = static_cast<Tunnel *>(SSL_get_app_data(ssl));
+    if (!tunnel || !SSL_SESSION_is_resumable(session))
+        return 0;
+
+    lock_guard<mutex> guard(session_lock);
+    SSL_SESSION *&slot = client_sessions[tunnel->session_key];
+    if (slot)
+        SSL_SESSION_free(slot);
+    slot = session;
+    return 1; // The cache keeps the reference OpenSSL handed over
+}
+
+// One context per transport ([0] TLS, [1] DTLS), built on first use and shared by every
+// tunnel; reloadCertificates() replaces them
+static mutex context_lock;
+static SSL_CTX *shared_contexts[2] = {nullptr, nullptr};
+
+Tunnel::Tunnel(bool datagram) : datagram(datagram)
 {
     ctx = NULL;
     ssl = NULL;
     socket_fd = -1;
     connected = false;
-
-    // Initialize OpenSSL library components
-    SSL_library_init();
-    OpenSSL_add_all_algorithms(); // Load crypto algorithms
-    SSL_load_error_strings();     // Load SSL error messages
+    ktls_tx = ktls_rx = false;
+    send_head = send_tail = send_retry = 0;
+    send_wait = receive_wait = handshake_wait = WAIT_NONE;
+
+    // Initialize OpenSSL library components once per process
+    static once_flag openssl_ready;
+    call_once(openssl_ready, []
+              { OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, nullptr); });
 }
 
 Tunnel::~Tunnel()
@@ -30,32 +198,81 @@ Tunnel::~Tunnel()
     disconnect();
 }
 
-bool Tunnel::init_ssl_ctx()
+void Tunnel::setCertificatePaths(const string &certPath, const string &keyPath)
+{
+    certificatePath = certPath;
+    privateKeyPath = keyPath;
+}
+
+void Tunnel::setKernelTls(bool enable)
+{
+    kernelTls = enable;
+}
+
+void Tunnel::setCipherPolicy(const CipherPolicy &policy)
+{
+    cipherPolicy = policy;
+}
+
+void Tunnel::setTicketRotation(int seconds)
+{
+    ticketRotation = seconds;
+}
+
+SSL_CTX *Tunnel::build_context(bool datagram)
 {
     // TLS_method() provides the most up-to-date TLS version negotiation
-    const SSL_METHOD *method = TLS_method();
-    ctx = SSL_CTX_new(method);
+    const SSL_METHOD *method = datagram ? DTLS_method() : TLS_method();
+    SSL_CTX *ctx = SSL_CTX_new(method);
 
     if (!ctx)
     {
         cerr << "Failed to create SSL context" << endl;
         ERR_print_errors_fp(stderr);
-        return false;
+        return nullptr;
     }
 
     // Disable outdated and insecure SSL versions
     SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-    // Enable automatic retry on interrupted operations
-    SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
+    // Enable automatic retry on interrupted operations; the send queue may be compacted
+    // between a WANT_WRITE and the retry of the same SSL_write
+    SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     // Disable certificate verification for testing (should be enabled in production)
     SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+    if (!cipherPolicy.apply(ctx))
+    {
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    // Let OpenSSL install the session keys into the kernel after the handshake when the
+    // kernel supports the negotiated cipher; otherwise records stay in user space
+    if (kernelTls && !datagram)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    // Session resumption: sessions are sealed into tickets under the shared rotating keys
+    // (only servers issue them, so this is a no-op for clients)
+    if (ticketRotation > 0)
+    {
+        SSL_CTX_set_timeout(ctx, ticketRotation);
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_callback);
+    }
+    else
+    {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+    // Stateless cookie exchange before a DTLS server commits any state to a client
+    if (datagram)
+    {
+        SSL_CTX_set_cookie_generate_cb(ctx, generate_cookie);
+        SSL_CTX_set_cookie_verify_cb(ctx, verify_cookie);
+    }
 
     // Load the server's public certificate from file
     if (SSL_CTX_use_certificate_file(ctx, certificatePath.c_str(), SSL_FILETYPE_PEM) <= 0)
     {
         cerr << "Failed to load certificate. Error: " << endl;
         ERR_print_errors_fp(stderr);
-        return false;
+        SSL_CTX_free(ctx);
+        return nullptr;
     }
 
     // Load the server's private key used for encryption
@@ -63,7 +280,8 @@ bool Tunnel::init_ssl_ctx()
     {
         cerr << "Failed to load private key. Error: " << endl;
         ERR_print_errors_fp(stderr);
-        return false;
+        SSL_CTX_free(ctx);
+        return nullptr;
     }
 
     // Verify the private key matches the certificate
@@ -71,28 +289,89 @@ bool Tunnel::init_ssl_ctx()
     {
         cerr << "Private key verification failed. Error: " << endl;
         ERR_print_errors_fp(stderr);
-        return false;
+        SSL_CTX_free(ctx);
+        return nullptr;
     }
 
+    // File the tickets a server issues under its address, for the next connection
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, remember_session);
+
     cout << "SSL context initialized successfully" << endl;
+    return ctx;
+}
+
+bool Tunnel::init_ssl_ctx()
+{
+    // A retried connect() drops its reference to the context it used before
+    if (ctx)
+        SSL_CTX_free(ctx);
+    ctx = nullptr;
+
+    lock_guard<mutex> guard(context_lock);
+    SSL_CTX *&shared = shared_contexts[datagram];
+    if (!shared)
+        shared = build_context(datagram);
+    if (!shared)
+        return false;
+    // The tunnel keeps its own reference, so a reload does not pull the context from under it
+    SSL_CTX_up_ref(shared);
+    ctx = shared;
+    return true;
+}
+
+bool Tunnel::reloadCertificates()
+{
+    // Build outside the lock: handshakes keep using the old contexts meanwhile
+    SSL_CTX *fresh[2] = {nullptr, nullptr};
+    bool ok = true;
+    for (int kind = 0; kind < 2 && ok; kind++)
+    {
+        {
+            lock_guard<mutex> guard(context_lock);
+            if (!shared_contexts[kind])
+                continue;
+        }
+        fresh[kind] = build_context(kind == 1);
+        ok = fresh[kind] != nullptr;
+    }
+    if (!ok)
+    {
+        for (SSL_CTX *built : fresh)
+            SSL_CTX_free(built);
+        return false;
+    }
+
+    // Swap both in at once; live sessions hold references to the contexts they started with
+    lock_guard<mutex> guard(context_lock);
+    for (int kind = 0; kind < 2; kind++)
+    {
+        if (!fresh[kind])
+            continue;
+        SSL_CTX_free(shared_contexts[kind]);
+        shared_contexts[kind] = fresh[kind];
+    }
     return true;
 }
 
 // Establishes TCP connection to remote host
+// Bounds blocking socket calls (connect, send, receive) to ms milliseconds; 0 lifts the bound
+static void set_socket_timeout(int fd, int ms)
+{
+    struct timeval timeout = {ms / 1000, (ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
 bool Tunnel::open_connection(const string &hostname, const string &port)
 {
     // Initialize address info structure for IPv4/IPv6 compatibility
     struct addrinfo hints = {}, *addrs;
     hints.ai_family = AF_UNSPEC;     // Allow IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
-    hints.ai_protocol = IPPROTO_TCP; // TCP protocol
-    cout << AF_UNSPEC << endl
-         << SOCK_STREAM << endl
-         << IPPROTO_TCP << endl;
-    cout << hostname << port << endl;
+    hints.ai_socktype = datagram ? SOCK_DGRAM : SOCK_STREAM; // TCP stream or UDP datagram sockets
+    hints.ai_protocol = datagram ? IPPROTO_UDP : IPPROTO_TCP;
     // Resolve hostname and port to IP addresses
     int status = getaddrinfo(hostname.c_str(), port.c_str(), &hints, &addrs);
-    cout << status << endl;
     if (status != 0)
     {
         cerr << "getaddrinfo error: " << gai_strerror(status) << endl;
@@ -100,24 +379,29 @@ bool Tunnel::open_connection(const string &hostname, const string &port)
     }
 
     // Try each address until we successfully connect
-    // for (struct addrinfo *addr = addrs; addr != nullptr; addr = addr->ai_next)
-    // {
-    // Create a new socket
-    socket_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-    if (socket_fd < 0)
-        continue;
+    for (struct addrinfo *addr = addrs; addr != nullptr; addr = addr->ai_next)
+    {
+        // Create a new socket
+        socket_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (socket_fd < 0)
+            continue;
+        set_socket_timeout(socket_fd, CONNECT_TIMEOUT_MS);
+
+        // Attempt to establish TCP connection
+        if (::connect(socket_fd, addr->ai_addr, addr->ai_addrlen) == 0)
+        { // Added :: to use global connect
+            // Frames are already coalesced into records, so Nagle would only hold them back
+            int nodelay = 1;
+            if (!datagram)
+                setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            freeaddrinfo(addrs);
+            return true;
+        }
 
-    // Attempt to establish TCP connection
-    if (::connect(socket_fd, addr->ai_addr, addr->ai_addrlen) == 0)
-    { // Added :: to use global connect
-        freeaddrinfo(addrs);
-        return true;
+        close(socket_fd);
+        socket_fd = -1;
     }
 
-    close(socket_fd);
-    socket_fd = -1;
-    // }
-
     freeaddrinfo(addrs);
     return false;
 }
@@ -125,18 +409,78 @@ bool Tunnel::open_connection(const string &hostname, const string &port)
 // Creates secure SSL connection over established TCP connection
 bool Tunnel::connect(const string &hostname, const string &port)
 {
-    // First initialize SSL context with certificates and settings
-    if (!init_ssl_ctx())
-        return false;
-    cout << "SSL context initialized successfully" << endl
-         << endl;
-
     // Establish TCP connection to remote host
     if (!open_connection(hostname, port))
     {
         cerr << "Failed to connect to " << hostname << ":" << port << endl;
         return false;
     }
+    if (!connect_socket(socket_fd, hostname + ":" + port))
+        return false;
+    set_socket_timeout(socket_fd, 0);
+    return true;
+}
+
+bool Tunnel::connect_socket(int fd, const string &key)
+{
+    socket_fd = fd;
+    if (!prepare_client(key))
+        return false;
+
+    // Perform SSL/TLS handshake
+    if (SSL_connect(ssl) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+    client_connected();
+    return true;
+}
+
+bool Tunnel::start_connect(const string &hostname, const string &port)
+{
+    if (datagram)
+        return false;
+    struct addrinfo hints = {}, *addrs;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    int status = getaddrinfo(hostname.c_str(), port.c_str(), &hints, &addrs);
+    if (status != 0)
+    {
+        cerr << "getaddrinfo error: " << gai_strerror(status) << endl;
+        return false;
+    }
+
+    // The connect completes in the background; the handshake's first write waits for it
+    for (struct addrinfo *addr = addrs; addr != nullptr && socket_fd < 0; addr = addr->ai_next)
+    {
+        socket_fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK, addr->ai_protocol);
+        if (socket_fd < 0)
+            continue;
+        if (::connect(socket_fd, addr->ai_addr, addr->ai_addrlen) < 0 && errno != EINPROGRESS)
+        {
+            close(socket_fd);
+            socket_fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    if (socket_fd < 0)
+        return false;
+
+    int nodelay = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (!prepare_client(hostname + ":" + port))
+        return false;
+    SSL_set_connect_state(ssl);
+    return true;
+}
+
+bool Tunnel::prepare_client(const string &key)
+{
+    // Initialize SSL context with certificates and settings
+    if (!init_ssl_ctx())
+        return false;
 
     // Create new SSL structure for this connection
     ssl = SSL_new(ctx);
@@ -146,18 +490,45 @@ bool Tunnel::connect(const string &hostname, const string &port)
         return false;
     }
 
+    // Offer the session from the last connection to this server, if it left one
+    session_key = key;
+    SSL_set_app_data(ssl, this);
+    {
+        lock_guard<mutex> guard(session_lock);
+        auto cached = client_sessions.find(session_key);
+        if (cached != client_sessions.end())
+            SSL_set_session(ssl, cached->second);
+    }
+
     // Associate SSL structure with socket file descriptor
-    SSL_set_fd(ssl, socket_fd);
-    // Perform SSL/TLS handshake
-    if (SSL_connect(ssl) != 1)
+    if (datagram)
     {
-        ERR_print_errors_fp(stderr);
-        return false;
+        // The UDP socket is connected, so the datagram BIO only talks to the server
+        struct sockaddr_storage server;
+        socklen_t len = sizeof(server);
+        BIO *bio = BIO_new_dgram(socket_fd, BIO_NOCLOSE);
+        if (!bio || getpeername(socket_fd, (struct sockaddr *)&server, &len) < 0)
+        {
+            BIO_free(bio);
+            return false;
+        }
+        BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &server);
+        SSL_set_bio(ssl, bio, bio);
     }
+    else
+    {
+        SSL_set_fd(ssl, socket_fd);
+    }
+    return true;
+}
 
+void Tunnel::client_connected()
+{
     connected = true;
+    cout << (SSL_session_reused(ssl) ? "Resumed TLS session" : "Full TLS handshake") << " with "
+         << session_key << " using " << SSL_get_cipher_name(ssl) << endl;
+    detect_ktls();
     display_certificates();
-    return true;
 }
 
 bool Tunnel::listen(const string &port)
@@ -183,6 +554,13 @@ bool Tunnel::accept_client(int client_fd)
     // Store client socket descriptor
     socket_fd = client_fd;
 
+    // Take a reference to the current shared context without listen()'s setup output
+    if (!ctx && !init_ssl_ctx())
+    {
+        cerr << "SSL context initialization failed" << endl;
+        return false;
+    }
+
     // Create new SSL structure for this client
     ssl = SSL_new(ctx);
     if (!ssl)
@@ -191,18 +569,146 @@ bool Tunnel::accept_client(int client_fd)
         return false;
     }
 
-    // Associate SSL with client socket
+    // Associate SSL with client socket; the handshake itself runs in handshake()
     SSL_set_fd(ssl, socket_fd);
-    // Perform SSL/TLS handshake as server
-    if (SSL_accept(ssl) <= 0)
+    SSL_set_accept_state(ssl);
+    return true;
+}
+
+int Tunnel::handshake()
+{
+    int r = SSL_do_handshake(ssl);
+    if (r == 1)
     {
-        ERR_print_errors_fp(stderr);
-        return false;
+        handshake_wait = WAIT_NONE;
+        if (!SSL_is_server(ssl))
+        {
+            client_connected();
+            return 1;
+        }
+        connected = true;
+        detect_ktls();
+        display_certificates();
+        return 1;
     }
 
-    connected = true;
-    display_certificates();
-    return true;
+    int err = SSL_get_error(ssl, r);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        handshake_wait = err == SSL_ERROR_WANT_WRITE ? WAIT_WRITE : WAIT_READ;
+        return 0;
+    }
+    ERR_print_errors_fp(stderr);
+    return -1;
+}
+
+bool Tunnel::handshake_timer()
+{
+    return !datagram || connected || !ssl || DTLSv1_handle_timeout(ssl) >= 0;
+}
+
+int Tunnel::accept_datagram(int listen_fd, unique_ptr<Tunnel> &session, string &peer)
+{
+    // Listen on the shared socket until a client echoes a valid cookie. The SSL is made
+    // once per client that gets through, not once per datagram
+    if (!ssl)
+    {
+        ssl = SSL_new(ctx);
+        BIO *bio = BIO_new_dgram(listen_fd, BIO_NOCLOSE);
+        if (!ssl || !bio)
+        {
+            BIO_free(bio);
+            SSL_free(ssl);
+            ssl = nullptr;
+            return -1;
+        }
+        SSL_set_bio(ssl, bio, bio);
+        SSL_set_options(ssl, SSL_OP_COOKIE_EXCHANGE);
+    }
+    BIO_ADDR *client = BIO_ADDR_new();
+    if (!client)
+        return -1;
+
+    int r = DTLSv1_listen(ssl, client);
+    if (r <= 0)
+    {
+        // A hello without a cookie was answered with HelloVerifyRequest (or the datagram
+        // was not a hello at all); nothing is kept for that address
+        BIO_ADDR_free(client);
+        if (r == 0)
+            return 0;
+        SSL_free(ssl);
+        ssl = nullptr;
+        return -1;
+    }
+
+    // The listening SSL now holds this client's handshake and goes with it. Its tunnel takes
+    // the current shared context, so a reloaded certificate applies from the next client on
+    session = make_unique<Tunnel>(true);
+    SSL *accepted = ssl;
+    ssl = nullptr;
+    session->ssl = accepted;
+    if (!session->init_ssl_ctx())
+    {
+        BIO_ADDR_free(client);
+        return -1;
+    }
+    SSL_set_SSL_CTX(accepted, session->ctx);
+    r = session->connect_datagram(listen_fd, client, peer);
+    BIO_ADDR_free(client);
+    return r;
+}
+
+int Tunnel::connect_datagram(int listen_fd, const BIO_ADDR *client, string &peer)
+{
+    // Give the client its own socket: bound to the server port and connected to the
+    // client, so the kernel delivers that client's datagrams to it rather than listen_fd
+    union
+    {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+        struct sockaddr_storage storage;
+    } local, remote;
+    socklen_t local_len = sizeof(local);
+    memset(&remote, 0, sizeof(remote));
+    int family = BIO_ADDR_family(client);
+    socklen_t remote_len;
+    char host[INET6_ADDRSTRLEN] = "";
+    if (family == AF_INET)
+    {
+        remote.in.sin_family = AF_INET;
+        remote.in.sin_port = BIO_ADDR_rawport(client);
+        BIO_ADDR_rawaddress(client, &remote.in.sin_addr, nullptr);
+        inet_ntop(AF_INET, &remote.in.sin_addr, host, sizeof(host));
+        remote_len = sizeof(remote.in);
+    }
+    else
+    {
+        remote.in6.sin6_family = AF_INET6;
+        remote.in6.sin6_port = BIO_ADDR_rawport(client);
+        BIO_ADDR_rawaddress(client, &remote.in6.sin6_addr, nullptr);
+        inet_ntop(AF_INET6, &remote.in6.sin6_addr, host, sizeof(host));
+        remote_len = sizeof(remote.in6);
+    }
+    peer = string(host) + ":" + to_string(ntohs(BIO_ADDR_rawport(client)));
+
+    int optval = 1;
+    socket_fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0 ||
+        setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ||
+        getsockname(listen_fd, &local.sa, &local_len) < 0 ||
+        ::bind(socket_fd, &local.sa, local_len) < 0 ||
+        ::connect(socket_fd, &remote.sa, remote_len) < 0)
+    {
+        cerr << "Failed to create socket for " << peer << ": " << strerror(errno) << endl;
+        return -1;
+    }
+
+    // The rest of the handshake runs on the new socket
+    BIO_set_fd(SSL_get_rbio(ssl), socket_fd, BIO_NOCLOSE);
+    BIO_ctrl(SSL_get_rbio(ssl), BIO_CTRL_DGRAM_SET_CONNECTED, 0, const_cast<BIO_ADDR *>(client));
+    return 1;
 }
 
 void Tunnel::disconnect()
@@ -229,6 +735,21 @@ void Tunnel::disconnect()
         ctx = nullptr;
     }
     connected = false;
+    ktls_tx = ktls_rx = false;
+    send_head = send_tail = send_retry = 0;
+    send_wait = receive_wait = handshake_wait = WAIT_NONE;
+}
+
+void Tunnel::detect_ktls()
+{
+    ktls_tx = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    if (kernelTls && !datagram)
+    {
+        cout << "kTLS with " << SSL_get_version(ssl) << " " << SSL_get_cipher_name(ssl)
+             << ": send in " << (ktls_tx ? "kernel" : "user space")
+             << ", receive in " << (ktls_rx ? "kernel" : "user space") << endl;
+    }
 }
 
 void Tunnel::display_certificates()
@@ -249,16 +770,175 @@ void Tunnel::display_certificates()
     }
 }
 
+bool Tunnel::set_nonblocking(bool enable)
+{
+    int flags = fcntl(socket_fd, F_GETFL, 0);
+    if (flags < 0)
+        return false;
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(socket_fd, F_SETFL, flags) == 0;
+}
+
+bool Tunnel::set_unsent_limit(int bytes)
+{
+    if (datagram)
+        return true;
+    return setsockopt(socket_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) == 0;
+}
+
 ssize_t Tunnel::send(const void *data, size_t length)
 {
     if (!connected || !ssl)
         return -1;
-    return SSL_write(ssl, data, length);
+
+    while (true)
+    {
+        int n = SSL_write(ssl, data, length);
+        if (n > 0)
+            return n;
+
+        // On a non-blocking socket wait until the record can be flushed and
+        // retry with the same arguments, as OpenSSL requires
+        int err = SSL_get_error(ssl, n);
+        if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ)
+            return n;
+
+        struct pollfd pfd = {socket_fd, (short)(err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN), 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+    }
 }
 
 ssize_t Tunnel::receive(void *buffer, size_t length)
 {
     if (!connected || !ssl)
         return -1;
-    return SSL_read(ssl, buffer, length);
-}
\ No newline at end of file
+
+    receive_wait = WAIT_NONE;
+    if (datagram)
+    {
+        // One record is one frame: rebuild the length prefix the caller parses
+        if (length <= FRAME_HEADER_SIZE)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        char *frame = static_cast<char *>(buffer);
+        int n = SSL_read(ssl, frame + FRAME_HEADER_SIZE, min(length - FRAME_HEADER_SIZE, (size_t)UINT16_MAX));
+        if (n > 0)
+        {
+            uint16_t plength = htons(n);
+            memcpy(frame, &plength, sizeof(plength));
+            return n + FRAME_HEADER_SIZE;
+        }
+        return receive_failed(n);
+    }
+
+    int n = SSL_read(ssl, buffer, length);
+    if (n > 0)
+        return n;
+    return receive_failed(n);
+}
+
+ssize_t Tunnel::receive_failed(int n)
+{
+    // Report "no complete record yet" like a non-blocking read() would
+    int err = SSL_get_error(ssl, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        // A read can need the socket writable, e.g. to answer a TLS 1.3 key update
+        if (err == SSL_ERROR_WANT_WRITE)
+            receive_wait = WAIT_WRITE;
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    return n;
+}
+
+void Tunnel::enqueue(const void *data, size_t length)
+{
+    if (send_head == send_tail)
+    {
+        // Empty queue: start over at the front
+        send_head = send_tail = 0;
+    }
+    else if (send_buffer.size() - send_tail < length && send_head > 0)
+    {
+        // Reclaim the space already written out before growing the buffer
+        memmove(send_buffer.data(), send_buffer.data() + send_head, send_tail - send_head);
+        send_tail -= send_head;
+        send_head = 0;
+    }
+    if (send_buffer.size() - send_tail < length)
+        send_buffer.resize(send_tail + length);
+
+    memcpy(send_buffer.data() + send_tail, data, length);
+    send_tail += length;
+}
+
+int Tunnel::flush()
+{
+    if (!connected || !ssl)
+        return -1;
+
+    while (queued() > 0)
+    {
+        const char *data = send_buffer.data() + send_head;
+        size_t length, prefix = 0;
+        if (datagram)
+        {
+            // One frame per record and datagram; the datagram boundary replaces the length prefix
+            uint16_t plength;
+            memcpy(&plength, data, sizeof(plength));
+            prefix = FRAME_HEADER_SIZE;
+            length = ntohs(plength);
+        }
+        else if (ktls_tx)
+        {
+            // The kernel frames and encrypts: plain bytes go straight to the socket without
+            // being staged in OpenSSL's record buffer, and partial writes are fine
+            ssize_t n = ::send(socket_fd, data, queued(), MSG_NOSIGNAL);
+            if (n >= 0)
+            {
+                send_head += n;
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                send_wait = WAIT_WRITE;
+                return 0;
+            }
+            return -1;
+        }
+        else
+        {
+            // A write that hit WANT_* must be repeated with the same length
+            length = send_retry ? send_retry : queued();
+        }
+        int n = SSL_write(ssl, data + prefix, length);
+        if (n > 0)
+        {
+            send_head += prefix + n;
+            send_retry = 0;
+            send_wait = WAIT_NONE;
+            continue;
+        }
+
+        int err = SSL_get_error(ssl, n);
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+        {
+            send_retry = length;
+            send_wait = err == SSL_ERROR_WANT_WRITE ? WAIT_WRITE : WAIT_READ;
+            return 0;
+        }
+        return -1;
+    }
+
+    send_head = send_tail = 0;
+    send_wait = WAIT_NONE;
+    return 1;
+}
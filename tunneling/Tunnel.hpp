@@ -2,35 +2,125 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 #include <openssl/ssl.h>
+#include "CipherPolicy.hpp"
 using namespace std;
 
-// Tunnel class: Handles secure SSL/TLS communication between endpoints
+// Tunnel class: Handles secure SSL/TLS communication between endpoints.
+// In datagram mode it runs DTLS over UDP instead and keeps the same interface: the
+// caller still sends and receives length-prefixed frames, but each frame travels as
+// its own DTLS record in its own datagram, so a lost datagram loses only that packet.
 class Tunnel
 {
 public:
-    Tunnel();
+    explicit Tunnel(bool datagram = false);
     ~Tunnel();
 
     bool connect(const string &hostname, const string &port);
 
+    // Runs the client handshake over an already connected socket, which the tunnel then
+    // owns. key names the server in the session cache.
+    bool connect_socket(int fd, const string &key);
+
+    // Client, TCP only: starts connecting on a non-blocking socket, for a caller running an
+    // event loop of its own; handshake() then drives the connection and the handshake.
+    // Only the first address the name resolves to is tried
+    bool start_connect(const string &hostname, const string &port);
+
     bool listen(const string &port);
 
-    // Accepts an incoming client connection and establishes SSL
+    // Takes an accepted, non-blocking client socket and prepares the server side of the
+    // handshake; handshake() then runs it
 
     bool accept_client(int client_fd);
 
+    // Datagram mode, on the listening tunnel: handles one datagram queued on the shared server
+    // socket. The cookie exchange keeps nothing per client; it runs on one SSL the listener
+    // reuses. Returns 1 when a client proved its address with a valid cookie: it gets that
+    // SSL in a tunnel of its own (session), whose handshake continues through handshake() on a
+    // non-blocking socket connected to the client. Returns 0 when the datagram was a cookie
+    // exchange or junk, -1 on failure. peer is set to the client address.
+    int accept_datagram(int listen_fd, unique_ptr<Tunnel> &session, string &peer);
+
+    // Advances a server handshake, or a client's from start_connect(), without blocking:
+    // 1 once it completed, 0 while it waits for the socket (either direction, so watch
+    // both, or see handshake_wants_write()), -1 when it failed
+    int handshake();
+    // The handshake waits for the socket to become writable rather than readable
+    bool handshake_wants_write() const { return handshake_wait == WAIT_WRITE; }
+
+    // Datagram mode: retransmits the last handshake flight if its timer ran out (a lost
+    // datagram). Returns false if the handshake gave up.
+    bool handshake_timer();
+
+    bool is_datagram() const { return datagram; }
+
+    // Record encryption directions the kernel took over after the handshake (kTLS).
+    // Both stay false when kTLS is off, or the kernel or negotiated cipher cannot do it.
+    bool ktls_send() const { return ktls_tx; }
+    bool ktls_receive() const { return ktls_rx; }
+
+    // Negotiated cipher suite, e.g. for log messages
+    const char *cipher() const { return ssl ? SSL_get_cipher_name(ssl) : ""; }
+
+    // The handshake resumed an earlier session from a ticket instead of a full key exchange
+    bool session_reused() const { return ssl && SSL_session_reused(ssl); }
+
     // Returns the underlying socket file descriptor
     int get_socket_fd() const { return socket_fd; }
 
-    // Sends data through the secure tunnel
+    // Inner MTU for datagram mode: a full packet plus DTLS, UDP and outer IPv6 headers
+    // still fits a 1500-byte path without fragmentation
+    static constexpr int DATAGRAM_MTU = 1420;
+
+    // Default lifetime of a session ticket encryption key before the server rotates it
+    static constexpr int DEFAULT_TICKET_ROTATION = 3600;
+
+    // Soft limit on bytes waiting in the send queue before send_queue_full() reports backpressure
+    static constexpr size_t SEND_QUEUE_LIMIT = 256 * 1024;
+
+    // Longest a client waits for the server to answer while connecting and during the
+    // handshake, instead of the kernel's minutes of SYN retries for an unreachable server
+    static constexpr int CONNECT_TIMEOUT_MS = 5000;
+
+    // Sends data through the secure tunnel, waiting for the socket if it is non-blocking
 
     ssize_t send(const void *data, size_t length);
 
-    // Receives data from the secure tunnel
+    // Non-blocking send path: enqueue() only copies into the send queue (in datagram mode
+    // it must hold whole length-prefixed frames, each of which becomes one datagram), flush() writes
+    // as much of it as the socket takes. flush() returns 1 when the queue is empty,
+    // 0 when OpenSSL is waiting for the socket (see wants_write()), -1 on error.
+    void enqueue(const void *data, size_t length);
+    int flush();
+
+    // Bytes waiting in the send queue
+    size_t queued() const { return send_tail - send_head; }
+    // The owner should stop producing data for this tunnel until flush() catches up
+    bool send_queue_full() const { return queued() >= SEND_QUEUE_LIMIT; }
+    // The owner must watch the socket for writability and then call flush()/receive()
+    bool wants_write() const { return (queued() > 0 && send_wait != WAIT_READ) || receive_wait == WAIT_WRITE; }
+    // A queued write is waiting for the socket to become readable: call flush() on readability
+    bool write_wants_read() const { return queued() > 0 && send_wait == WAIT_READ; }
+    // receive() is waiting for the socket to become writable: call it again on writability
+    bool read_wants_write() const { return receive_wait == WAIT_WRITE; }
 
+    // Receives data from the secure tunnel
+    // On a non-blocking socket returns -1 with errno == EAGAIN when no record is ready
     ssize_t receive(void *buffer, size_t length);
 
+    // Bytes already decrypted and buffered inside OpenSSL (invisible to select/epoll)
+    size_t pending() const { return ssl ? SSL_pending(ssl) : 0; }
+
+    // Switches the underlying socket between blocking and non-blocking mode
+    bool set_nonblocking(bool enable);
+
+    // TCP: caps the bytes the kernel holds unsent for the socket (TCP_NOTSENT_LOWAT), so
+    // writes beyond that wait and the backlog builds up in front of the tunnel instead.
+    // Nothing to do in datagram mode
+    bool set_unsent_limit(int bytes);
+
     // Checks if the tunnel is currently connected
     bool is_connected() const { return connected; }
 
@@ -43,19 +133,67 @@ public:
     // Static method to set certificate paths globally
     static void setCertificatePaths(const string &certPath, const string &keyPath);
 
+    // Static method to request kernel TLS offload for TCP tunnels created afterwards
+    static void setKernelTls(bool enable);
+
+    // Cipher suites and groups for SSL contexts built afterwards (see reloadCertificates)
+    static void setCipherPolicy(const CipherPolicy &policy);
+
+    // Rebuilds the shared SSL contexts from the certificate and key files (e.g. after they
+    // were renewed). New handshakes use the new contexts; live sessions keep their own.
+    // On failure the old contexts stay in place.
+    static bool reloadCertificates();
+
+    // Server: seconds between session ticket key rotations. Tickets stay valid for one more
+    // period under the previous key; 0 turns session tickets off.
+    static void setTicketRotation(int seconds);
+
     // Instance method to set certificate paths for this tunnel
     bool setCertificates(const string &certPath, const string &keyPath);
 
 private:
-    // Initializes the SSL context with proper settings
+    // Takes a reference to the shared SSL context for this transport, building it on first use
     bool init_ssl_ctx();
 
+    // Creates an SSL context with proper settings, reading the certificate and key files
+    static SSL_CTX *build_context(bool datagram);
+
+    // Maps a failed SSL_read to the receive() result, recording what it waits for
+    ssize_t receive_failed(int n);
+
     // Establishes the TCP connection to remote host
     bool open_connection(const string &hostname, const string &port);
 
+    // Datagram server: gives the client accepted on listen_fd a socket of its own,
+    // connected to it, for the rest of the handshake. Returns 1, or -1 on failure
+    int connect_datagram(int listen_fd, const BIO_ADDR *client, string &peer);
+
+    // Client: sets up the SSL side of the connection on socket_fd, offering the session
+    // cached under key
+    bool prepare_client(const string &key);
+    // Client: the handshake completed
+    void client_connected();
+
     // Displays SSL certificate information for debugging
     void display_certificates();
 
+    // Records which directions OpenSSL handed to the kernel during the handshake
+    void detect_ktls();
+
+    // Server: seals and opens session tickets with the shared rotating keys
+    static int ticket_key_callback(SSL *ssl, unsigned char *name, unsigned char *iv,
+                                   EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc);
+    // Client: stores a session the server issued a ticket for in the session cache
+    static int remember_session(SSL *ssl, SSL_SESSION *session);
+
+    // What a non-blocking SSL call is waiting for before it can be retried
+    enum IoWait
+    {
+        WAIT_NONE,
+        WAIT_READ,  // SSL_ERROR_WANT_READ
+        WAIT_WRITE, // SSL_ERROR_WANT_WRITE
+    };
+
     // SSL context for the connection
     SSL_CTX *ctx;
     // SSL connection instance
@@ -64,10 +202,34 @@ private:
     int socket_fd;
     // Connection state flag
     bool connected;
+    // DTLS over UDP instead of TLS over TCP
+    bool datagram;
+    // The kernel encrypts sent / decrypts received records (kTLS)
+    bool ktls_tx;
+    bool ktls_rx;
+
+    // Client: "host:port" the session cache entry for this connection is filed under
+    string session_key;
+
+    // Outbound bytes not yet accepted by SSL_write, from send_head to send_tail
+    vector<char> send_buffer;
+    size_t send_head;
+    size_t send_tail;
+    // Length of an SSL_write that must be retried with the same arguments (0 if none)
+    size_t send_retry;
+    IoWait send_wait;
+    IoWait receive_wait;
+    IoWait handshake_wait;
 
     // Static paths for SSL certificates
     static string certificatePath;
     static string privateKeyPath;
+    // Whether new TCP tunnels ask OpenSSL for kTLS
+    static bool kernelTls;
+    // Session ticket key lifetime on the server (seconds, 0 = no tickets)
+    static int ticketRotation;
+    // Cipher suites and key exchange groups
+    static CipherPolicy cipherPolicy;
 
     // Delete copy constructor and assignment operator to prevent copying
     Tunnel(const Tunnel &) = delete;